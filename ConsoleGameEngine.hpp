@@ -83,14 +83,57 @@
 #define _UNICODE
 #endif
 
+#ifdef CONSOLE_GAME_ENGINE_STREAMING
+// Has to come before Windows.h so the old winsock.h isn't pulled in, AF_UNIX needs Windows 10 1803
+#include <winsock2.h>
+#include <afunix.h>
+#pragma comment(lib, "ws2_32.lib")
+#endif
+
 #include <Windows.h>
 #include <vector>
+#include <new>
+#include <cstdlib>
 #include <chrono>
 #include <cmath>
 #include <thread>
 #include <string>
+#include <string_view>
 #include <atomic>
 #include <fstream>
+#include <cstdint>
+#include <cstddef>
+#include <climits>
+#include <cfloat>
+#include <algorithm>
+#include <cstdarg>
+#include <cwchar>
+#include <cwctype>
+#include <mutex>
+#include <condition_variable>
+#include <unordered_map>
+#include <functional>
+#include <type_traits>
+#include <memory>
+
+#if __has_include(<version>)
+#include <version>
+#endif
+
+// MSVC ships <format> in C++17 mode too but warns when it's included there
+#ifdef __cpp_lib_format
+#include <format>
+#endif
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#define CONSOLE_GAME_ENGINE_COROUTINES
+#include <coroutine>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define CONSOLE_GAME_ENGINE_SSE2
+#include <emmintrin.h>
+#endif
 
 #pragma comment(lib, "winmm.lib")
 
@@ -153,6 +196,64 @@ enum CommonLvb : unsigned short
 	CL_UNDERSCORE = 0x8000
 };
 
+// Extended cell colours are only used by VT terminals (see EnableTrueColour),
+// the high byte of a packed colour tells how the low 24 bits are interpreted
+enum ExtendedColourKind : uint32_t
+{
+	EXT_COLOUR_NONE = 0x00000000, // use the FG_/BG_ bits of the cell attribute
+	EXT_COLOUR_RGB = 0x01000000, // 0x01RRGGBB
+	EXT_COLOUR_INDEXED = 0x02000000 // 0x020000NN, index into the 256-colour palette
+};
+
+constexpr uint32_t ColourRGB(uint8_t r, uint8_t g, uint8_t b)
+{
+	return EXT_COLOUR_RGB | ((uint32_t)r << 16) | ((uint32_t)g << 8) | (uint32_t)b;
+}
+
+constexpr uint32_t Colour256(uint8_t index)
+{
+	return EXT_COLOUR_INDEXED | (uint32_t)index;
+}
+
+struct CellColour
+{
+	uint32_t fg;
+	uint32_t bg;
+};
+
+// How well the console keeps up with the frames the game produces, see ConsoleGameEngine::GetPresentStats
+struct PresentStats
+{
+	// Seconds, smoothed over the last frames
+	float fPresentTime = 0.0f;
+	float fFrameTime = 0.0f;
+
+	uint64_t nPresented = 0;
+
+	// Frames replaced by a newer one before the console got to show them
+	uint64_t nCoalesced = 0;
+
+	// Set while writing a whole frame takes longer than the game takes to make one
+	bool bBackpressure = false;
+
+	// Below the screen height while presentation is degraded
+	int nRowsPerPresent = 0;
+};
+
+// Heap traffic of the last frame, see ConsoleGameEngine::GetAllocationStats
+struct AllocationStats
+{
+	// Only counted when the implementation is compiled with CONSOLE_GAME_ENGINE_COUNT_ALLOCATIONS,
+	// and only what the game thread itself allocates and frees. The present, recorder, watcher
+	// and server threads aren't included
+	uint64_t nAllocations = 0;
+	uint64_t nFrees = 0;
+	uint64_t nBytes = 0;
+
+	// Bytes taken from the frame arena
+	size_t nArenaBytes = 0;
+};
+
 struct KeyState
 {
 	bool bHeld;
@@ -187,851 +288,9029 @@ public:
 	wchar_t GetGlyph(int x, int y);
 	short GetColour(int x, int y);
 
+	// Raw row-major cell data for blitters that do their own bounds checks
+	const wchar_t* GlyphData() const;
+	const short* ColourData() const;
+
 	bool Save(const std::wstring& sFileName);
+
+	// Leaves the sprite as it was if the file can't be read completely
 	bool Load(const std::wstring& sFileName);
-};
 
-enum ErrorCode
-{
-	RC_OK,
-	RC_INVALID_SCREEN_SIZE,
-	RC_INVALID_SCREEN_BUFFER,
-	RC_INVALID_FONT,
-	RC_INVALID_CONSOLE_MODE,
-	RC_INVALID_SCREEN_INFO,
+	// Exchanges size and cells with the other sprite without copying them
+	void Swap(Sprite& other);
+
+	// Writes a C++ header defining the sprite as an EmbeddedSprite called sName, e.g. to embed a .spr file
+	bool SaveHeader(const std::wstring& sFileName, const std::string& sName) const;
 };
 
-class ConsoleGameEngine
+// Read-only view of sprite cells that doesn't own them, so it can point at a Sprite
+// or at an EmbeddedSprite in static storage and be copied around freely
+class SpriteView
 {
 public:
-	ConsoleGameEngine();
-	virtual ~ConsoleGameEngine();
-
-public:
-	virtual bool OnUserCreate() = 0;
-	virtual bool OnUserUpdate(float fDeltaTime) = 0;
-
-	ErrorCode ConstructConsole(int nWidth = 120, int nHeight = 40, int nFontWidth = 4, int nFontHeight = 4);
-	void Run();
-
-public:
-	bool MakeSound(const std::wstring& sFilename, bool bLoop);
-	bool IsFocused();
-
-	virtual void Draw(int x, int y, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void DrawRectangle(int x, int y, int sx, int sy, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void FillRectangle(int x, int y, int sx, int sy, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void DrawCircle(int x, int y, int r, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void FillCircle(int x, int y, int r, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void DrawTriangle(int x1, int y1, int x2, int y2, int x3, int y3, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void FillTriangle(int x1, int y1, int x2, int y2, int x3, int y3, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void DrawLine(int x1, int y1, int x2, int y2, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void DrawSprite(int x, int y, Sprite* sprite);
-	virtual void DrawSpriteAlpha(int x, int y, Sprite* sprite);
-	virtual void DrawPartialSprite(int x, int y, int fx, int fy, int fw, int fh, Sprite* sprite);
-	virtual void DrawPartialSpriteAlpha(int x, int y, int fx, int fy, int fw, int fh, Sprite* sprite);
-	virtual void DrawWireFrameModel(const std::vector<std::pair<float, float>>& model, float x, float y, float r, float s, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-	virtual void DrawString(int x, int y, const std::wstring& text, short col = FG_WHITE);
-	virtual void Clear(wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
-
-	int GetMouseX() const;
-	int GetMouseY() const;
-
-	const KeyState& GetMouse(short button) const;
-	const KeyState& GetKey(short key) const;
-
-	int ScreenWidth() const;
-	int ScreenHeight() const;
+	constexpr SpriteView() = default;
 
-private:
-	void AppThread();
+	constexpr SpriteView(int nWidth, int nHeight, const wchar_t* pGlyphs, const short* pColours)
+		: m_pGlyphs(pGlyphs), m_pColours(pColours), nWidth(nWidth), nHeight(nHeight)
+	{
+	}
 
-protected:
-	std::wstring sAppName;
-	std::wstring sFont;
+	SpriteView(const Sprite& sprite)
+		: SpriteView(sprite.nWidth, sprite.nHeight, sprite.GlyphData(), sprite.ColourData())
+	{
+	}
 
 private:
-	CHAR_INFO* m_pScreen = nullptr;
-	HANDLE m_hConsoleOut;
-	HANDLE m_hConsoleIn;
-	SMALL_RECT m_rWindow;
-	HWND m_hWindow;
-	HDC m_hDrawContext;
+	const wchar_t* m_pGlyphs = nullptr;
+	const short* m_pColours = nullptr;
 
-	KeyState m_aryKeys[256];
-	KeyState m_aryMouse[5];
+public:
+	int nWidth = 0;
+	int nHeight = 0;
 
-	short m_nKeyOldState[256];
-	short m_nKeyNewState[256];
+public:
+	constexpr wchar_t GetGlyph(int x, int y) const
+	{
+		return x >= 0 && x < nWidth && y >= 0 && y < nHeight ? m_pGlyphs[y * nWidth + x] : L' ';
+	}
 
-	bool m_bMouseOldState[5]{ false };
-	bool m_bMouseNewState[5]{ false };
+	constexpr short GetColour(int x, int y) const
+	{
+		return x >= 0 && x < nWidth && y >= 0 && y < nHeight ? m_pColours[y * nWidth + x] : short(FG_BLACK);
+	}
 
-	int m_nMouseX;
-	int m_nMouseY;
+	constexpr const wchar_t* GlyphData() const { return m_pGlyphs; }
+	constexpr const short* ColourData() const { return m_pColours; }
+};
 
-	int m_nScreenWidth;
-	int m_nScreenHeight;
+// Sprite cells stored inline, meant to be declared static constexpr (or inline constexpr at namespace
+// scope) so they live in the binary and views of them need no allocation or file I/O
+template <int W, int H>
+struct EmbeddedSprite
+{
+	static_assert(W > 0 && H > 0, "Sprite size must be positive");
 
-	int m_nFontWidth;
-	int m_nFontHeight;
+	wchar_t glyphs[W * H] = {};
+	short colours[W * H] = {};
 
-	float m_fDeltaTime;
+	constexpr SpriteView View() const
+	{
+		return SpriteView(W, H, glyphs, colours);
+	}
 
-	std::thread m_thrGame;
-	std::atomic<bool> m_bGameThreadActive;
-	bool m_bFocused = true;
+	constexpr operator SpriteView() const
+	{
+		return View();
+	}
 };
 
-#ifdef CONSOLE_GAME_ENGINE_IMPLEMENTATION
-#undef CONSOLE_GAME_ENGINE_IMPLEMENTATION
-
-Sprite::Sprite()
+namespace detail
 {
-	Create(8, 8);
+	constexpr short HexColour(wchar_t c)
+	{
+		if (c >= L'0' && c <= L'9') return short(c - L'0');
+		if (c >= L'A' && c <= L'F') return short(c - L'A' + 10);
+		if (c >= L'a' && c <= L'f') return short(c - L'a' + 10);
+		return -1;
+	}
 }
 
-Sprite::Sprite(int nWidth, int nHeight)
+// Builds a sprite at compile time from rows of string art, W * H characters in total:
+//   static constexpr auto sprShip = SpriteFromArt<5, 3>(
+//       L"  F  "
+//       L" FFF "
+//       L"F4F4F");
+// Hex digits are PIXEL_SOLID cells of that colour, anything else is a transparent L' ' cell
+template <int W, int H, size_t N>
+constexpr EmbeddedSprite<W, H> SpriteFromArt(const wchar_t (&sArt)[N])
 {
-	Create(nWidth, nHeight);
-}
+	static_assert(N - 1 == size_t(W * H), "Art must have exactly W * H characters");
 
-Sprite::Sprite(const std::wstring& sFileName)
-{
-	if (!Load(sFileName))
-		Create(8, 8);
-}
+	EmbeddedSprite<W, H> sprite;
 
-Sprite::~Sprite()
-{
-	if (m_pGlyphs)
-		delete[] m_pGlyphs;
+	for (int i = 0; i < W * H; i++)
+	{
+		short col = detail::HexColour(sArt[i]);
 
-	if (m_pColours)
-		delete[] m_pColours;
+		sprite.glyphs[i] = col >= 0 ? wchar_t(PIXEL_SOLID) : L' ';
+		sprite.colours[i] = col >= 0 ? col : short(FG_BLACK);
+	}
+
+	return sprite;
 }
 
-void Sprite::Create(int nWidth, int nHeight)
+// Same as above with the glyphs given literally and a hex digit colour per cell alongside them
+template <int W, int H, size_t N, size_t M>
+constexpr EmbeddedSprite<W, H> SpriteFromArt(const wchar_t (&sGlyphs)[N], const wchar_t (&sColours)[M])
 {
-	this->nWidth = nWidth;
-	this->nHeight = nHeight;
+	static_assert(N - 1 == size_t(W * H) && M - 1 == size_t(W * H), "Art must have exactly W * H characters");
 
-	m_pGlyphs = new wchar_t[nWidth * nHeight];
-	m_pColours = new short[nWidth * nHeight];
+	EmbeddedSprite<W, H> sprite;
 
-	for (int i = 0; i < nWidth * nHeight; i++)
+	for (int i = 0; i < W * H; i++)
 	{
-		m_pGlyphs[i] = L' ';
-		m_pColours[i] = FG_BLACK;
-	}
-}
+		short col = detail::HexColour(sColours[i]);
 
-void Sprite::SetGlyph(int x, int y, wchar_t c)
-{
-	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
-		m_pGlyphs[y * nWidth + x] = c;
-}
+		sprite.glyphs[i] = sGlyphs[i];
+		sprite.colours[i] = col >= 0 ? col : short(FG_BLACK);
+	}
 
-void Sprite::SetColour(int x, int y, short c)
-{
-	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
-		m_pColours[y * nWidth + x] = c;
+	return sprite;
 }
 
-wchar_t Sprite::GetGlyph(int x, int y)
+// Prefiltered half-size copies of a sprite for drawing it shrunk. Each cell of a level is the most common
+// visible cell of a 2x2 block of the level above, or blank when less than half of the block is visible,
+// so thin details survive downscaling instead of being skipped by point sampling
+class SpriteMips
 {
-	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
-		return m_pGlyphs[y * nWidth + x];
+public:
+	SpriteMips(const SpriteView& sprite);
 
-	return L' ';
-}
+private:
+	struct MipLevel
+	{
+		int nWidth = 0;
+		int nHeight = 0;
+		std::vector<wchar_t> vecGlyphs;
+		std::vector<short> vecColours;
+	};
 
-short Sprite::GetColour(int x, int y)
-{
-	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
-		return m_pColours[y * nWidth + x];
+	std::vector<MipLevel> m_vecLevels;
 
-	return FG_BLACK;
-}
+public:
+	// Level 0 is a copy of the sprite, the last level is 1x1
+	int Levels() const;
+	SpriteView Level(int nLevel) const;
+};
 
-bool Sprite::Save(const std::wstring& sFileName)
+// Sprite storing one byte per cell, an index into up to 256 glyph/colour pairs of its own palette.
+// Meant for big sprites made of few distinct cells, e.g. world maps, which take 4 to 6 times less memory than a Sprite
+class IndexedSprite
 {
-	std::ofstream file(sFileName, std::ios::binary);
+public:
+	IndexedSprite();
+	IndexedSprite(int nWidth, int nHeight);
 
-	if (!file.is_open())
-		return false;
+	static constexpr int MAX_PALETTE_SIZE = 256;
 
-	auto write = [&](void* data, std::streamsize bytes)
-		{
-			file.write(reinterpret_cast<const char*>(data), bytes);
-			return !file.bad();
-		};
+private:
+	std::vector<uint8_t> m_vecIndices;
+	std::vector<CHAR_INFO> m_vecPalette;
 
-	//file.exceptions(std::ostream::failbit | std::ostream::badbit);
+public:
+	int nWidth = 0;
+	int nHeight = 0;
 
-	if (!write(&nWidth, sizeof(int))) return false;
-	if (!write(&nHeight, sizeof(int))) return false;
+public:
+	// Converts a sprite, fails and leaves this one unchanged if it has more than 256 distinct cells
+	bool FromSprite(const SpriteView& sprite);
 
-	std::streamsize nSize = nWidth * nHeight;
+	// Index of the pair in the palette, which is added if missing. -1 when the palette is full
+	int PaletteIndex(wchar_t c, short col);
 
-	if (!write(m_pGlyphs, nSize * sizeof(wchar_t))) return false;
-	if (!write(m_pColours, nSize * sizeof(short))) return false;
+	// Fails when the palette is full and doesn't have the pair yet
+	bool SetCell(int x, int y, wchar_t c, short col);
+	void SetIndex(int x, int y, uint8_t nIndex);
 
-	file.close();
+	wchar_t GetGlyph(int x, int y) const;
+	short GetColour(int x, int y) const;
+	uint8_t GetIndex(int x, int y) const;
 
-	return true;
-}
+	int PaletteSize() const;
+	const CHAR_INFO* PaletteData() const;
+	const uint8_t* IndexData() const;
+};
 
-bool Sprite::Load(const std::wstring& sFileName)
+// Maps 0xRRGGBB pixels to the closest glyph/attribute pair made of a shade glyph
+// and two palette colours, using a 32x32x32 lookup table built once on construction
+class ColourQuantizer
 {
-	if (m_pGlyphs)
-		delete[] m_pGlyphs;
+public:
+	ColourQuantizer(const uint32_t* pPalette = nullptr);
 
-	if (m_pColours)
-		delete[] m_pColours;
+public:
+	static const uint32_t DefaultPalette[16];
 
-	std::ifstream file(sFileName, std::ios::binary);
+	// nDitherAmount is the peak-to-peak strength of the 4x4 ordered dither in 0..255 units,
+	// nOriginX and nOriginY anchor the dither pattern so it doesn't crawl when drawing at an offset
+	void Convert(const uint32_t* pSrc, int nWidth, int nHeight, int nSrcStride,
+		CHAR_INFO* pDst, int nDstStride, int nOriginX = 0, int nOriginY = 0, int nDitherAmount = 0) const;
 
-	if (!file.is_open())
-		return false;
+	CHAR_INFO Quantize(uint32_t rgb) const;
 
-	auto read = [&](void* data, int bytes)
-		{
-			file.read(reinterpret_cast<char*>(data), bytes);
-			return !file.bad();
-		};
+private:
+	static const int LUT_BITS = 5;
+	static const int LUT_SIZE = 1 << (LUT_BITS * 3);
 
-	if (!read(&nWidth, sizeof(int))) return false;
-	if (!read(&nHeight, sizeof(int))) return false;
-	 
-	Create(nWidth, nHeight);
+	std::vector<CHAR_INFO> m_vecLut;
+};
 
-	std::streamsize nSize = nWidth * nHeight;
+// Uniform grid over console cell coordinates. Objects are identified by the caller's own
+// non-negative ids (e.g. indices into the app's object array) and bucketed by their top-left cell,
+// so moving within a bucket is just a store and moving across buckets is an O(1) relink.
+// Queries widen their search by the largest object in the grid and then test exact bounds.
+// Culling before drawing:
+//	grid.QueryRect(nCameraX, nCameraY, ScreenWidth(), ScreenHeight(), [&](int id) { DrawSprite(...); });
+class SpatialGrid
+{
+public:
+	SpatialGrid(int nWorldWidth, int nWorldHeight, int nBucketSize = 8);
 
-	if (!read(m_pGlyphs, nSize * sizeof(wchar_t))) return false;
-	if (!read(m_pColours, nSize * sizeof(short))) return false;
+public:
+	void Insert(int nId, int x, int y, int w = 1, int h = 1);
+	void Move(int nId, int x, int y);
+	void Move(int nId, int x, int y, int w, int h);
+	void Remove(int nId);
+	void Clear();
 
-	file.close();
+	bool Contains(int nId) const;
+	int Count() const;
 
-	return true;
-}
+	template <class F>
+	void QueryRect(int x, int y, int w, int h, F&& callback) const
+	{
+		if (w <= 0 || h <= 0)
+			return;
 
-ConsoleGameEngine::ConsoleGameEngine()
-{
-	m_hConsoleOut = GetStdHandle(STD_OUTPUT_HANDLE);
-	m_hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+		int bx1 = BucketX(x - m_nMaxWidth + 1), bx2 = BucketX(x + w - 1);
+		int by1 = BucketY(y - m_nMaxHeight + 1), by2 = BucketY(y + h - 1);
 
-	m_hWindow = GetConsoleWindow();
-	m_hDrawContext = GetDC(m_hWindow);
+		for (int by = by1; by <= by2; by++)
+			for (int bx = bx1; bx <= bx2; bx++)
+				for (int i = m_vecHeads[by * m_nBucketsX + bx]; i != NONE; i = m_vecNext[i])
+				{
+					const Bounds& b = m_vecBounds[i];
 
-	sAppName = L"Undefined";
-	sFont = L"Consolas";
-}
+					if (b.x < x + w && b.x + b.w > x && b.y < y + h && b.y + b.h > y)
+						callback(i);
+				}
+	}
 
-ConsoleGameEngine::~ConsoleGameEngine()
-{
-	delete[] m_pScreen;
-}
+	// Objects whose bounds intersect the circle
+	template <class F>
+	void QueryRadius(int cx, int cy, int r, F&& callback) const
+	{
+		QueryRect(cx - r, cy - r, 2 * r + 1, 2 * r + 1, [&](int i)
+			{
+				const Bounds& b = m_vecBounds[i];
 
-ErrorCode ConsoleGameEngine::ConstructConsole(int nWidth, int nHeight, int nFontWidth, int nFontHeight)
-{
-	if (nWidth <= 0 || nHeight <= 0 || nFontWidth <= 0 || nFontHeight <= 0)
-		return RC_INVALID_SCREEN_SIZE;
+				int dx = std::max(b.x - cx, std::max(0, cx - (b.x + b.w - 1)));
+				int dy = std::max(b.y - cy, std::max(0, cy - (b.y + b.h - 1)));
 
-	m_nScreenWidth = nWidth;
-	m_nScreenHeight = nHeight;
+				if (dx * dx + dy * dy <= r * r)
+					callback(i);
+			});
+	}
 
-	m_nFontWidth = nFontWidth;
-	m_nFontHeight = nFontHeight;
+	template <class F>
+	void QueryCell(int x, int y, F&& callback) const
+	{
+		QueryRect(x, y, 1, 1, std::forward<F>(callback));
+	}
 
-	m_hConsoleOut = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
+	void QueryRect(int x, int y, int w, int h, std::vector<int>& vecOut) const;
+	void QueryRadius(int cx, int cy, int r, std::vector<int>& vecOut) const;
+	void QueryCell(int x, int y, std::vector<int>& vecOut) const;
 
-	if (m_hConsoleOut == INVALID_HANDLE_VALUE)
-		return RC_INVALID_SCREEN_BUFFER;
+private:
+	struct Bounds
+	{
+		int x, y, w, h;
+	};
 
-	m_rWindow = { 0, 0, 1, 1 };
-	SetConsoleWindowInfo(m_hConsoleOut, TRUE, &m_rWindow);
+	static constexpr int NONE = -1;
 
-	COORD coord = { (short)m_nScreenWidth, (short)m_nScreenHeight };
+	int BucketX(int x) const { return std::min(std::max(x, 0), m_nWorldWidth - 1) / m_nBucketSize; }
+	int BucketY(int y) const { return std::min(std::max(y, 0), m_nWorldHeight - 1) / m_nBucketSize; }
 
-	if (!SetConsoleScreenBufferSize(m_hConsoleOut, coord))  return RC_INVALID_SCREEN_SIZE;
-	if (!SetConsoleActiveScreenBuffer(m_hConsoleOut))		return RC_INVALID_SCREEN_BUFFER;
+	void Link(int nId, int nBucket);
+	void Unlink(int nId);
 
-	CONSOLE_FONT_INFOEX cfi;
-	cfi.cbSize = sizeof(cfi);
-	cfi.nFont = 0;
-	cfi.dwFontSize.X = m_nFontWidth;
-	cfi.dwFontSize.Y = m_nFontHeight;
-	cfi.FontFamily = FF_DONTCARE;
-	cfi.FontWeight = FW_NORMAL;
+	// Keep m_nMaxWidth and m_nMaxHeight at the largest extents of the objects in the grid
+	void AddExtent(int w, int h);
+	void RemoveExtent(int w, int h);
 
-	wcscpy_s(cfi.FaceName, sFont.c_str());
-	if (!SetCurrentConsoleFontEx(m_hConsoleOut, false, &cfi))
-		return RC_INVALID_FONT;
+	int m_nWorldWidth;
+	int m_nWorldHeight;
+	int m_nBucketSize;
+	int m_nBucketsX;
+	int m_nBucketsY;
 
-	if (!SetConsoleMode(m_hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
-		return RC_INVALID_CONSOLE_MODE;
+	int m_nMaxWidth = 1;
+	int m_nMaxHeight = 1;
+	int m_nCount = 0;
 
-	CONSOLE_SCREEN_BUFFER_INFO csbi;
-	if (!GetConsoleScreenBufferInfo(m_hConsoleOut, &csbi))
-		return RC_INVALID_SCREEN_INFO;
+	// Number of objects of each width and height, so the widening shrinks again once the largest leaves
+	std::vector<int> m_vecWidthCount;
+	std::vector<int> m_vecHeightCount;
 
-	if (m_nScreenHeight > csbi.dwMaximumWindowSize.Y)
-		return RC_INVALID_SCREEN_SIZE;
+	std::vector<int> m_vecHeads;
 
-	if (m_nScreenWidth > csbi.dwMaximumWindowSize.X)
-		return RC_INVALID_SCREEN_SIZE;
+	// Indexed by object id
+	std::vector<Bounds> m_vecBounds;
+	std::vector<int> m_vecBucket;
+	std::vector<int> m_vecNext;
+	std::vector<int> m_vecPrev;
+};
 
-	m_rWindow = { 0, 0, short(m_nScreenWidth - 1), short(m_nScreenHeight - 1) };
-	SetConsoleWindowInfo(m_hConsoleOut, TRUE, &m_rWindow);
+// Fixed set of worker threads for data-parallel loops, the calling thread takes part in the work too
+class ThreadPool
+{
+public:
+	// A negative count uses one worker less than the number of hardware threads
+	ThreadPool(int nWorkers = -1);
+	~ThreadPool();
 
-	m_pScreen = new CHAR_INFO[m_nScreenWidth * m_nScreenHeight]{ 0 };
+	ThreadPool(const ThreadPool&) = delete;
+	ThreadPool& operator=(const ThreadPool&) = delete;
 
-	return RC_OK;
-}
+public:
+	// Number of threads that run a ParallelFor including the caller
+	int ThreadCount() const;
 
-void ConsoleGameEngine::Run()
-{
-	m_bGameThreadActive = true;
+	// Calls f(nFrom, nTo) for consecutive ranges of at most nGrain items and returns once all of them are done.
+	// Calls made from inside a running job are executed serially on the calling thread
+	template <class F>
+	void ParallelFor(size_t nBegin, size_t nEnd, size_t nGrain, F&& f)
+	{
+		auto pFunc = &f;
 
-	m_thrGame = std::thread(&ConsoleGameEngine::AppThread, this);
+		Dispatch(nBegin, nEnd, nGrain, (void*)pFunc, [](void* pData, size_t nFrom, size_t nTo)
+			{
+				(*static_cast<decltype(pFunc)>(pData))(nFrom, nTo);
+			});
+	}
 
-	if (m_thrGame.joinable())
-		m_thrGame.join();
-}
+private:
+	void Dispatch(size_t nBegin, size_t nEnd, size_t nGrain, void* pData, void (*pInvoke)(void*, size_t, size_t));
+	void WorkerThread();
+	void Work();
 
-bool ConsoleGameEngine::MakeSound(const std::wstring& sFilename, bool bLoop)
-{
-	DWORD f = SND_ASYNC | SND_FILENAME;
+	static bool& InsideJob();
 
-	if (bLoop)
-		f |= SND_LOOP;
+	std::vector<std::thread> m_vecWorkers;
 
-	return PlaySoundW(sFilename.c_str(), NULL, f);
-}
+	std::mutex m_muxDispatch;
+	std::mutex m_muxState;
+	std::condition_variable m_cvWork;
+	std::condition_variable m_cvDone;
 
-bool ConsoleGameEngine::IsFocused()
+	uint64_t m_nGeneration = 0;
+	int m_nActive = 0;
+	bool m_bQuit = false;
+
+	void* m_pJobData = nullptr;
+	void (*m_pJobInvoke)(void*, size_t, size_t) = nullptr;
+	size_t m_nJobEnd = 0;
+	size_t m_nJobGrain = 1;
+	std::atomic<size_t> m_nJobNext{ 0 };
+};
+
+// Generational handle, stays valid for as long as the entity lives no matter how its components change
+struct Entity
 {
-	return m_bFocused;
-}
+	uint32_t nIndex = 0xFFFFFFFF;
+	uint32_t nGeneration = 0;
 
-void ConsoleGameEngine::Draw(int x, int y, wchar_t c, short col)
+	bool operator==(const Entity& e) const { return nIndex == e.nIndex && nGeneration == e.nGeneration; }
+	bool operator!=(const Entity& e) const { return !(*this == e); }
+};
+
+// Archetype based entity/component storage. Entities with the same set of components share an
+// archetype that keeps one tightly packed array per component type, so systems stream through
+// plain arrays instead of chasing pointers. Components must be trivially copyable because rows are
+// moved with memcpy when an entity gains or loses a component, and at most MAX_COMPONENTS distinct
+// component types can be used per program. Don't add, remove or destroy while iterating.
+class EntityWorld
 {
-	if (x >= 0 && x < m_nScreenWidth && y >= 0 && y < m_nScreenHeight)
+public:
+	static constexpr int MAX_COMPONENTS = 64;
+
+	EntityWorld();
+	~EntityWorld();
+
+	EntityWorld(const EntityWorld&) = delete;
+	EntityWorld& operator=(const EntityWorld&) = delete;
+
+public:
+	Entity Create();
+	void Destroy(Entity e);
+	bool IsAlive(Entity e) const;
+	size_t Count() const;
+
+	template <class... C>
+	Entity Create(const C&... components)
 	{
-		m_pScreen[y * m_nScreenWidth + x].Char.UnicodeChar = c;
-		m_pScreen[y * m_nScreenWidth + x].Attributes = col;
+		Entity e = Create();
+
+		(Register<C>(), ...);
+		MoveTo(e.nIndex, GetArchetype((Bit<C>() | ...)));
+		((*Column<C>(m_vecRecords[e.nIndex].pArchetype, m_vecRecords[e.nIndex].nRow) = components), ...);
+
+		return e;
 	}
-}
 
-void ConsoleGameEngine::FillRectangle(int x, int y, int sx, int sy, wchar_t c, short col)
-{
-	for (int i = 0; i <= sx; i++)
-		for (int j = 0; j <= sy; j++)
-			Draw(x + i, y + j, c, col);
-}
+	// Adding to a dead entity only writes the returned throwaway component
+	template <class C>
+	C& Add(Entity e, const C& component = C())
+	{
+		if (!IsAlive(e))
+		{
+			static thread_local C dead{ component };
+			return dead = component;
+		}
 
-void ConsoleGameEngine::DrawCircle(int x, int y, int r, wchar_t c, short col)
-{
-	if (r <= 0)
-		return;
+		Register<C>();
 
-	int x1 = 0;
-	int y1 = r;
-	int p = 3 - 2 * r;
+		if (C* pExisting = Get<C>(e))
+			return *pExisting = component;
 
-	while (y1 >= x1)
+		Record& r = m_vecRecords[e.nIndex];
+		MoveTo(e.nIndex, GetArchetype(r.pArchetype->nMask | Bit<C>()));
+
+		return *Column<C>(r.pArchetype, r.nRow) = component;
+	}
+
+	template <class C>
+	void Remove(Entity e)
 	{
-		Draw(x - x1, y - y1, c, col);
-		Draw(x - y1, y - x1, c, col);
-		Draw(x + y1, y - x1, c, col);
-		Draw(x + x1, y - y1, c, col);
-		Draw(x - x1, y + y1, c, col);
-		Draw(x - y1, y + x1, c, col);
-		Draw(x + y1, y + x1, c, col);
-		Draw(x + x1, y + y1, c, col);
+		if (Has<C>(e))
+			MoveTo(e.nIndex, GetArchetype(m_vecRecords[e.nIndex].pArchetype->nMask & ~Bit<C>()));
+	}
 
-		if (p < 0)
-			p += 4 * x1++ + 6;
-		else
-			p += 4 * (x1++ - y1--) + 10;
+	template <class C>
+	bool Has(Entity e) const
+	{
+		return IsAlive(e) && (m_vecRecords[e.nIndex].pArchetype->nMask & Bit<C>()) != 0;
 	}
-}
 
-void ConsoleGameEngine::FillCircle(int x, int y, int r, wchar_t c, short col)
-{
-	if (r <= 0)
-		return;
+	template <class C>
+	C* Get(Entity e)
+	{
+		if (!Has<C>(e))
+			return nullptr;
 
-	int x1 = 0;
-	int y1 = r;
-	int p = 3 - 2 * r;
+		return Column<C>(m_vecRecords[e.nIndex].pArchetype, m_vecRecords[e.nIndex].nRow);
+	}
 
-	auto drawline = [&](int sx, int ex, int ny)
-		{
-			for (int i = sx; i <= ex; i++)
-				Draw(i, ny, c, col);
-		};
+	// Calls f(C&...) or f(Entity, C&...) for every entity that has all of the components
+	template <class... C, class F>
+	void Each(F&& f)
+	{
+		ForEachArchetype<C...>([&](Archetype* a)
+			{
+				RunRows(f, a->vecEntities.data(), 0, a->vecEntities.size(), Column<C>(a, 0)...);
+			});
+	}
 
-	while (y1 >= x1)
+	// Calls f(nCount, C*...) once per matching archetype with pointers to its packed columns,
+	// handy for SIMD loops
+	template <class... C, class F>
+	void EachChunk(F&& f)
 	{
-		drawline(x - x1, x + x1, y - y1);
-		drawline(x - y1, x + y1, y - x1);
-		drawline(x - x1, x + x1, y + y1);
-		drawline(x - y1, x + y1, y + x1);
+		ForEachArchetype<C...>([&](Archetype* a)
+			{
+				f(a->vecEntities.size(), Column<C>(a, 0)...);
+			});
+	}
 
-		if (p < 0)
-			p += 4 * x1++ + 6;
-		else
-			p += 4 * (x1++ - y1--) + 10;
+	// Same as Each but the rows of every archetype are split across the pool, so f must not
+	// touch anything another row may be writing to
+	template <class... C, class F>
+	void EachParallel(ThreadPool& pool, F&& f, size_t nGrain = 4096)
+	{
+		ForEachArchetype<C...>([&](Archetype* a)
+			{
+				pool.ParallelFor(0, a->vecEntities.size(), nGrain, [&](size_t nFrom, size_t nTo)
+					{
+						RunRows(f, a->vecEntities.data(), nFrom, nTo, Column<C>(a, 0)...);
+					});
+			});
 	}
-}
 
-void ConsoleGameEngine::DrawLine(int x1, int y1, int x2, int y2, wchar_t c, short col)
-{
-	int x, y, xe, ye;
+	template <class C>
+	static uint32_t ComponentId()
+	{
+		static_assert(std::is_trivially_copyable<C>::value, "components must be trivially copyable");
+		static_assert(alignof(C) <= alignof(std::max_align_t), "over-aligned components aren't supported");
 
-	int dx = x2 - x1;
-	int dy = y2 - y1;
+		static const uint32_t nId = NextComponentId();
+		return nId;
+	}
 
-	int dx1 = abs(dx);
-	int dy1 = abs(dy);
+private:
+	struct ComponentColumn
+	{
+		uint32_t nComponent;
+		uint32_t nElementSize;
+		std::vector<uint8_t> vecData;
+	};
 
-	int px = 2 * dy1 - dx1;
-	int py = 2 * dx1 - dy1;
+	struct Archetype
+	{
+		uint64_t nMask = 0;
+		int8_t nColumnOf[MAX_COMPONENTS];
+		std::vector<ComponentColumn> vecColumns;
+		std::vector<Entity> vecEntities;
+	};
 
-	if (dy1 <= dx1)
+	struct Record
 	{
-		if (dx >= 0)
-		{
-			x = x1;
-			y = y1;
-			xe = x2;
-		}
-		else
-		{
-			x = x2;
-			y = y2;
-			xe = x1;
-		}
+		Archetype* pArchetype = nullptr;
+		uint32_t nRow = 0;
+		uint32_t nGeneration = 0;
+	};
 
-		Draw(x, y, c, col);
+	static uint32_t NextComponentId();
 
-		for (int i = 0; x < xe; i++)
-		{
-			x++;
+	template <class C>
+	static uint64_t Bit()
+	{
+		return uint64_t(1) << ComponentId<C>();
+	}
 
-			if (px < 0)
-				px = px + 2 * dy1;
-			else
-			{
-				y += ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) ? 1 : -1;
-				px = px + 2 * (dy1 - dx1);
-			}
+	template <class C>
+	void Register()
+	{
+		m_nComponentSize[ComponentId<C>()] = sizeof(C);
+	}
 
-			Draw(x, y, c, col);
-		}
+	template <class C>
+	static C* Column(Archetype* a, size_t nRow)
+	{
+		return reinterpret_cast<C*>(a->vecColumns[a->nColumnOf[ComponentId<C>()]].vecData.data()) + nRow;
 	}
-	else
+
+	template <class... C, class F>
+	void ForEachArchetype(F&& f)
 	{
-		if (dy >= 0)
+		const uint64_t nRequired = (Bit<C>() | ...);
+
+		for (auto a : m_vecArchetypes)
 		{
-			x = x1;
-			y = y1;
-			ye = y2;
+			if ((a->nMask & nRequired) == nRequired && !a->vecEntities.empty())
+				f(a);
 		}
-		else
+	}
+
+	template <class F, class... C>
+	static void RunRows(F& f, const Entity* pEntities, size_t nFrom, size_t nTo, C*... pColumns)
+	{
+		for (size_t i = nFrom; i < nTo; i++)
 		{
-			x = x2;
-			y = y2;
-			ye = y1;
+			if constexpr (std::is_invocable<F&, Entity, C&...>::value)
+				f(pEntities[i], pColumns[i]...);
+			else
+				f(pColumns[i]...);
 		}
+	}
 
-		Draw(x, y, c, col);
+	Archetype* GetArchetype(uint64_t nMask);
+	void MoveTo(uint32_t nIndex, Archetype* pDest);
+	void RemoveRow(Archetype* a, uint32_t nRow);
 
-		for (int i = 0; y < ye; i++)
-		{
-			y++;
+	std::vector<Archetype*> m_vecArchetypes;
+	std::unordered_map<uint64_t, Archetype*> m_mapArchetypes;
 
-			if (py <= 0)
-				py = py + 2 * dx1;
-			else
-			{
-				x += ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) ? 1 : -1;
-				py = py + 2 * (dx1 - dy1);
-			}
+	std::vector<Record> m_vecRecords;
+	std::vector<uint32_t> m_vecFreeIndices;
+	size_t m_nCount = 0;
 
-			Draw(x, y, c, col);
-		}
-	}
-}
+	uint32_t m_nComponentSize[MAX_COMPONENTS]{ 0 };
+};
 
-void ConsoleGameEngine::DrawTriangle(int x1, int y1, int x2, int y2, int x3, int y3, wchar_t c, short col)
+// Fixed-capacity particle pool stored as structure of arrays. Update integrates position, velocity
+// and age four particles at a time and compacts dead ones away, Render scatters the live particles
+// into a cell buffer picking glyph and colour from a ramp over the normalized age
+class ParticleSystem
 {
-	DrawLine(x1, y1, x2, y2, c, col);
-	DrawLine(x2, y2, x3, y3, c, col);
-	DrawLine(x3, y3, x1, y1, c, col);
-}
+public:
+	ParticleSystem(size_t nCapacity = 4096);
 
-void ConsoleGameEngine::FillTriangle(int x1, int y1, int x2, int y2, int x3, int y3, wchar_t c, short col)
-{
-	auto drawline = [&](int sx, int ex, int ny)
-		{
-			for (int i = sx; i <= ex; i++)
-				Draw(i, ny, c, col);
-		};
+public:
+	static constexpr int MAX_RAMP_STOPS = 16;
+	static constexpr int RENDER_BATCH = 64;
 
-	int t1x, t2x, y, minx, maxx, t1xp, t2xp;
+	bool Emit(float x, float y, float vx, float vy, float fLifetime);
 
-	bool changed1 = false;
-	bool changed2 = false;
+	// Emits up to nCount particles in random directions from (x, y)
+	int EmitBurst(float x, float y, int nCount, float fSpeedMin, float fSpeedMax, float fLifeMin, float fLifeMax);
 
-	int signx1, signx2, dx1, dy1, dx2, dy2;
-	int e1, e2;
+	void Update(float fDeltaTime);
+	void Clear();
 
-	if (y1 > y2) { std::swap(y1, y2); std::swap(x1, x2); }
-	if (y1 > y3) { std::swap(y1, y3); std::swap(x1, x3); }
-	if (y2 > y3) { std::swap(y2, y3); std::swap(x2, x3); }
+	void SetGravity(float gx, float gy);
 
-	t1x = t2x = x1; y = y1;
-	dx1 = x2 - x1;
+	// Stops are spread evenly from birth to death, e.g. { PIXEL_SOLID, PIXEL_HALF, PIXEL_QUARTER }
+	void SetRamp(const wchar_t* pGlyphs, const short* pColours, int nStops);
+
+	// Returns the bounds of the written cells in rTouched, or an empty rectangle if nothing was drawn
+	void Render(CHAR_INFO* pCells, int nWidth, int nHeight, SMALL_RECT& rTouched, CellColour* pColours = nullptr) const;
+
+	size_t Count() const;
+	size_t Capacity() const;
+
+private:
+	float Random();
+
+	size_t m_nCapacity;
+	size_t m_nCount = 0;
+
+	std::vector<float> m_vecX;
+	std::vector<float> m_vecY;
+	std::vector<float> m_vecVelX;
+	std::vector<float> m_vecVelY;
+	std::vector<float> m_vecAge;
+	std::vector<float> m_vecInvLifetime;
+
+	float m_fGravityX = 0.0f;
+	float m_fGravityY = 0.0f;
+
+	int m_nRampStops = 1;
+	wchar_t m_cRampGlyphs[MAX_RAMP_STOPS] = { PIXEL_SOLID };
+	short m_nRampColours[MAX_RAMP_STOPS] = { FG_WHITE };
+
+	uint32_t m_nRandomState = 0x9E3779B9;
+};
+
+enum PathStatus
+{
+	PATH_INVALID,
+	PATH_PENDING,
+	PATH_FOUND,
+	PATH_NOT_FOUND
+};
+
+// A* over a grid of cell costs (0 is a wall, 1..255 is the price of entering a cell).
+// Search storage is allocated once and reused by every query. When nClusterSize is non-zero the map
+// is split into clusters connected by border entrances (HPA*), long queries search that abstract
+// graph first and then refine it cluster by cluster. SetCost only rebuilds the clusters it touched
+// and invalidates cached paths that went through them. Requests queued with RequestPath are solved
+// by ProcessRequests within a time budget, so many agents repathing at once are spread over frames.
+class PathFinder
+{
+public:
+	PathFinder(int nWidth, int nHeight, int nClusterSize = 16, bool bDiagonal = false);
+
+public:
+	typedef std::vector<std::pair<int, int>> Path;
+
+	void SetCost(int x, int y, uint8_t nCost);
+	uint8_t GetCost(int x, int y) const;
+
+	// Path includes both ends, returns false if the goal can't be reached
+	bool FindPath(int sx, int sy, int gx, int gy, Path& vecPath);
+
+	int RequestPath(int sx, int sy, int gx, int gy);
+	void ProcessRequests(float fTimeBudget);
+	PathStatus GetRequestStatus(int nRequest) const;
+
+	// Hands out the result and frees the request
+	bool TakePath(int nRequest, Path& vecPath);
+	void CancelRequest(int nRequest);
+
+	int Width() const;
+	int Height() const;
+
+private:
+	static constexpr uint32_t INF = 0xFFFFFFFF;
+	static constexpr int CACHE_SIZE = 64;
+
+	struct AbstractEdge
+	{
+		int nTo;
+		uint32_t nCost;
+	};
+
+	struct Cluster
+	{
+		std::vector<int> vecNodes;
+		std::vector<std::vector<AbstractEdge>> vecEdges;
+		uint32_t nVersion = 0;
+		bool bDirty = true;
+	};
+
+	struct CacheEntry
+	{
+		int nStart = -1;
+		int nGoal = -1;
+		Path vecPath;
+		std::vector<std::pair<int, uint32_t>> vecVersions;
+	};
+
+	struct Request
+	{
+		int nStart;
+		int nGoal;
+		PathStatus status = PATH_INVALID;
+		Path vecPath;
+	};
+
+	int ClusterOf(int nCell) const;
+	void ClusterBounds(int nCluster, int& x1, int& y1, int& x2, int& y2) const;
+	uint32_t Heuristic(int a, int b) const;
+
+	// Low level search inside [x1, x2] x [y1, y2], with nGoal < 0 it floods the whole area
+	bool Search(int nStart, int nGoal, int x1, int y1, int x2, int y2);
+	void AppendPath(int nStart, int nGoal, Path& vecPath);
+
+	void Refresh();
+	void BuildBorder(int nCluster, bool bEast);
+	void BuildCluster(int nCluster);
+
+	bool FindAbstractPath(int nStart, int nGoal, Path& vecPath);
+
+	int m_nWidth;
+	int m_nHeight;
+	int m_nClusterSize;
+	int m_nClustersX;
+	int m_nClustersY;
+	bool m_bDiagonal;
+	bool m_bHierarchical;
+	bool m_bDirty = true;
+
+	std::vector<uint8_t> m_vecCost;
+
+	// Per cell search state, a cell belongs to the current search only if its stamp matches
+	std::vector<uint32_t> m_vecG;
+	std::vector<int> m_vecParent;
+	std::vector<uint32_t> m_vecSeen;
+	std::vector<uint32_t> m_vecClosed;
+	std::vector<std::pair<uint32_t, int>> m_vecOpen;
+	uint32_t m_nStamp = 0;
+
+	std::vector<Cluster> m_vecClusters;
+	std::vector<std::vector<std::pair<int, int>>> m_vecEastBorders;
+	std::vector<std::vector<std::pair<int, int>>> m_vecSouthBorders;
+	std::vector<int> m_vecNodeIndex;
+
+	// Refresh scratch, one flag per cluster
+	std::vector<uint8_t> m_vecRebuild;
+
+	std::vector<AbstractEdge> m_vecStartEdges;
+	std::vector<uint32_t> m_vecGoalEdges;
+	std::vector<int> m_vecAbstractPath;
+
+	CacheEntry m_cache[CACHE_SIZE];
+
+	std::vector<Request> m_vecRequests;
+	std::vector<int> m_vecFreeRequests;
+	std::vector<int> m_vecQueue;
+	size_t m_nQueueHead = 0;
+};
+
+// First person view of a grid map cast with DDA, one ray per screen column. Ray directions come
+// from a per-column camera plane table, so a frame needs a single sin/cos pair. Columns are spread
+// over a ThreadPool and every column writes its ceiling, wall and floor spans in one pass, keeping
+// the perpendicular wall distance in a depth buffer that DrawBillboard tests sprites against
+class Raycaster
+{
+public:
+	Raycaster(int nMapWidth, int nMapHeight);
+
+public:
+	// 0 is empty space, any other value is a wall textured with SetTexture(nWall)
+	void SetCell(int x, int y, uint8_t nWall);
+	uint8_t GetCell(int x, int y) const;
+
+	// Walls without a texture are shaded with PIXEL_* glyphs by distance
+	void SetTexture(uint8_t nWall, const Sprite* sprite, short nUntexturedColour = FG_GREY);
+
+	void SetFieldOfView(float fFov);
+	void SetMaxDepth(float fDepth);
+	void SetCeiling(wchar_t c, short col);
+	void SetFloor(wchar_t c, short col);
+
+	void Render(CHAR_INFO* pCells, int nWidth, int nHeight, float px, float py, float fAngle, ThreadPool* pPool = nullptr);
+
+	// World space sprite drawn with the camera of the last Render, hidden behind closer walls.
+	// The extended colours of the written cells in pColours are reset if it's given
+	void DrawBillboard(CHAR_INFO* pCells, int nWidth, int nHeight, float x, float y, const Sprite* sprite, float fScale = 1.0f,
+		CellColour* pColours = nullptr) const;
+
+	const std::vector<float>& DepthBuffer() const;
+
+private:
+	void RenderColumns(CHAR_INFO* pCells, int nWidth, int nHeight, int nFrom, int nTo);
+
+	int m_nMapWidth;
+	int m_nMapHeight;
+	std::vector<uint8_t> m_vecMap;
+
+	const Sprite* m_pTextures[256]{ nullptr };
+	short m_nWallColours[256];
+
+	float m_fFov = 3.14159f / 3.0f;
+	float m_fMaxDepth = 32.0f;
+
+	wchar_t m_cCeiling = L' ';
+	short m_nCeilingColour = FG_BLACK;
+	wchar_t m_cFloor = PIXEL_QUARTER;
+	short m_nFloorColour = FG_DARK_GREY;
+
+	// Camera of the last Render
+	float m_fPosX = 0.0f, m_fPosY = 0.0f;
+	float m_fDirX = 1.0f, m_fDirY = 0.0f;
+	float m_fPlaneX = 0.0f, m_fPlaneY = 0.0f;
+
+	std::vector<float> m_vecCameraX;
+	std::vector<float> m_vecDepth;
+};
+
+struct Vec3
+{
+	float x = 0.0f;
+	float y = 0.0f;
+	float z = 0.0f;
+
+	Vec3 operator+(const Vec3& v) const { return { x + v.x, y + v.y, z + v.z }; }
+	Vec3 operator-(const Vec3& v) const { return { x - v.x, y - v.y, z - v.z }; }
+	Vec3 operator*(float f) const { return { x * f, y * f, z * f }; }
+
+	float Dot(const Vec3& v) const { return x * v.x + y * v.y + z * v.z; }
+	Vec3 Cross(const Vec3& v) const { return { y * v.z - z * v.y, z * v.x - x * v.z, x * v.y - y * v.x }; }
+	float Length() const { return sqrtf(Dot(*this)); }
+	Vec3 Normalise() const { float l = Length(); return l > 0.0f ? *this * (1.0f / l) : *this; }
+};
+
+// Row-major, vectors are rows multiplied from the left, so A * B applies A first
+struct Mat4
+{
+	float m[4][4] = { { 0.0f } };
+
+	Mat4 operator*(const Mat4& b) const;
+	Vec3 TransformPoint(const Vec3& v) const;
+	Vec3 TransformVector(const Vec3& v) const;
+
+	static Mat4 Identity();
+	static Mat4 Translation(float x, float y, float z);
+	static Mat4 Scale(float x, float y, float z);
+	static Mat4 RotationX(float a);
+	static Mat4 RotationY(float a);
+	static Mat4 RotationZ(float a);
+
+	// Left-handed view matrix, the camera looks down +z with +y up
+	static Mat4 LookAt(const Vec3& eye, const Vec3& target, const Vec3& up);
+};
+
+struct Mesh
+{
+	std::vector<Vec3> vecVertices;
+	std::vector<uint32_t> vecIndices;
+
+	// Only "v" and triangle or polygon "f" lines are read, polygons are fanned into triangles
+	bool LoadObj(const std::wstring& sFileName);
+};
+
+// Depth buffered triangle rasterizer for 3D meshes. DrawMesh transforms all vertices in one batch,
+// clips triangles against the near plane, culls back faces and rasterizes with incremental edge
+// functions, rejecting cells against the depth buffer before they are written. Meshes with many
+// triangles are binned into screen tiles which are rasterized in parallel on a ThreadPool.
+// Front faces are counter-clockwise as seen by the camera.
+class Renderer3D
+{
+public:
+	Renderer3D(int nWidth, int nHeight);
+
+public:
+	void Resize(int nWidth, int nHeight);
+	void ClearDepth();
+
+	// fAspect is the width/height ratio of the screen in pixels, i.e. including the font size
+	void SetProjection(float fFov, float fAspect, float fNear, float fFar);
+	void SetView(const Mat4& matView);
+	void SetLight(const Vec3& vDirection);
+	void SetCulling(bool bCullBackFaces);
+
+	// Flat shades with the light using PIXEL_* glyphs of col, or draws c/col unlit when bLit is false
+	void DrawMesh(CHAR_INFO* pCells, const Mesh& mesh, const Mat4& matModel, short col = FG_WHITE,
+		bool bLit = true, wchar_t c = PIXEL_SOLID, ThreadPool* pPool = nullptr);
+
+	const float* DepthBuffer() const;
+
+	int Width() const;
+	int Height() const;
+
+private:
+	struct ClipVertex
+	{
+		float x, y, z, w;
+	};
+
+	// Edge functions are in fixed point so a triangle covers the same cells whichever tile rasterizes it
+	struct RasterTriangle
+	{
+		int64_t nEdgeA[3], nEdgeB[3], nEdgeC[3];
+		float z[3];
+		float fInvArea;
+		int nMinX, nMinY, nMaxX, nMaxY;
+		CHAR_INFO cell;
+	};
+
+	static constexpr int SUBPIXEL_BITS = 4;
+	static constexpr int TILE_SIZE = 32;
+	static constexpr size_t BINNING_THRESHOLD = 64;
+
+	void SetupTriangle(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c, const CHAR_INFO& cell);
+	void Rasterize(const RasterTriangle& t, CHAR_INFO* pCells, int x1, int y1, int x2, int y2);
+
+	int m_nWidth = 0;
+	int m_nHeight = 0;
+
+	std::vector<float> m_vecDepth;
+
+	Mat4 m_matView = Mat4::Identity();
+	float m_fScaleX = 1.0f, m_fScaleY = 1.0f;
+	float m_fNear = 0.1f, m_fFar = 1000.0f;
+
+	Vec3 m_vLight = { 0.0f, 0.0f, -1.0f };
+	bool m_bCullBackFaces = true;
+
+	// Scratch storage reused between calls
+	std::vector<Vec3> m_vecWorld;
+	std::vector<ClipVertex> m_vecClip;
+	std::vector<RasterTriangle> m_vecTriangles;
+	std::vector<std::vector<uint32_t>> m_vecBins;
+};
+
+// Records the screen after every frame. Each frame is stored as the runs of cells that changed since
+// the previous one, encoded on the game thread into a ring of reusable buffers and written to disk
+// by a background thread. If the writer falls behind the frame is dropped and the next one is
+// stored whole, so the file always decodes.
+//
+// File layout: "CGER", uint32 version, then per frame uint32 payload size followed by
+// uint32 time in ms, uint16 width, uint16 height, uint8 flags, uint32 run count and
+// the runs as uint32 offset, uint32 length and length raw CHAR_INFOs.
+class FrameRecorder
+{
+public:
+	FrameRecorder() = default;
+	~FrameRecorder();
+
+public:
+	bool Start(const std::wstring& sFileName);
+
+	// Returns false if anything failed to be written
+	bool Stop();
+
+	bool IsRecording() const;
+	size_t DroppedFrames() const;
+
+	void Capture(const CHAR_INFO* pScreen, int nWidth, int nHeight, float fDeltaTime);
+
+	// Encodes one frame record including its size prefix, a null pPrevious makes a keyframe
+	static void EncodeFrame(std::vector<uint8_t>& vecOut, const CHAR_INFO* pScreen, const CHAR_INFO* pPrevious, int nWidth, int nHeight, uint32_t nTime);
+
+	static constexpr uint32_t VERSION = 1;
+	static constexpr uint8_t FLAG_KEYFRAME = 0x01;
+
+private:
+	static constexpr size_t RING_SIZE = 16;
+
+	void Write();
+
+	std::ofstream m_file;
+	std::thread m_thrWriter;
+
+	std::mutex m_mux;
+	std::condition_variable m_cv;
+
+	std::vector<uint8_t> m_vecSlots[RING_SIZE];
+	size_t m_nHead = 0;
+	size_t m_nTail = 0;
+
+	bool m_bRecording = false;
+	bool m_bFailed = false;
+	bool m_bForceKeyframe = true;
+
+	size_t m_nDropped = 0;
+	double m_dTime = 0.0;
+
+	std::vector<CHAR_INFO> m_vecPrevious;
+	int m_nPrevWidth = 0;
+	int m_nPrevHeight = 0;
+};
+
+// Streams a file written by FrameRecorder back, reading one frame at a time
+class FramePlayer
+{
+public:
+	FramePlayer() = default;
+
+public:
+	bool Open(const std::wstring& sFileName);
+	void Close();
+
+	bool IsOpen() const;
+	bool IsFinished() const;
+
+	// 1 plays at the recorded speed, 2 twice as fast and so on, 0 steps one frame per Update
+	void SetSpeed(float fSpeed);
+
+	// Applies every frame due by the new playback time, returns false once the file ends
+	bool Update(float fElapsed);
+
+	const CHAR_INFO* Frame() const;
+	int Width() const;
+	int Height() const;
+
+	// Applies a frame record without its size prefix to vecFrame, returns false if it's malformed
+	static bool DecodeFrame(const uint8_t* pPayload, size_t nSize, std::vector<CHAR_INFO>& vecFrame, int& nWidth, int& nHeight);
+
+private:
+	bool ReadFrame();
+
+	std::ifstream m_file;
+	std::vector<uint8_t> m_vecPayload;
+	std::vector<CHAR_INFO> m_vecFrame;
+
+	int m_nWidth = 0;
+	int m_nHeight = 0;
+
+	float m_fSpeed = 1.0f;
+	double m_dTime = 0.0;
+
+	bool m_bPending = false;
+	bool m_bFinished = true;
+	uint32_t m_nPendingTime = 0;
+};
+
+// Watches a directory tree for changed files with ReadDirectoryChangesW and reloads the sprites tracked
+// from them on its own thread. Nothing changes until Apply, which the engine calls before every
+// OnUserUpdate, so new cells are swapped in between frames and never while a sprite is being drawn
+class AssetWatcher
+{
+public:
+	AssetWatcher() = default;
+	~AssetWatcher();
+
+public:
+	bool Start(const std::wstring& sDirectory);
+	void Stop();
+	bool IsWatching() const;
+
+	// Only files under the watched directory are noticed, paths may be relative to the working directory.
+	// Only the pointer is kept, so untrack a sprite before destroying it
+	void TrackSprite(Sprite* sprite, const std::wstring& sFileName);
+	void UntrackSprite(Sprite* sprite);
+
+	// For any other kind of asset, fnReload is called from Apply after the file changed
+	void TrackFile(const std::wstring& sFileName, std::function<void()> fnReload);
+
+	// Swaps in the sprites loaded since the last call and runs the reload callbacks, returns how many assets changed
+	int Apply();
+
+private:
+	void Watch();
+
+	// Returns false if the file couldn't be loaded yet, e.g. because it's still being written
+	bool Reload(const std::wstring& sPath);
+
+	static std::wstring NormalisePath(const std::wstring& sFileName);
+
+	// Editors save in several writes, so a file is only loaded after it was left alone for this long
+	static constexpr DWORD SETTLE_TIME_MS = 100;
+	static constexpr int MAX_RETRIES = 10;
+
+	struct LoadedSprite
+	{
+		Sprite* pTarget;
+		std::wstring sPath;
+		std::unique_ptr<Sprite> pSprite;
+	};
+
+	std::thread m_thrWatcher;
+	HANDLE m_hDirectory = INVALID_HANDLE_VALUE;
+	HANDLE m_hStop = NULL;
+	std::wstring m_sDirectory;
+
+	std::mutex m_mux;
+
+	// Tracked assets by normalised path
+	std::unordered_map<Sprite*, std::wstring> m_mapSprites;
+	std::vector<std::pair<std::wstring, std::function<void()>>> m_vecFiles;
+
+	std::vector<LoadedSprite> m_vecLoaded;
+	std::vector<std::wstring> m_vecChangedFiles;
+};
+
+// Declared either way so the engine has the same members whether or not coroutines are available
+class ScriptScheduler;
+
+#ifdef CONSOLE_GAME_ENGINE_COROUTINES
+namespace detail
+{
+	// Coroutine frames are allocated whenever a script starts, freed frames are kept on a free list
+	// per size class and reused instead of going back to the heap
+	class ScriptFramePool
+	{
+	public:
+		static void* Allocate(size_t nSize);
+		static void Free(void* p, size_t nSize);
+
+	private:
+		static constexpr size_t GRANULARITY = 64;
+		static constexpr size_t SIZE_CLASSES = 32;
+
+		struct FreeFrame
+		{
+			FreeFrame* pNext;
+		};
+
+		static ScriptFramePool& Instance();
+
+		std::mutex m_mux;
+		FreeFrame* m_pFree[SIZE_CLASSES] = {};
+	};
+}
+
+// A C++20 coroutine run by a ScriptScheduler, usually the engine's, see ConsoleGameEngine::StartScript:
+//   Script Blink(Sprite* sprite)
+//   {
+//       co_await KeyPressed(VK_SPACE);
+//       for (int i = 0; i < 3; i++)
+//       {
+//           sprite->SetColour(0, 0, FG_RED);
+//           co_await Seconds(0.5f);
+//           sprite->SetColour(0, 0, FG_WHITE);
+//           co_await NextFrame();
+//       }
+//   }
+// Scripts run on the game thread and don't start until the scheduler first resumes them
+class Script
+{
+public:
+	struct promise_type
+	{
+		ScriptScheduler* pScheduler = nullptr;
+
+		Script get_return_object() { return Script(std::coroutine_handle<promise_type>::from_promise(*this)); }
+
+		std::suspend_always initial_suspend() noexcept { return {}; }
+		std::suspend_always final_suspend() noexcept { return {}; }
+
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+
+		static void* operator new(size_t nSize) { return detail::ScriptFramePool::Allocate(nSize); }
+		static void operator delete(void* p, size_t nSize) { detail::ScriptFramePool::Free(p, nSize); }
+	};
+
+	using Handle = std::coroutine_handle<promise_type>;
+
+	Script(Script&& script) noexcept;
+	Script& operator=(Script&& script) noexcept;
+
+	Script(const Script&) = delete;
+	Script& operator=(const Script&) = delete;
+
+	~Script();
+
+public:
+	// Hands the coroutine over to the caller, who must destroy it
+	Handle Release();
+
+private:
+	explicit Script(Handle handle);
+
+	Handle m_handle;
+};
+
+// Things a script can co_await, each suspends it at least until the next frame
+struct NextFrame
+{
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(Script::Handle handle) const;
+	void await_resume() const noexcept {}
+};
+
+struct Seconds
+{
+	explicit Seconds(float fSeconds) : fSeconds(fSeconds) {}
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(Script::Handle handle) const;
+	void await_resume() const noexcept {}
+
+	float fSeconds;
+};
+
+struct KeyPressed
+{
+	explicit KeyPressed(int nKey) : nKey(nKey) {}
+
+	bool await_ready() const noexcept { return false; }
+	void await_suspend(Script::Handle handle) const;
+	void await_resume() const noexcept {}
+
+	int nKey;
+};
+
+// Resumes scripts when what they wait for happens. A waiting script sits in exactly one queue until
+// then and isn't looked at, so sleeping scripts cost nothing per frame: timers are a heap ordered by
+// wake time and key waits are lists per key that are only touched when that key is pressed
+class ScriptScheduler
+{
+public:
+	ScriptScheduler() = default;
+	~ScriptScheduler();
+
+	ScriptScheduler(const ScriptScheduler&) = delete;
+	ScriptScheduler& operator=(const ScriptScheduler&) = delete;
+
+public:
+	// The script first runs on the next Update
+	void Start(Script script);
+
+	// Resumes the scripts whose wait is over, pKeys are the 256 key states of this frame.
+	// Waits that start during the call are checked on the next one
+	void Update(float fDeltaTime, const KeyState* pKeys);
+
+	// Destroys every script, must not be called from inside one
+	void Clear();
+
+	// Scripts that haven't finished yet
+	size_t Count() const;
+
+	// Seconds passed in Update calls
+	double Time() const;
+
+private:
+	friend struct NextFrame;
+	friend struct Seconds;
+	friend struct KeyPressed;
+
+	void Resume(Script::Handle handle);
+
+	struct Timer
+	{
+		double dWake;
+
+		// Scripts waking at the same time resume in the order they started waiting
+		uint64_t nOrder;
+
+		Script::Handle handle;
+
+		bool operator>(const Timer& timer) const
+		{
+			return dWake > timer.dWake || (dWake == timer.dWake && nOrder > timer.nOrder);
+		}
+	};
+
+	std::vector<Script::Handle> m_vecNextFrame;
+	std::vector<Timer> m_vecTimers;
+	std::vector<Script::Handle> m_vecKeyWaits[256];
+
+	// Keys with a non empty wait list
+	std::vector<int> m_vecWaitedKeys;
+
+	std::vector<Script::Handle> m_vecResuming;
+
+	double m_dTime = 0.0;
+	uint64_t m_nTimerOrder = 0;
+	size_t m_nScripts = 0;
+};
+#endif
+
+// Identifies a scheduled timer, 0 is never used
+using TimerId = uint64_t;
+
+// Calls functions after a delay measured by the frame clock. Timers live in a hierarchical timing
+// wheel of 1 ms ticks: four levels of 256 slots, each level covering 256 times the span of the one
+// below. A timer goes into the lowest level its due time fits in and moves down when the wheel reaches
+// its slot, so scheduling and cancelling take constant time and an update only visits the slots that
+// come due instead of every pending timer
+class TimerWheel
+{
+public:
+	TimerWheel();
+
+	TimerWheel(const TimerWheel&) = delete;
+	TimerWheel& operator=(const TimerWheel&) = delete;
+
+public:
+	// Calls fnCallback once after fDelay seconds, and then every fRepeat seconds if that's above 0.
+	// Timers due on the same tick fire in the order they were scheduled
+	TimerId Schedule(float fDelay, std::function<void()> fnCallback, float fRepeat = 0.0f);
+
+	// Returns false if the timer has already fired or was cancelled, a timer may cancel itself
+	bool Cancel(TimerId id);
+	bool IsPending(TimerId id) const;
+
+	// Advances the clock and fires the timers that came due in tick order. Delays of timers scheduled
+	// from a callback count from the new time, and they never fire on the tick being processed
+	void Update(float fDeltaTime);
+
+	// Cancels every timer, must not be called from a callback
+	void Clear();
+
+	size_t Count() const;
+	double Time() const;
+
+	static constexpr double TICKS_PER_SECOND = 1000.0;
+
+private:
+	static constexpr int LEVELS = 4;
+	static constexpr int SLOT_BITS = 8;
+	static constexpr int SLOTS = 1 << SLOT_BITS;
+
+	// Timers further away than the top level can reach wait here until it wraps
+	static constexpr int OVERFLOW_SLOT = LEVELS * SLOTS;
+
+	static constexpr uint32_t NONE = UINT32_MAX;
+
+	enum class TimerState : uint8_t
+	{
+		Free,
+		Pending,
+		Firing,
+		Cancelled
+	};
+
+	struct Timer
+	{
+		uint64_t nDue;
+		uint64_t nOrder;
+
+		// In ticks, 0 for timers that fire once
+		uint64_t nRepeat;
+
+		std::function<void()> fnCallback;
+
+		// Links of the slot list, nNext also links free timers
+		uint32_t nPrev;
+		uint32_t nNext;
+
+		uint32_t nGeneration;
+		uint16_t nSlot;
+		TimerState state;
+	};
+
+	uint32_t Find(TimerId id) const;
+
+	void Insert(uint32_t nTimer);
+	void Link(uint32_t nTimer, int nSlot);
+	void Unlink(uint32_t nTimer);
+	void Release(uint32_t nTimer);
+
+	// Moves the timers of the slots reached on a block boundary down the levels
+	void Cascade();
+	void Redistribute(int nSlot);
+
+	void Fire(int nSlot);
+
+	// First occupied slot of level 0 at or after nFrom, SLOTS if there is none
+	int NextOccupied(int nFrom) const;
+
+	std::vector<Timer> m_vecTimers;
+	uint32_t m_nFree = NONE;
+
+	uint32_t m_arySlots[LEVELS * SLOTS + 1];
+	uint64_t m_aryOccupied[SLOTS / 64];
+
+	std::vector<uint32_t> m_vecFiring;
+
+	// Every timer due up to and including this tick has fired
+	uint64_t m_nTick = 0;
+
+	double m_dTime = 0.0;
+	uint64_t m_nOrder = 0;
+	size_t m_nCount = 0;
+};
+
+// Keeps the last frames of the screen and of registered game state within a memory budget, so they
+// can be stepped through backwards. A frame is stored XOR'd against the one before it, which turns
+// unchanged cells and bytes into zero words, and then as alternating runs of zero and literal words.
+// Every few frames a keyframe starts a new group, XOR'd against itself shifted by a cell so flat areas
+// still compress. Seeking decodes at most one group, and the oldest group is dropped whole once the
+// budget or the maximum duration runs out.
+class RewindBuffer
+{
+public:
+	RewindBuffer() = default;
+
+	RewindBuffer(const RewindBuffer&) = delete;
+	RewindBuffer& operator=(const RewindBuffer&) = delete;
+
+public:
+	// The bytes are copied into every frame and back by RestoreState, pData must stay valid
+	void AddState(void* pData, size_t nSize);
+
+	// For state that isn't one block, fnSave appends its bytes and fnLoad gets them back
+	void AddState(std::function<void(std::vector<uint8_t>&)> fnSave, std::function<void(const uint8_t*, size_t)> fnLoad);
+
+	// Both clear the buffer
+	void SetBudget(size_t nBytes);
+	void SetKeyframeInterval(int nFrames);
+
+	// Frames older than this are dropped even if they fit the budget, 0 keeps as many as fit
+	void SetMaxDuration(float fSeconds);
+
+	// Stores the screen and the registered state as the newest frame, when seeking it resumes first.
+	// Returns false if one frame doesn't fit the budget
+	bool Capture(const CHAR_INFO* pScreen, int nWidth, int nHeight, float fDeltaTime);
+
+	// Decodes a frame, 0 is the oldest one stored. Stepping forwards only applies the deltas in between,
+	// anything else decodes from the keyframe of the frame's group
+	bool Seek(int nFrame);
+	bool IsSeeking() const;
+
+	// Copies the state of the sought frame back, returns false if the registered state has changed since
+	bool RestoreState();
+
+	// Stops seeking and drops the frames after the sought one, so capturing continues from it
+	void Resume();
+
+	// Stops seeking and keeps every frame
+	void EndSeek();
+
+	void Clear();
+
+	int FrameCount() const;
+
+	// The newest frame captured at least fSeconds before the newest one, -1 if there are no frames
+	int FindFrame(float fSeconds) const;
+
+	// Of the sought frame
+	const CHAR_INFO* Frame() const;
+	int Width() const;
+	int Height() const;
+	double Time() const;
+
+	// Bytes taken by the stored frames
+	size_t MemoryUsed() const;
+	size_t Budget() const;
+
+	static constexpr size_t DEFAULT_BUDGET = 16 * 1024 * 1024;
+	static constexpr int DEFAULT_KEYFRAME_INTERVAL = 30;
+
+private:
+	static constexpr uint64_t NONE = UINT64_MAX;
+
+	struct FrameRecord
+	{
+		size_t nOffset;
+		size_t nSize;
+		size_t nWords;
+		double dTime;
+		bool bKeyframe;
+	};
+
+	struct State
+	{
+		void* pData;
+		size_t nSize;
+
+		std::function<void(std::vector<uint8_t>&)> fnSave;
+		std::function<void(const uint8_t*, size_t)> fnLoad;
+	};
+
+	// Snapshot words are the width, height, padded cells, state count and per state its size and padded bytes
+	void BuildSnapshot(const CHAR_INFO* pScreen, int nWidth, int nHeight);
+
+	// Keyframes are XOR'd against the word one cell back
+	static constexpr size_t KEYFRAME_STRIDE = sizeof(CHAR_INFO) >= sizeof(uint32_t) ? sizeof(CHAR_INFO) / sizeof(uint32_t) : 1;
+
+	// A null pReference makes a keyframe
+	static void Encode(std::vector<uint8_t>& vecOut, const uint32_t* pWords, const uint32_t* pReference, size_t nWords);
+
+	// Keyframes overwrite pWords, deltas are applied to the previous frame already in it
+	static bool Decode(uint32_t* pWords, size_t nWords, const uint8_t* pData, size_t nSize, bool bKeyframe);
+
+	// Drops the oldest groups until nSize bytes fit after the newest frame, a delta frame can't drop
+	// the group it depends on and fails instead
+	bool Reserve(size_t nSize, bool bKeyframe);
+
+	void DropOldestGroup();
+	void PushRecord(const FrameRecord& record);
+
+	FrameRecord& Record(size_t nFrame);
+	const FrameRecord& Record(size_t nFrame) const;
+
+	std::vector<State> m_vecStates;
+
+	// Encoded frames, written as a ring
+	std::vector<uint8_t> m_vecData;
+	size_t m_nBudget = DEFAULT_BUDGET;
+	size_t m_nWrite = 0;
+	size_t m_nUsed = 0;
+
+	// Ring of frame records, oldest first
+	std::vector<FrameRecord> m_vecRecords;
+	size_t m_nFirstRecord = 0;
+	size_t m_nRecords = 0;
+
+	// Frames are numbered from the first one ever captured, these are the numbers of the oldest
+	// stored frame, the newest keyframe and the decoded frame
+	uint64_t m_nFirstFrame = 0;
+	uint64_t m_nLastKeyframe = 0;
+	uint64_t m_nSeekFrame = NONE;
+
+	bool m_bSeeking = false;
+
+	int m_nKeyframeInterval = DEFAULT_KEYFRAME_INTERVAL;
+	int m_nSinceKeyframe = 0;
+
+	double m_dMaxDuration = 0.0;
+	double m_dTime = 0.0;
+
+	std::vector<uint32_t> m_vecSnapshot;
+	std::vector<uint32_t> m_vecPrevious;
+	std::vector<uint8_t> m_vecEncoded;
+	std::vector<uint8_t> m_vecState;
+
+	std::vector<uint32_t> m_vecSeek;
+	std::vector<CHAR_INFO> m_vecFrame;
+	int m_nSeekWidth = 0;
+	int m_nSeekHeight = 0;
+};
+
+// Declared either way so the engine has the same members whether or not streaming is compiled in
+class FrameServer;
+
+#ifdef CONSOLE_GAME_ENGINE_STREAMING
+// Serves the screen to any number of viewers over a local AF_UNIX socket using the FrameRecorder
+// frame records. Each frame's delta is encoded once on the game thread and the same buffer is
+// handed to every viewer. A background thread does all socket work without blocking. A viewer that
+// is still sending an older frame skips ahead and gets a keyframe of the newest one, so slow viewers
+// never hold up the game. New viewers also start with a keyframe.
+class FrameServer
+{
+public:
+	FrameServer() = default;
+	~FrameServer();
+
+public:
+	bool Start(const std::string& sPath);
+	void Stop();
+
+	bool IsRunning() const;
+	size_t ViewerCount() const;
+
+	void Publish(const CHAR_INFO* pScreen, int nWidth, int nHeight, float fDeltaTime);
+
+private:
+	typedef std::shared_ptr<const std::vector<uint8_t>> Packet;
+
+	struct Viewer
+	{
+		SOCKET socket;
+
+		// Packet being sent and how much of it went out already
+		Packet packet;
+		size_t nSent = 0;
+
+		// Frame the viewer has once its packet is sent, 0 for none
+		uint64_t nFrame = 0;
+	};
+
+	void Serve();
+
+	// A pooled buffer nobody else holds any more, so publishing doesn't allocate once the pool has warmed up
+	std::shared_ptr<std::vector<uint8_t>> NextPacket();
+
+	std::string m_sPath;
+	SOCKET m_socket = INVALID_SOCKET;
+
+	std::thread m_thrServer;
+	std::mutex m_mux;
+	std::condition_variable m_cv;
+
+	bool m_bRunning = false;
+
+	// Newest frame, guarded by m_mux
+	Packet m_delta;
+	Packet m_keyframe;
+	uint64_t m_nFrame = 0;
+
+	// Set while a viewer waits for a keyframe, only cleared by the server thread once one was handed out
+	std::atomic<bool> m_bKeyframeWanted = false;
+	std::atomic<size_t> m_nViewers = 0;
+
+	// Owned by the server thread
+	std::vector<Viewer> m_vecViewers;
+
+	// Owned by the game thread
+	std::vector<std::shared_ptr<std::vector<uint8_t>>> m_vecPackets;
+	std::vector<CHAR_INFO> m_vecPrevious;
+	int m_nPrevWidth = 0;
+	int m_nPrevHeight = 0;
+	double m_dTime = 0.0;
+};
+
+// Viewer side of FrameServer
+class FrameStreamClient
+{
+public:
+	FrameStreamClient() = default;
+	~FrameStreamClient();
+
+public:
+	bool Connect(const std::string& sPath);
+	void Disconnect();
+
+	bool IsConnected() const;
+
+	// Applies every frame received so far without blocking, returns true if the frame changed
+	bool Poll();
+
+	const CHAR_INFO* Frame() const;
+	int Width() const;
+	int Height() const;
+
+private:
+	SOCKET m_socket = INVALID_SOCKET;
+
+	std::vector<uint8_t> m_vecReceived;
+	std::vector<CHAR_INFO> m_vecFrame;
+
+	int m_nWidth = 0;
+	int m_nHeight = 0;
+};
+#endif
+
+// Cells that every drawing call can render into once bound with ConsoleGameEngine::SetDrawTarget,
+// so content that rarely changes (minimaps, HUD panels, composed sprites) is drawn once and blitted each frame
+class Surface
+{
+public:
+	Surface(int nWidth, int nHeight, wchar_t c = L' ', short col = FG_BLACK);
+	Surface(const SpriteView& sprite);
+
+private:
+	std::vector<CHAR_INFO> m_vecCells;
+
+public:
+	int nWidth = 0;
+	int nHeight = 0;
+
+public:
+	CHAR_INFO* Cells();
+	const CHAR_INFO* Cells() const;
+
+	wchar_t GetGlyph(int x, int y) const;
+	short GetColour(int x, int y) const;
+
+	// The sprite has to be the same size as the surface
+	bool CopyTo(Sprite& sprite) const;
+};
+
+// Bump allocator for data that only lives until the end of a frame. Allocating is a pointer increment
+// and nothing is freed one by one, Reset releases everything at once. When a frame needs more than
+// one block the blocks are merged on Reset, so after a few frames the arena stops touching the heap
+class FrameArena
+{
+public:
+	FrameArena(size_t nInitialSize = 64 * 1024);
+	~FrameArena();
+
+	FrameArena(const FrameArena&) = delete;
+	FrameArena& operator=(const FrameArena&) = delete;
+
+	struct Marker
+	{
+		size_t nBlock;
+		size_t nOffset;
+	};
+
+public:
+	// nAlign has to be a power of two
+	void* Allocate(size_t nSize, size_t nAlign = alignof(std::max_align_t));
+
+	// Uninitialised storage for nCount objects, destructors are never run so only trivial types are allowed
+	template <class T>
+	T* Allocate(size_t nCount)
+	{
+		static_assert(std::is_trivially_destructible_v<T>, "The arena never runs destructors");
+		return static_cast<T*>(Allocate(sizeof(T) * nCount, alignof(T)));
+	}
+
+	void Reset();
+
+	// Rewinding to a mark releases everything allocated after it, for scratch memory inside a single call
+	Marker Mark() const;
+	void Rewind(const Marker& mark);
+
+	// Bytes handed out since the last Reset, including alignment padding and the unused ends of filled blocks
+	size_t Used() const;
+	size_t Capacity() const;
+
+private:
+	struct Block
+	{
+		uint8_t* pData;
+		size_t nSize;
+	};
+
+	std::vector<Block> m_vecBlocks;
+	size_t m_nBlock = 0;
+	size_t m_nOffset = 0;
+
+	// Bytes used in the blocks before m_nBlock
+	size_t m_nUsedBefore = 0;
+};
+
+// Lets standard containers allocate from a FrameArena, e.g. std::vector<int, ArenaAllocator<int>> vec(arena).
+// Such containers must not outlive the frame
+template <class T>
+class ArenaAllocator
+{
+public:
+	using value_type = T;
+
+	ArenaAllocator(FrameArena& arena) : m_pArena(&arena) {}
+
+	template <class U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : m_pArena(other.Arena()) {}
+
+private:
+	FrameArena* m_pArena;
+
+public:
+	T* allocate(size_t n) { return static_cast<T*>(m_pArena->Allocate(n * sizeof(T), alignof(T))); }
+	void deallocate(T*, size_t) {}
+
+	FrameArena* Arena() const { return m_pArena; }
+
+	template <class U>
+	bool operator==(const ArenaAllocator<U>& other) const { return m_pArena == other.Arena(); }
+
+	template <class U>
+	bool operator!=(const ArenaAllocator<U>& other) const { return m_pArena != other.Arena(); }
+};
+
+// Turns cells into VT escape sequences, writing only the cells that changed since the previous frame.
+// The cursor is moved only when that is shorter than rewriting the unchanged cells in between,
+// and colours are only set when they differ from the ones the terminal already has
+class VtEncoder
+{
+public:
+	// The output is empty when nothing changed. bFull clears the terminal and writes every cell,
+	// which also happens when the size differs from the previous frame. Otherwise only nRows rows
+	// starting at nFirstRow are looked at, wrapping around the bottom, the rest are left for later frames
+	void Encode(std::wstring& sOut, const CHAR_INFO* pCells, const CellColour* pColours, int nWidth, int nHeight, bool bFull,
+		int nFirstRow = 0, int nRows = INT_MAX);
+
+	// Wraps frames in DEC mode 2026 so the terminal shows them at once instead of tearing,
+	// terminals that don't know the mode ignore it
+	void SetSynchronized(bool bEnable);
+
+private:
+	// Colours are resolved so palette and extended ones compare the same way
+	struct Cell
+	{
+		wchar_t c;
+		uint32_t fg;
+		uint32_t bg;
+	};
+
+	static constexpr uint32_t COLOUR_UNKNOWN = 0xFFFFFFFF;
+
+	std::vector<Cell> m_vecPrevious;
+	int m_nWidth = 0;
+	int m_nHeight = 0;
+
+	// What the terminal currently draws with, it persists between frames
+	uint32_t m_nFg = COLOUR_UNKNOWN;
+	uint32_t m_nBg = COLOUR_UNKNOWN;
+
+	bool m_bSynchronized = true;
+};
+
+// Off-screen cell buffer composited into the screen, see ConsoleGameEngine::CreateLayer
+struct Layer
+{
+	std::vector<CHAR_INFO> vecCells;
+
+	// One flag per LAYER_TILE_SIZE x LAYER_TILE_SIZE block of cells written since the last composite
+	std::vector<uint8_t> vecDirty;
+
+	int nZ = 0;
+	bool bVisible = true;
+
+	// Cells holding this glyph let the layers below show through
+	wchar_t cAlpha = L'\0';
+};
+
+enum ErrorCode
+{
+	RC_OK,
+	RC_INVALID_SCREEN_SIZE,
+	RC_INVALID_SCREEN_BUFFER,
+	RC_INVALID_FONT,
+	RC_INVALID_CONSOLE_MODE,
+	RC_INVALID_SCREEN_INFO,
+};
+
+class ConsoleGameEngine
+{
+public:
+	ConsoleGameEngine();
+	virtual ~ConsoleGameEngine();
+
+public:
+	virtual bool OnUserCreate() = 0;
+	virtual bool OnUserUpdate(float fDeltaTime) = 0;
+
+	// Called after the screen was resized, returning false ends the application like OnUserUpdate does
+	virtual bool OnUserResize(int nWidth, int nHeight) { return true; }
+
+	ErrorCode ConstructConsole(int nWidth = 120, int nHeight = 40, int nFontWidth = 4, int nFontHeight = 4);
+
+	// Allocates the screen without touching the console, for tools and benchmarks that only draw
+	ErrorCode ConstructOffscreen(int nWidth, int nHeight);
+	void Run();
+
+public:
+	bool MakeSound(const std::wstring& sFilename, bool bLoop);
+	bool IsFocused();
+
+	virtual void Draw(int x, int y, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+	virtual void DrawRectangle(int x, int y, int sx, int sy, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+	virtual void FillRectangle(int x, int y, int sx, int sy, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+	virtual void DrawCircle(int x, int y, int r, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+	virtual void FillCircle(int x, int y, int r, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+	virtual void DrawTriangle(int x1, int y1, int x2, int y2, int x3, int y3, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+	virtual void FillTriangle(int x1, int y1, int x2, int y2, int x3, int y3, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+	virtual void DrawLine(int x1, int y1, int x2, int y2, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+
+	// The sprite draws copy rows straight into the draw target without going through Draw,
+	// so an overridden Draw doesn't see them. Override these too to intercept sprites
+	virtual void DrawSprite(int x, int y, Sprite* sprite);
+	virtual void DrawSpriteAlpha(int x, int y, Sprite* sprite);
+	virtual void DrawPartialSprite(int x, int y, int fx, int fy, int fw, int fh, Sprite* sprite);
+	virtual void DrawPartialSpriteAlpha(int x, int y, int fx, int fy, int fw, int fh, Sprite* sprite);
+
+	// Also take Sprites and EmbeddedSprites, the Sprite* versions above forward to these
+	void DrawSprite(int x, int y, const SpriteView& sprite);
+	void DrawSpriteAlpha(int x, int y, const SpriteView& sprite);
+	void DrawPartialSprite(int x, int y, int fx, int fy, int fw, int fh, const SpriteView& sprite);
+	void DrawPartialSpriteAlpha(int x, int y, int fx, int fy, int fw, int fh, const SpriteView& sprite);
+
+	// Expand the indices through the sprite's palette while copying, with the same clipping and colours as above
+	void DrawSprite(int x, int y, const IndexedSprite& sprite);
+	void DrawSpriteAlpha(int x, int y, const IndexedSprite& sprite);
+	void DrawPartialSprite(int x, int y, int fx, int fy, int fw, int fh, const IndexedSprite& sprite);
+	void DrawPartialSpriteAlpha(int x, int y, int fx, int fy, int fw, int fh, const IndexedSprite& sprite);
+
+	// Rotates the sprite by fAngle radians and scales it about fPivotX, fPivotY (in sprite cells), which lands on x, y.
+	// Every covered cell is mapped back into the sprite so nothing has holes, bAlpha skips L' ' cells.
+	// Scales below 1/1024 draw nothing and negative scales mirror the sprite. Like the copies above this bypasses Draw
+	void DrawSpriteTransformed(float x, float y, const SpriteView& sprite, float fAngle, float fScaleX = 1.0f, float fScaleY = 1.0f,
+		float fPivotX = 0.0f, float fPivotY = 0.0f, bool bAlpha = true);
+
+	// Same but samples the mip level matching the scale, so shrunk sprites keep their shape instead of shimmering.
+	// The pivot is in cells of the full size sprite
+	void DrawSpriteTransformed(float x, float y, const SpriteMips& mips, float fAngle, float fScaleX = 1.0f, float fScaleY = 1.0f,
+		float fPivotX = 0.0f, float fPivotY = 0.0f, bool bAlpha = true);
+
+	virtual void DrawWireFrameModel(const std::vector<std::pair<float, float>>& model, float x, float y, float r, float s, wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+
+	// Every other overload draws through the string_view one, so overriding that one covers them all.
+	// Overriding any of these hides the rest, so bring them back with using ConsoleGameEngine::DrawString
+	virtual void DrawString(int x, int y, std::wstring_view text, short col = FG_WHITE);
+	virtual void DrawString(int x, int y, const std::wstring& text, short col = FG_WHITE);
+	void DrawString(int x, int y, const wchar_t* text, short col = FG_WHITE);
+
+	// printf and std::format flavours that format into a fixed per-engine buffer, so nothing is allocated.
+	// Both draw nothing when the output is FORMAT_BUFFER_SIZE (512) characters or longer
+	void DrawStringf(int x, int y, short col, const wchar_t* format, ...);
+
+#ifdef __cpp_lib_format
+	template <class... Args>
+	void DrawStringFormat(int x, int y, short col, std::wformat_string<Args...> format, Args&&... args)
+	{
+		auto res = std::format_to_n(m_sFormatBuffer, FORMAT_BUFFER_SIZE, format, std::forward<Args>(args)...);
+
+		// Same limit as DrawStringf, whose buffer also has to hold the terminator
+		if (res.size >= (std::ptrdiff_t)FORMAT_BUFFER_SIZE)
+			return;
+
+		DrawString(x, y, std::wstring_view(m_sFormatBuffer, res.out - m_sFormatBuffer), col);
+	}
+#endif
+	virtual void Clear(wchar_t c = PIXEL_SOLID, short col = FG_WHITE);
+
+	// Switches presentation to VT escape sequences so cells can carry 24-bit or 256-colour values,
+	// the extra per-cell storage is only allocated once this is enabled
+	bool EnableTrueColour(bool bEnable = true);
+	bool IsTrueColour() const;
+
+	// Whether VT frames are wrapped in synchronized updates (DEC mode 2026), on by default
+	void SetSynchronizedOutput(bool bEnable);
+
+	// Frames are written to the console by a thread of their own, so when the console is slow (e.g. over SSH)
+	// the game keeps running at full rate and the console shows the newest frame whenever it's ready.
+	// Degrading also lets such a console refresh only as many rows per frame as it keeps up with, cycling
+	// through the screen, so each update stays short at the cost of tearing between row bands
+	void SetPresentDegrade(bool bEnable);
+	PresentStats GetPresentStats() const;
+
+	// Scratch memory for the current frame, released after it's presented. Only for the game thread
+	FrameArena& GetFrameArena();
+	const AllocationStats& GetAllocationStats() const;
+
+	void DrawTrueColour(int x, int y, wchar_t c, uint32_t fg, uint32_t bg = EXT_COLOUR_NONE, short col = FG_WHITE);
+
+	// Renders the first person view to the whole draw target using the engine's thread pool
+	void DrawRaycaster(Raycaster& raycaster, float px, float py, float fAngle);
+	void DrawBillboard(const Raycaster& raycaster, float x, float y, const Sprite* sprite, float fScale = 1.0f);
+
+	// Rasterizes into the current draw target, the renderer is resized to the screen if needed
+	void DrawMesh(Renderer3D& renderer, const Mesh& mesh, const Mat4& matModel, short col = FG_WHITE, bool bLit = true, wchar_t c = PIXEL_SOLID);
+
+	// Records every presented frame until StopRecording is called or the engine exits
+	bool StartRecording(const std::wstring& sFileName);
+	bool StopRecording();
+	bool IsRecording() const;
+
+	// Copies the player's current frame into the draw target, call after FramePlayer::Update
+	void DrawRecording(const FramePlayer& player);
+
+	// Captures every presented frame into the rewind buffer, except while it's seeking, see RewindBuffer
+	void EnableRewind(bool bEnable);
+	RewindBuffer& GetRewindBuffer();
+
+	// Copies the sought frame into the draw target, call after RewindBuffer::Seek
+	void DrawRewind(const RewindBuffer& rewind);
+
+	// Reloads tracked sprites and assets when their files under sDirectory change, see AssetWatcher
+	bool WatchAssets(const std::wstring& sDirectory);
+	void StopWatchingAssets();
+
+	// The sprite is reloaded in place and must be untracked before it is destroyed
+	void TrackSprite(Sprite* sprite, const std::wstring& sFileName);
+	void UntrackSprite(Sprite* sprite);
+	void TrackAsset(const std::wstring& sFileName, std::function<void()> fnReload);
+
+	// Calls fnCallback on the game thread before the OnUserUpdate of the frame the timer comes due, see TimerWheel
+	TimerId ScheduleTimer(float fDelay, std::function<void()> fnCallback, float fRepeat = 0.0f);
+	bool CancelTimer(TimerId id);
+	TimerWheel& GetTimers();
+
+#ifdef CONSOLE_GAME_ENGINE_COROUTINES
+	// Runs the script on the game thread, resumed before every OnUserUpdate, see Script
+	void StartScript(Script script);
+	ScriptScheduler& GetScriptScheduler();
+#endif
+
+#ifdef CONSOLE_GAME_ENGINE_STREAMING
+	// Serves every presented frame on a local socket until StopStreaming is called or the engine exits
+	bool StartStreaming(const std::string& sPath);
+	void StopStreaming();
+	bool IsStreaming() const;
+
+	// Copies the client's current frame into the draw target, call after FrameStreamClient::Poll
+	void DrawStream(const FrameStreamClient& client);
+#endif
+
+	// Workers shared by the engine modules, created on first use
+	ThreadPool& GetThreadPool();
+
+	// Scatters the live particles into the current draw target
+	void DrawParticles(const ParticleSystem& particles);
+
+	// Draws a w*h buffer of 0xRRGGBB pixels quantized to the 16 colour palette
+	void DrawRGBBuffer(int x, int y, int w, int h, const uint32_t* pPixels, bool bDither = true);
+
+	static const int SCREEN_LAYER = -1;
+	static const int LAYER_TILE_SIZE = 8;
+
+	// Layers are composited top to bottom by z order before presenting, only tiles that
+	// some layer touched since the last frame are recomposited. Once a layer exists the screen only
+	// holds the composite: cells no layer covers are blank and anything drawn to SCREEN_LAYER is lost
+	// whenever its tile is recomposited, so draw backgrounds into the lowest layer instead
+	int CreateLayer(int nZ = 0);
+	void SetDrawLayer(int nLayer);
+	int GetDrawLayer() const;
+
+	void SetLayerVisible(int nLayer, bool bVisible);
+	void SetLayerZ(int nLayer, int nZ);
+
+	// Cells holding the old alpha glyph are changed to the new one so they stay transparent,
+	// cells that already held the new glyph become transparent too
+	void SetLayerAlphaGlyph(int nLayer, wchar_t c);
+	void ClearLayer(int nLayer);
+
+	// Redirects all drawing into the surface, nullptr goes back to the draw layer. SetDrawLayer unbinds it too
+	void SetDrawTarget(Surface* pSurface);
+	Surface* GetDrawTarget() const;
+
+	// Size of whatever is being drawn to, the screen unless a surface is bound
+	int TargetWidth() const;
+	int TargetHeight() const;
+
+	// The alpha version skips L' ' cells
+	void DrawSurface(int x, int y, const Surface& surface);
+	void DrawSurfaceAlpha(int x, int y, const Surface& surface);
+
+	int GetMouseX() const;
+	int GetMouseY() const;
+
+	const KeyState& GetMouse(short button) const;
+	const KeyState& GetKey(short key) const;
+
+	int ScreenWidth() const;
+	int ScreenHeight() const;
+
+	// Row-major cells of the screen as last drawn, before layers are composited
+	const CHAR_INFO* ScreenBuffer() const;
+
+	// Resizes the screen and layers keeping what's drawn in the overlapping area, then calls OnUserResize.
+	// Happens by itself when the console buffer is resized
+	bool ResizeScreen(int nWidth, int nHeight);
+
+private:
+	void AppThread();
+
+	// Hands the screen to the present thread, replacing the frame it hasn't got to yet
+	void Present();
+	void PresentThread();
+
+	// Writes nRows rows of the frame starting at nFirstRow and wrapping around the bottom
+	void WriteFrame(const CHAR_INFO* pCells, const CellColour* pColours, int nWidth, int nHeight, bool bFull, int nFirstRow, int nRows);
+
+	void MarkDirty(int x1, int y1, int x2, int y2);
+
+	// Copies the fw x fh block at fx, fy of the sprite to x, y row by row after clipping it once.
+	// bAlpha skips L' ' cells and bColourBackground repeats the colour in the background nibble
+	void BlitSprite(int x, int y, int fx, int fy, int fw, int fh, const SpriteView& sprite, bool bAlpha, bool bColourBackground);
+	void BlitSprite(int x, int y, int fx, int fy, int fw, int fh, const IndexedSprite& sprite, bool bAlpha, bool bColourBackground);
+
+	void CompositeLayers();
+
+	// Lays the cells of every layer out for the new screen size and marks all their tiles dirty
+	void ResizeLayers(int nOldWidth, int nOldHeight, int nWidth, int nHeight);
+
+	// Points the m_pTarget* members at the bound surface, the draw layer or the screen
+	void BindTarget();
+
+	// Copies a block of cells to x, y of the draw target after clipping it, bAlpha skips L' ' cells
+	void BlitCells(int x, int y, const CHAR_INFO* pCells, int nWidth, int nHeight, bool bAlpha);
+
+protected:
+	std::wstring sAppName;
+	std::wstring sFont;
+
+private:
+	CHAR_INFO* m_pScreen = nullptr;
+	HANDLE m_hConsoleOut;
+	HANDLE m_hConsoleIn;
+	SMALL_RECT m_rWindow;
+	HWND m_hWindow;
+	HDC m_hDrawContext;
+
+	// Set by ConstructOffscreen, there is no console window to keep in step with the screen
+	bool m_bOffscreen = false;
+
+	KeyState m_aryKeys[256];
+	KeyState m_aryMouse[5];
+
+	short m_nKeyOldState[256];
+	short m_nKeyNewState[256];
+
+	bool m_bMouseOldState[5]{ false };
+	bool m_bMouseNewState[5]{ false };
+
+	int m_nMouseX;
+	int m_nMouseY;
+
+	// Zero until the first Construct*, ResizeLayers reads these as the old size
+	int m_nScreenWidth = 0;
+	int m_nScreenHeight = 0;
+
+	int m_nFontWidth;
+	int m_nFontHeight;
+
+	float m_fDeltaTime;
+
+	std::thread m_thrGame;
+	std::atomic<bool> m_bGameThreadActive;
+	bool m_bFocused = true;
+
+	bool m_bTrueColour = false;
+	CellColour* m_pColours = nullptr;
+
+	// Cells allocated for m_pScreen and m_pColours, grows geometrically on resize
+	size_t m_nScreenCapacity = 0;
+
+	// The console may hold stale cells, e.g. after a resize, so the next present must cover everything
+	bool m_bFullRedraw = true;
+
+	// Owned by the present thread
+	std::wstring m_sVtFrame;
+	VtEncoder m_vtEncoder;
+	std::vector<CHAR_INFO> m_vecPresentCells;
+	std::vector<CellColour> m_vecPresentColours;
+
+	// The frame waiting for the present thread, everything below is guarded by m_muxPresent
+	std::thread m_thrPresent;
+	mutable std::mutex m_muxPresent;
+	std::condition_variable m_cvPresent;
+
+	std::vector<CHAR_INFO> m_vecPendingCells;
+	std::vector<CellColour> m_vecPendingColours;
+	int m_nPendingWidth = 0;
+	int m_nPendingHeight = 0;
+	bool m_bFramePending = false;
+	bool m_bPendingFullRedraw = false;
+	bool m_bPresentActive = false;
+
+	PresentStats m_presentStats;
+
+	std::atomic<bool> m_bSynchronizedOutput{ true };
+	std::atomic<bool> m_bPresentDegrade{ false };
+
+	FrameArena m_frameArena;
+	AllocationStats m_allocationStats;
+
+	ColourQuantizer* m_pQuantizer = nullptr;
+	ThreadPool* m_pThreadPool = nullptr;
+	FrameRecorder* m_pRecorder = nullptr;
+	AssetWatcher* m_pWatcher = nullptr;
+	TimerWheel* m_pTimers = nullptr;
+	RewindBuffer* m_pRewind = nullptr;
+	bool m_bRewind = false;
+
+	// Always declared so C++17 and C++20 translation units agree on the layout, stays null without coroutines
+	ScriptScheduler* m_pScripts = nullptr;
+
+	// Always declared so every translation unit agrees on the layout, stays null without streaming
+	FrameServer* m_pServer = nullptr;
+
+	static const size_t FORMAT_BUFFER_SIZE = 512;
+	wchar_t m_sFormatBuffer[FORMAT_BUFFER_SIZE] = {};
+
+	// Where the drawing routines write to: m_pScreen, the cells of m_pTargetLayer or of m_pTargetSurface.
+	// Only the screen has extended colours, so m_pTargetColours is null otherwise
+	CHAR_INFO* m_pTarget = nullptr;
+	CellColour* m_pTargetColours = nullptr;
+	int m_nTargetWidth = 0;
+	int m_nTargetHeight = 0;
+
+	Layer* m_pTargetLayer = nullptr;
+	int m_nTargetLayer = SCREEN_LAYER;
+	Surface* m_pTargetSurface = nullptr;
+
+	std::vector<Layer*> m_vecLayers;
+	std::vector<Layer*> m_vecLayerOrder;
+	bool m_bLayersChanged = false;
+};
+
+#ifdef CONSOLE_GAME_ENGINE_IMPLEMENTATION
+#undef CONSOLE_GAME_ENGINE_IMPLEMENTATION
+
+#ifdef CONSOLE_GAME_ENGINE_COUNT_ALLOCATIONS
+// Replaces the global allocation functions of the whole program to count heap traffic per frame
+namespace detail
+{
+	// Per thread, so the game thread's frame doesn't pick up what the other threads do meanwhile
+	thread_local uint64_t g_nAllocations = 0;
+	thread_local uint64_t g_nFrees = 0;
+	thread_local uint64_t g_nAllocatedBytes = 0;
+}
+
+void* operator new(size_t nSize)
+{
+	void* p = malloc(nSize > 0 ? nSize : 1);
+
+	if (!p)
+		throw std::bad_alloc();
+
+	detail::g_nAllocations++;
+	detail::g_nAllocatedBytes += nSize;
+
+	return p;
+}
+
+void* operator new[](size_t nSize)
+{
+	return operator new(nSize);
+}
+
+void operator delete(void* p) noexcept
+{
+	if (!p)
+		return;
+
+	detail::g_nFrees++;
+	free(p);
+}
+
+void operator delete[](void* p) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+void operator delete[](void* p, size_t) noexcept
+{
+	operator delete(p);
+}
+
+// Over-aligned types come through these, malloc's memory can't be handed to _aligned_free or the other way round
+void* operator new(size_t nSize, std::align_val_t nAlign)
+{
+	void* p = _aligned_malloc(nSize > 0 ? nSize : 1, (size_t)nAlign);
+
+	if (!p)
+		throw std::bad_alloc();
+
+	detail::g_nAllocations++;
+	detail::g_nAllocatedBytes += nSize;
+
+	return p;
+}
+
+void* operator new[](size_t nSize, std::align_val_t nAlign)
+{
+	return operator new(nSize, nAlign);
+}
+
+void operator delete(void* p, std::align_val_t) noexcept
+{
+	if (!p)
+		return;
+
+	detail::g_nFrees++;
+	_aligned_free(p);
+}
+
+void operator delete[](void* p, std::align_val_t nAlign) noexcept
+{
+	operator delete(p, nAlign);
+}
+
+void operator delete(void* p, size_t, std::align_val_t nAlign) noexcept
+{
+	operator delete(p, nAlign);
+}
+
+void operator delete[](void* p, size_t, std::align_val_t nAlign) noexcept
+{
+	operator delete(p, nAlign);
+}
+#endif
+
+Sprite::Sprite()
+{
+	Create(8, 8);
+}
+
+Sprite::Sprite(int nWidth, int nHeight)
+{
+	Create(nWidth, nHeight);
+}
+
+Sprite::Sprite(const std::wstring& sFileName)
+{
+	if (!Load(sFileName))
+		Create(8, 8);
+}
+
+Sprite::~Sprite()
+{
+	if (m_pGlyphs)
+		delete[] m_pGlyphs;
+
+	if (m_pColours)
+		delete[] m_pColours;
+}
+
+void Sprite::Create(int nWidth, int nHeight)
+{
+	this->nWidth = nWidth;
+	this->nHeight = nHeight;
+
+	m_pGlyphs = new wchar_t[nWidth * nHeight];
+	m_pColours = new short[nWidth * nHeight];
+
+	for (int i = 0; i < nWidth * nHeight; i++)
+	{
+		m_pGlyphs[i] = L' ';
+		m_pColours[i] = FG_BLACK;
+	}
+}
+
+void Sprite::SetGlyph(int x, int y, wchar_t c)
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		m_pGlyphs[y * nWidth + x] = c;
+}
+
+void Sprite::SetColour(int x, int y, short c)
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		m_pColours[y * nWidth + x] = c;
+}
+
+wchar_t Sprite::GetGlyph(int x, int y)
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		return m_pGlyphs[y * nWidth + x];
+
+	return L' ';
+}
+
+short Sprite::GetColour(int x, int y)
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		return m_pColours[y * nWidth + x];
+
+	return FG_BLACK;
+}
+
+const wchar_t* Sprite::GlyphData() const
+{
+	return m_pGlyphs;
+}
+
+const short* Sprite::ColourData() const
+{
+	return m_pColours;
+}
+
+bool Sprite::Save(const std::wstring& sFileName)
+{
+	std::ofstream file(sFileName, std::ios::binary);
+
+	if (!file.is_open())
+		return false;
+
+	auto write = [&](void* data, std::streamsize bytes)
+		{
+			file.write(reinterpret_cast<const char*>(data), bytes);
+			return !file.bad();
+		};
+
+	//file.exceptions(std::ostream::failbit | std::ostream::badbit);
+
+	if (!write(&nWidth, sizeof(int))) return false;
+	if (!write(&nHeight, sizeof(int))) return false;
+
+	std::streamsize nSize = nWidth * nHeight;
+
+	if (!write(m_pGlyphs, nSize * sizeof(wchar_t))) return false;
+	if (!write(m_pColours, nSize * sizeof(short))) return false;
+
+	file.close();
+
+	return true;
+}
+
+bool Sprite::SaveHeader(const std::wstring& sFileName, const std::string& sName) const
+{
+	std::ofstream file(sFileName, std::ios::out);
+
+	if (!file.is_open())
+		return false;
+
+	int nSize = nWidth * nHeight;
+
+	auto writeArray = [&](auto* pData)
+		{
+			file << "\t{";
+
+			for (int i = 0; i < nSize; i++)
+				file << (i % 16 == 0 ? "\n\t\t" : " ") << int(pData[i]) << (i + 1 < nSize ? "," : "");
+
+			file << "\n\t}";
+		};
+
+	file << "#pragma once\n\n";
+	file << "inline constexpr EmbeddedSprite<" << nWidth << ", " << nHeight << "> " << sName << " =\n{\n";
+
+	writeArray(m_pGlyphs);
+	file << ",\n";
+	writeArray(m_pColours);
+
+	file << "\n};\n";
+
+	return !file.bad();
+}
+
+bool Sprite::Load(const std::wstring& sFileName)
+{
+	std::ifstream file(sFileName, std::ios::binary);
+
+	if (!file.is_open())
+		return false;
+
+	auto read = [&](void* data, std::streamsize bytes)
+		{
+			file.read(reinterpret_cast<char*>(data), bytes);
+			return file.gcount() == bytes;
+		};
+
+	int nNewWidth = 0, nNewHeight = 0;
+
+	if (!read(&nNewWidth, sizeof(int))) return false;
+	if (!read(&nNewHeight, sizeof(int))) return false;
+
+	// A file caught halfway through being written can claim any size
+	if (nNewWidth <= 0 || nNewHeight <= 0 || (int64_t)nNewWidth * nNewHeight > INT_MAX / (int)sizeof(wchar_t))
+		return false;
+
+	std::streamsize nSize = (std::streamsize)nNewWidth * nNewHeight;
+
+	std::unique_ptr<wchar_t[]> pGlyphs(new wchar_t[nSize]);
+	std::unique_ptr<short[]> pColours(new short[nSize]);
+
+	if (!read(pGlyphs.get(), nSize * sizeof(wchar_t))) return false;
+	if (!read(pColours.get(), nSize * sizeof(short))) return false;
+
+	delete[] m_pGlyphs;
+	delete[] m_pColours;
+
+	m_pGlyphs = pGlyphs.release();
+	m_pColours = pColours.release();
+
+	nWidth = nNewWidth;
+	nHeight = nNewHeight;
+
+	return true;
+}
+
+void Sprite::Swap(Sprite& other)
+{
+	std::swap(m_pGlyphs, other.m_pGlyphs);
+	std::swap(m_pColours, other.m_pColours);
+	std::swap(nWidth, other.nWidth);
+	std::swap(nHeight, other.nHeight);
+}
+
+const uint32_t ColourQuantizer::DefaultPalette[16] =
+{
+	0x000000, 0x000080, 0x008000, 0x008080,
+	0x800000, 0x800080, 0x808000, 0xC0C0C0,
+	0x808080, 0x0000FF, 0x00FF00, 0x00FFFF,
+	0xFF0000, 0xFF00FF, 0xFFFF00, 0xFFFFFF
+};
+
+SpriteMips::SpriteMips(const SpriteView& sprite)
+{
+	MipLevel level;
+	level.nWidth = sprite.GlyphData() ? sprite.nWidth : 0;
+	level.nHeight = sprite.GlyphData() ? sprite.nHeight : 0;
+	level.vecGlyphs.assign(sprite.GlyphData(), sprite.GlyphData() + level.nWidth * level.nHeight);
+	level.vecColours.assign(sprite.ColourData(), sprite.ColourData() + level.nWidth * level.nHeight);
+
+	m_vecLevels.push_back(std::move(level));
+
+	while (m_vecLevels.back().nWidth > 1 || m_vecLevels.back().nHeight > 1)
+	{
+		const MipLevel& src = m_vecLevels.back();
+
+		MipLevel dst;
+		dst.nWidth = (src.nWidth + 1) / 2;
+		dst.nHeight = (src.nHeight + 1) / 2;
+		dst.vecGlyphs.resize(dst.nWidth * dst.nHeight);
+		dst.vecColours.resize(dst.nWidth * dst.nHeight);
+
+		for (int y = 0; y < dst.nHeight; y++)
+			for (int x = 0; x < dst.nWidth; x++)
+			{
+				int nIndices[4];
+				int nCount = 0;
+				int nVisible = 0;
+
+				// Blocks on the right and bottom edges of odd sized levels are clipped
+				for (int j = 2 * y; j < std::min(2 * y + 2, src.nHeight); j++)
+					for (int i = 2 * x; i < std::min(2 * x + 2, src.nWidth); i++)
+					{
+						nIndices[nCount++] = j * src.nWidth + i;
+
+						if (src.vecGlyphs[j * src.nWidth + i] != L' ')
+							nVisible++;
+					}
+
+				int nBest = nIndices[0];
+
+				if (nVisible * 2 >= nCount)
+				{
+					int nBestVotes = 0;
+
+					// Ties go to the top-left most cell
+					for (int a = 0; a < nCount; a++)
+					{
+						wchar_t c = src.vecGlyphs[nIndices[a]];
+						short col = src.vecColours[nIndices[a]];
+
+						if (c == L' ')
+							continue;
+
+						int nVotes = 0;
+
+						for (int b = 0; b < nCount; b++)
+							if (src.vecGlyphs[nIndices[b]] == c && src.vecColours[nIndices[b]] == col)
+								nVotes++;
+
+						if (nVotes > nBestVotes)
+						{
+							nBest = nIndices[a];
+							nBestVotes = nVotes;
+						}
+					}
+				}
+
+				dst.vecGlyphs[y * dst.nWidth + x] = nVisible * 2 >= nCount ? src.vecGlyphs[nBest] : L' ';
+				dst.vecColours[y * dst.nWidth + x] = src.vecColours[nBest];
+			}
+
+		m_vecLevels.push_back(std::move(dst));
+	}
+}
+
+int SpriteMips::Levels() const
+{
+	return (int)m_vecLevels.size();
+}
+
+SpriteView SpriteMips::Level(int nLevel) const
+{
+	const MipLevel& level = m_vecLevels[std::clamp(nLevel, 0, Levels() - 1)];
+	return SpriteView(level.nWidth, level.nHeight, level.vecGlyphs.data(), level.vecColours.data());
+}
+
+IndexedSprite::IndexedSprite()
+{
+}
+
+IndexedSprite::IndexedSprite(int nWidth, int nHeight)
+{
+	this->nWidth = std::max(nWidth, 0);
+	this->nHeight = std::max(nHeight, 0);
+
+	// Index 0 starts out blank, the same as a new Sprite
+	m_vecIndices.assign((size_t)this->nWidth * (size_t)this->nHeight, 0);
+	PaletteIndex(L' ', FG_BLACK);
+}
+
+bool IndexedSprite::FromSprite(const SpriteView& sprite)
+{
+	IndexedSprite result(sprite.nWidth, sprite.nHeight);
+
+	if (!sprite.GlyphData())
+		return false;
+
+	for (int i = 0; i < result.nWidth * result.nHeight; i++)
+	{
+		int nIndex = result.PaletteIndex(sprite.GlyphData()[i], sprite.ColourData()[i]);
+
+		if (nIndex < 0)
+			return false;
+
+		result.m_vecIndices[i] = (uint8_t)nIndex;
+	}
+
+	*this = std::move(result);
+	return true;
+}
+
+int IndexedSprite::PaletteIndex(wchar_t c, short col)
+{
+	for (size_t i = 0; i < m_vecPalette.size(); i++)
+	{
+		if (m_vecPalette[i].Char.UnicodeChar == c && m_vecPalette[i].Attributes == col)
+			return (int)i;
+	}
+
+	if (m_vecPalette.size() >= MAX_PALETTE_SIZE)
+		return -1;
+
+	CHAR_INFO entry;
+	entry.Char.UnicodeChar = c;
+	entry.Attributes = col;
+
+	m_vecPalette.push_back(entry);
+
+	return (int)m_vecPalette.size() - 1;
+}
+
+bool IndexedSprite::SetCell(int x, int y, wchar_t c, short col)
+{
+	if (x < 0 || x >= nWidth || y < 0 || y >= nHeight)
+		return false;
+
+	int nIndex = PaletteIndex(c, col);
+
+	if (nIndex < 0)
+		return false;
+
+	m_vecIndices[y * nWidth + x] = (uint8_t)nIndex;
+	return true;
+}
+
+void IndexedSprite::SetIndex(int x, int y, uint8_t nIndex)
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight && nIndex < m_vecPalette.size())
+		m_vecIndices[y * nWidth + x] = nIndex;
+}
+
+wchar_t IndexedSprite::GetGlyph(int x, int y) const
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		return m_vecPalette[m_vecIndices[y * nWidth + x]].Char.UnicodeChar;
+
+	return L' ';
+}
+
+short IndexedSprite::GetColour(int x, int y) const
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		return m_vecPalette[m_vecIndices[y * nWidth + x]].Attributes;
+
+	return FG_BLACK;
+}
+
+uint8_t IndexedSprite::GetIndex(int x, int y) const
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		return m_vecIndices[y * nWidth + x];
+
+	return 0;
+}
+
+int IndexedSprite::PaletteSize() const
+{
+	return (int)m_vecPalette.size();
+}
+
+const CHAR_INFO* IndexedSprite::PaletteData() const
+{
+	return m_vecPalette.data();
+}
+
+const uint8_t* IndexedSprite::IndexData() const
+{
+	return m_vecIndices.data();
+}
+
+ColourQuantizer::ColourQuantizer(const uint32_t* pPalette)
+{
+	if (!pPalette)
+		pPalette = DefaultPalette;
+
+	struct Candidate
+	{
+		int r, g, b;
+		CHAR_INFO cell;
+	};
+
+	std::vector<Candidate> vecCandidates;
+
+	auto addCandidate = [&](wchar_t glyph, int fg, int bg, int nCoverage)
+		{
+			uint32_t f = pPalette[fg], k = pPalette[bg];
+
+			Candidate c;
+			c.r = (((f >> 16) & 0xFF) * nCoverage + ((k >> 16) & 0xFF) * (4 - nCoverage)) / 4;
+			c.g = (((f >> 8) & 0xFF) * nCoverage + ((k >> 8) & 0xFF) * (4 - nCoverage)) / 4;
+			c.b = ((f & 0xFF) * nCoverage + (k & 0xFF) * (4 - nCoverage)) / 4;
+			c.cell.Char.UnicodeChar = glyph;
+			c.cell.Attributes = short(fg | (bg << 4));
+
+			vecCandidates.push_back(c);
+		};
+
+	// A quarter shade of (fg, bg) looks like three quarters of (bg, fg) and half shades are symmetric,
+	// so only the unique mixes are considered
+	for (int fg = 0; fg < 16; fg++)
+	{
+		addCandidate(PIXEL_SOLID, fg, fg, 4);
+
+		for (int bg = 0; bg < 16; bg++)
+		{
+			if (fg == bg)
+				continue;
+
+			addCandidate(PIXEL_THREEQUARTERS, fg, bg, 3);
+
+			if (fg < bg)
+				addCandidate(PIXEL_HALF, fg, bg, 2);
+		}
+	}
+
+	m_vecLut.resize(LUT_SIZE);
+
+	const int nStep = 256 >> LUT_BITS;
+	const int nMask = (1 << LUT_BITS) - 1;
+
+	for (int i = 0; i < LUT_SIZE; i++)
+	{
+		int r = ((i >> (LUT_BITS * 2)) & nMask) * nStep + nStep / 2;
+		int g = ((i >> LUT_BITS) & nMask) * nStep + nStep / 2;
+		int b = (i & nMask) * nStep + nStep / 2;
+
+		int nBestDist = INT32_MAX;
+		const Candidate* pBest = &vecCandidates[0];
+
+		for (const auto& c : vecCandidates)
+		{
+			// Cheap perceptual weighting, green matters most and blue least
+			int dr = r - c.r, dg = g - c.g, db = b - c.b;
+			int nDist = 3 * dr * dr + 4 * dg * dg + 2 * db * db;
+
+			if (nDist < nBestDist)
+			{
+				nBestDist = nDist;
+				pBest = &c;
+			}
+		}
+
+		m_vecLut[i] = pBest->cell;
+	}
+}
+
+CHAR_INFO ColourQuantizer::Quantize(uint32_t rgb) const
+{
+	const int nShift = 8 - LUT_BITS;
+	const uint32_t nMask = (1 << LUT_BITS) - 1;
+
+	uint32_t i = (((rgb >> (16 + nShift)) & nMask) << (LUT_BITS * 2)) |
+		(((rgb >> (8 + nShift)) & nMask) << LUT_BITS) |
+		((rgb >> nShift) & nMask);
+
+	return m_vecLut[i];
+}
+
+void ColourQuantizer::Convert(const uint32_t* pSrc, int nWidth, int nHeight, int nSrcStride,
+	CHAR_INFO* pDst, int nDstStride, int nOriginX, int nOriginY, int nDitherAmount) const
+{
+	static const int nBayer[4][4] =
+	{
+		{  0,  8,  2, 10 },
+		{ 12,  4, 14,  6 },
+		{  3, 11,  1,  9 },
+		{ 15,  7, 13,  5 }
+	};
+
+	const int nShift = 8 - LUT_BITS;
+	const uint32_t nMask = (1 << LUT_BITS) - 1;
+
+	nDitherAmount = std::min(std::max(nDitherAmount, 0), 255);
+
+	for (int y = 0; y < nHeight; y++)
+	{
+		const uint32_t* pRow = pSrc + y * nSrcStride;
+		CHAR_INFO* pOut = pDst + y * nDstStride;
+
+		// Per-column offsets of this row, split into saturating add and subtract parts for every channel
+		int nOffset[4];
+		alignas(16) uint32_t nAdd[4];
+		alignas(16) uint32_t nSub[4];
+
+		for (int i = 0; i < 4; i++)
+		{
+			int b = nBayer[(nOriginY + y) & 3][(nOriginX + i) & 3];
+			nOffset[i] = ((2 * b + 1) * nDitherAmount) / 32 - nDitherAmount / 2;
+
+			nAdd[i] = nOffset[i] > 0 ? uint32_t(nOffset[i]) * 0x010101 : 0;
+			nSub[i] = nOffset[i] < 0 ? uint32_t(-nOffset[i]) * 0x010101 : 0;
+		}
+
+		int x = 0;
+
+#ifdef CONSOLE_GAME_ENGINE_SSE2
+		const __m128i vAdd = _mm_load_si128((const __m128i*)nAdd);
+		const __m128i vSub = _mm_load_si128((const __m128i*)nSub);
+		const __m128i vMask = _mm_set1_epi32(nMask);
+
+		alignas(16) uint32_t nIndex[4];
+
+		for (; x + 4 <= nWidth; x += 4)
+		{
+			__m128i p = _mm_loadu_si128((const __m128i*)(pRow + x));
+			p = _mm_subs_epu8(_mm_adds_epu8(p, vAdd), vSub);
+
+			__m128i r = _mm_and_si128(_mm_srli_epi32(p, 16 + nShift), vMask);
+			__m128i g = _mm_and_si128(_mm_srli_epi32(p, 8 + nShift), vMask);
+			__m128i b = _mm_and_si128(_mm_srli_epi32(p, nShift), vMask);
+
+			__m128i i = _mm_or_si128(_mm_or_si128(_mm_slli_epi32(r, LUT_BITS * 2), _mm_slli_epi32(g, LUT_BITS)), b);
+			_mm_store_si128((__m128i*)nIndex, i);
+
+			pOut[x + 0] = m_vecLut[nIndex[0]];
+			pOut[x + 1] = m_vecLut[nIndex[1]];
+			pOut[x + 2] = m_vecLut[nIndex[2]];
+			pOut[x + 3] = m_vecLut[nIndex[3]];
+		}
+#endif
+
+		for (; x < nWidth; x++)
+		{
+			uint32_t p = pRow[x];
+			int o = nOffset[x & 3];
+
+			auto channel = [&](int nBit)
+				{
+					int c = int((p >> nBit) & 0xFF) + o;
+					return uint32_t(std::min(std::max(c, 0), 255)) >> nShift;
+				};
+
+			pOut[x] = m_vecLut[(channel(16) << (LUT_BITS * 2)) | (channel(8) << LUT_BITS) | channel(0)];
+		}
+	}
+}
+
+SpatialGrid::SpatialGrid(int nWorldWidth, int nWorldHeight, int nBucketSize)
+{
+	m_nWorldWidth = std::max(nWorldWidth, 1);
+	m_nWorldHeight = std::max(nWorldHeight, 1);
+	m_nBucketSize = std::max(nBucketSize, 1);
+
+	m_nBucketsX = (m_nWorldWidth + m_nBucketSize - 1) / m_nBucketSize;
+	m_nBucketsY = (m_nWorldHeight + m_nBucketSize - 1) / m_nBucketSize;
+
+	m_vecHeads.resize(m_nBucketsX * m_nBucketsY, NONE);
+}
+
+void SpatialGrid::Insert(int nId, int x, int y, int w, int h)
+{
+	if (nId < 0)
+		return;
+
+	if (nId >= (int)m_vecBucket.size())
+	{
+		size_t nSize = std::max<size_t>(nId + 1, m_vecBucket.size() * 2);
+
+		m_vecBounds.resize(nSize);
+		m_vecBucket.resize(nSize, NONE);
+		m_vecNext.resize(nSize, NONE);
+		m_vecPrev.resize(nSize, NONE);
+	}
+	else if (m_vecBucket[nId] != NONE)
+	{
+		Move(nId, x, y, w, h);
+		return;
+	}
+
+	m_vecBounds[nId] = { x, y, std::max(w, 1), std::max(h, 1) };
+	AddExtent(m_vecBounds[nId].w, m_vecBounds[nId].h);
+
+	Link(nId, BucketY(y) * m_nBucketsX + BucketX(x));
+	m_nCount++;
+}
+
+void SpatialGrid::Move(int nId, int x, int y)
+{
+	if (!Contains(nId))
+		return;
+
+	m_vecBounds[nId].x = x;
+	m_vecBounds[nId].y = y;
+
+	int nBucket = BucketY(y) * m_nBucketsX + BucketX(x);
+
+	if (nBucket != m_vecBucket[nId])
+	{
+		Unlink(nId);
+		Link(nId, nBucket);
+	}
+}
+
+void SpatialGrid::Move(int nId, int x, int y, int w, int h)
+{
+	if (!Contains(nId))
+		return;
+
+	RemoveExtent(m_vecBounds[nId].w, m_vecBounds[nId].h);
+
+	m_vecBounds[nId].w = std::max(w, 1);
+	m_vecBounds[nId].h = std::max(h, 1);
+
+	AddExtent(m_vecBounds[nId].w, m_vecBounds[nId].h);
+
+	Move(nId, x, y);
+}
+
+void SpatialGrid::Remove(int nId)
+{
+	if (!Contains(nId))
+		return;
+
+	Unlink(nId);
+	RemoveExtent(m_vecBounds[nId].w, m_vecBounds[nId].h);
+
+	m_vecBucket[nId] = NONE;
+	m_nCount--;
+}
+
+void SpatialGrid::Clear()
+{
+	std::fill(m_vecHeads.begin(), m_vecHeads.end(), NONE);
+	std::fill(m_vecBucket.begin(), m_vecBucket.end(), NONE);
+	std::fill(m_vecWidthCount.begin(), m_vecWidthCount.end(), 0);
+	std::fill(m_vecHeightCount.begin(), m_vecHeightCount.end(), 0);
+
+	m_nMaxWidth = 1;
+	m_nMaxHeight = 1;
+	m_nCount = 0;
+}
+
+bool SpatialGrid::Contains(int nId) const
+{
+	return nId >= 0 && nId < (int)m_vecBucket.size() && m_vecBucket[nId] != NONE;
+}
+
+int SpatialGrid::Count() const
+{
+	return m_nCount;
+}
+
+void SpatialGrid::QueryRect(int x, int y, int w, int h, std::vector<int>& vecOut) const
+{
+	QueryRect(x, y, w, h, [&](int i) { vecOut.push_back(i); });
+}
+
+void SpatialGrid::QueryRadius(int cx, int cy, int r, std::vector<int>& vecOut) const
+{
+	QueryRadius(cx, cy, r, [&](int i) { vecOut.push_back(i); });
+}
+
+void SpatialGrid::QueryCell(int x, int y, std::vector<int>& vecOut) const
+{
+	QueryCell(x, y, [&](int i) { vecOut.push_back(i); });
+}
+
+void SpatialGrid::AddExtent(int w, int h)
+{
+	if (w >= (int)m_vecWidthCount.size())
+		m_vecWidthCount.resize(w + 1, 0);
+
+	if (h >= (int)m_vecHeightCount.size())
+		m_vecHeightCount.resize(h + 1, 0);
+
+	m_vecWidthCount[w]++;
+	m_vecHeightCount[h]++;
+
+	m_nMaxWidth = std::max(m_nMaxWidth, w);
+	m_nMaxHeight = std::max(m_nMaxHeight, h);
+}
+
+void SpatialGrid::RemoveExtent(int w, int h)
+{
+	m_vecWidthCount[w]--;
+	m_vecHeightCount[h]--;
+
+	// Only removing the largest object walks down, and never further than the next largest
+	while (m_nMaxWidth > 1 && m_vecWidthCount[m_nMaxWidth] == 0)
+		m_nMaxWidth--;
+
+	while (m_nMaxHeight > 1 && m_vecHeightCount[m_nMaxHeight] == 0)
+		m_nMaxHeight--;
+}
+
+void SpatialGrid::Link(int nId, int nBucket)
+{
+	int nHead = m_vecHeads[nBucket];
+
+	m_vecBucket[nId] = nBucket;
+	m_vecPrev[nId] = NONE;
+	m_vecNext[nId] = nHead;
+
+	if (nHead != NONE)
+		m_vecPrev[nHead] = nId;
+
+	m_vecHeads[nBucket] = nId;
+}
+
+void SpatialGrid::Unlink(int nId)
+{
+	int nPrev = m_vecPrev[nId];
+	int nNext = m_vecNext[nId];
+
+	if (nPrev != NONE)
+		m_vecNext[nPrev] = nNext;
+	else
+		m_vecHeads[m_vecBucket[nId]] = nNext;
+
+	if (nNext != NONE)
+		m_vecPrev[nNext] = nPrev;
+}
+
+ThreadPool::ThreadPool(int nWorkers)
+{
+	if (nWorkers < 0)
+		nWorkers = std::max(1, (int)std::thread::hardware_concurrency()) - 1;
+
+	for (int i = 0; i < nWorkers; i++)
+		m_vecWorkers.emplace_back(&ThreadPool::WorkerThread, this);
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(m_muxState);
+		m_bQuit = true;
+	}
+
+	m_cvWork.notify_all();
+
+	for (auto& worker : m_vecWorkers)
+		worker.join();
+}
+
+int ThreadPool::ThreadCount() const
+{
+	return (int)m_vecWorkers.size() + 1;
+}
+
+void ThreadPool::Dispatch(size_t nBegin, size_t nEnd, size_t nGrain, void* pData, void (*pInvoke)(void*, size_t, size_t))
+{
+	if (nBegin >= nEnd)
+		return;
+
+	nGrain = std::max<size_t>(nGrain, 1);
+
+	if (InsideJob() || m_vecWorkers.empty() || nEnd - nBegin <= nGrain)
+	{
+		for (size_t i = nBegin; i < nEnd; i += nGrain)
+			pInvoke(pData, i, std::min(i + nGrain, nEnd));
+
+		return;
+	}
+
+	std::lock_guard<std::mutex> dispatch(m_muxDispatch);
+
+	{
+		std::lock_guard<std::mutex> lock(m_muxState);
+
+		m_pJobData = pData;
+		m_pJobInvoke = pInvoke;
+		m_nJobEnd = nEnd;
+		m_nJobGrain = nGrain;
+		m_nJobNext = nBegin;
+
+		m_nActive = (int)m_vecWorkers.size();
+		m_nGeneration++;
+	}
+
+	m_cvWork.notify_all();
+
+	Work();
+
+	std::unique_lock<std::mutex> lock(m_muxState);
+	m_cvDone.wait(lock, [this] { return m_nActive == 0; });
+}
+
+void ThreadPool::WorkerThread()
+{
+	uint64_t nSeen = 0;
+
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(m_muxState);
+			m_cvWork.wait(lock, [&] { return m_bQuit || m_nGeneration != nSeen; });
+
+			if (m_bQuit)
+				return;
+
+			nSeen = m_nGeneration;
+		}
+
+		Work();
+
+		std::lock_guard<std::mutex> lock(m_muxState);
+
+		if (--m_nActive == 0)
+			m_cvDone.notify_one();
+	}
+}
+
+void ThreadPool::Work()
+{
+	InsideJob() = true;
+
+	while (true)
+	{
+		size_t i = m_nJobNext.fetch_add(m_nJobGrain);
+
+		if (i >= m_nJobEnd)
+			break;
+
+		m_pJobInvoke(m_pJobData, i, std::min(i + m_nJobGrain, m_nJobEnd));
+	}
+
+	InsideJob() = false;
+}
+
+bool& ThreadPool::InsideJob()
+{
+	static thread_local bool bInside = false;
+	return bInside;
+}
+
+EntityWorld::EntityWorld()
+{
+	GetArchetype(0);
+}
+
+EntityWorld::~EntityWorld()
+{
+	for (auto a : m_vecArchetypes)
+		delete a;
+}
+
+uint32_t EntityWorld::NextComponentId()
+{
+	static std::atomic<uint32_t> nNext{ 0 };
+	uint32_t nId = nNext++;
+
+	// The component masks and per archetype tables only have room for MAX_COMPONENTS types,
+	// going on would index past them
+	if (nId >= (uint32_t)MAX_COMPONENTS)
+		std::terminate();
+
+	return nId;
+}
+
+Entity EntityWorld::Create()
+{
+	uint32_t nIndex;
+
+	if (m_vecFreeIndices.empty())
+	{
+		nIndex = (uint32_t)m_vecRecords.size();
+		m_vecRecords.emplace_back();
+	}
+	else
+	{
+		nIndex = m_vecFreeIndices.back();
+		m_vecFreeIndices.pop_back();
+	}
+
+	Archetype* pRoot = m_mapArchetypes[0];
+	Record& r = m_vecRecords[nIndex];
+
+	Entity e = { nIndex, r.nGeneration };
+
+	r.pArchetype = pRoot;
+	r.nRow = (uint32_t)pRoot->vecEntities.size();
+	pRoot->vecEntities.push_back(e);
+
+	m_nCount++;
+
+	return e;
+}
+
+void EntityWorld::Destroy(Entity e)
+{
+	if (!IsAlive(e))
+		return;
+
+	Record& r = m_vecRecords[e.nIndex];
+
+	RemoveRow(r.pArchetype, r.nRow);
+
+	r.pArchetype = nullptr;
+	r.nGeneration++;
+
+	m_vecFreeIndices.push_back(e.nIndex);
+	m_nCount--;
+}
+
+bool EntityWorld::IsAlive(Entity e) const
+{
+	return e.nIndex < m_vecRecords.size() && m_vecRecords[e.nIndex].pArchetype && m_vecRecords[e.nIndex].nGeneration == e.nGeneration;
+}
+
+size_t EntityWorld::Count() const
+{
+	return m_nCount;
+}
+
+EntityWorld::Archetype* EntityWorld::GetArchetype(uint64_t nMask)
+{
+	auto it = m_mapArchetypes.find(nMask);
+
+	if (it != m_mapArchetypes.end())
+		return it->second;
+
+	Archetype* a = new Archetype;
+	a->nMask = nMask;
+
+	for (int i = 0; i < MAX_COMPONENTS; i++)
+	{
+		a->nColumnOf[i] = -1;
+
+		if (nMask & (uint64_t(1) << i))
+		{
+			a->nColumnOf[i] = (int8_t)a->vecColumns.size();
+			a->vecColumns.push_back({ (uint32_t)i, m_nComponentSize[i], {} });
+		}
+	}
+
+	m_vecArchetypes.push_back(a);
+	m_mapArchetypes[nMask] = a;
+
+	return a;
+}
+
+void EntityWorld::MoveTo(uint32_t nIndex, Archetype* pDest)
+{
+	Record& r = m_vecRecords[nIndex];
+	Archetype* pSource = r.pArchetype;
+
+	if (pSource == pDest)
+		return;
+
+	uint32_t nNewRow = (uint32_t)pDest->vecEntities.size();
+	pDest->vecEntities.push_back({ nIndex, r.nGeneration });
+
+	for (auto& column : pDest->vecColumns)
+	{
+		size_t nOffset = (size_t)nNewRow * column.nElementSize;
+		column.vecData.resize(nOffset + column.nElementSize);
+
+		int nSourceColumn = pSource->nColumnOf[column.nComponent];
+
+		if (nSourceColumn >= 0)
+			memcpy(column.vecData.data() + nOffset, pSource->vecColumns[nSourceColumn].vecData.data() + (size_t)r.nRow * column.nElementSize, column.nElementSize);
+	}
+
+	RemoveRow(pSource, r.nRow);
+
+	r.pArchetype = pDest;
+	r.nRow = nNewRow;
+}
+
+void EntityWorld::RemoveRow(Archetype* a, uint32_t nRow)
+{
+	uint32_t nLast = (uint32_t)a->vecEntities.size() - 1;
+
+	// Keep the columns packed by moving the last row into the hole
+	if (nRow != nLast)
+	{
+		for (auto& column : a->vecColumns)
+			memcpy(column.vecData.data() + (size_t)nRow * column.nElementSize, column.vecData.data() + (size_t)nLast * column.nElementSize, column.nElementSize);
+
+		a->vecEntities[nRow] = a->vecEntities[nLast];
+		m_vecRecords[a->vecEntities[nRow].nIndex].nRow = nRow;
+	}
+
+	a->vecEntities.pop_back();
+
+	for (auto& column : a->vecColumns)
+		column.vecData.resize((size_t)nLast * column.nElementSize);
+}
+
+ParticleSystem::ParticleSystem(size_t nCapacity)
+{
+	m_nCapacity = nCapacity;
+
+	m_vecX.resize(nCapacity);
+	m_vecY.resize(nCapacity);
+	m_vecVelX.resize(nCapacity);
+	m_vecVelY.resize(nCapacity);
+	m_vecAge.resize(nCapacity);
+	m_vecInvLifetime.resize(nCapacity);
+}
+
+bool ParticleSystem::Emit(float x, float y, float vx, float vy, float fLifetime)
+{
+	if (m_nCount >= m_nCapacity || fLifetime <= 0.0f)
+		return false;
+
+	size_t i = m_nCount++;
+
+	m_vecX[i] = x;
+	m_vecY[i] = y;
+	m_vecVelX[i] = vx;
+	m_vecVelY[i] = vy;
+	m_vecAge[i] = 0.0f;
+	m_vecInvLifetime[i] = 1.0f / fLifetime;
+
+	return true;
+}
+
+int ParticleSystem::EmitBurst(float x, float y, int nCount, float fSpeedMin, float fSpeedMax, float fLifeMin, float fLifeMax)
+{
+	int nEmitted = 0;
+
+	for (; nEmitted < nCount; nEmitted++)
+	{
+		float fAngle = Random() * 6.2831853f;
+		float fSpeed = fSpeedMin + (fSpeedMax - fSpeedMin) * Random();
+		float fLife = fLifeMin + (fLifeMax - fLifeMin) * Random();
+
+		if (!Emit(x, y, cosf(fAngle) * fSpeed, sinf(fAngle) * fSpeed, fLife))
+			break;
+	}
+
+	return nEmitted;
+}
+
+void ParticleSystem::Update(float fDeltaTime)
+{
+	float* px = m_vecX.data();
+	float* py = m_vecY.data();
+	float* pvx = m_vecVelX.data();
+	float* pvy = m_vecVelY.data();
+	float* pAge = m_vecAge.data();
+
+	size_t i = 0;
+
+#ifdef CONSOLE_GAME_ENGINE_SSE2
+	const __m128 vDt = _mm_set1_ps(fDeltaTime);
+	const __m128 vGx = _mm_set1_ps(m_fGravityX * fDeltaTime);
+	const __m128 vGy = _mm_set1_ps(m_fGravityY * fDeltaTime);
+
+	for (; i + 4 <= m_nCount; i += 4)
+	{
+		__m128 vx = _mm_loadu_ps(pvx + i);
+		__m128 vy = _mm_loadu_ps(pvy + i);
+
+		_mm_storeu_ps(px + i, _mm_add_ps(_mm_loadu_ps(px + i), _mm_mul_ps(vx, vDt)));
+		_mm_storeu_ps(py + i, _mm_add_ps(_mm_loadu_ps(py + i), _mm_mul_ps(vy, vDt)));
+		_mm_storeu_ps(pvx + i, _mm_add_ps(vx, vGx));
+		_mm_storeu_ps(pvy + i, _mm_add_ps(vy, vGy));
+		_mm_storeu_ps(pAge + i, _mm_add_ps(_mm_loadu_ps(pAge + i), vDt));
+	}
+#endif
+
+	for (; i < m_nCount; i++)
+	{
+		px[i] += pvx[i] * fDeltaTime;
+		py[i] += pvy[i] * fDeltaTime;
+		pvx[i] += m_fGravityX * fDeltaTime;
+		pvy[i] += m_fGravityY * fDeltaTime;
+		pAge[i] += fDeltaTime;
+	}
+
+	// Swap dead particles with the last live one to keep the arrays packed
+	for (i = 0; i < m_nCount;)
+	{
+		if (pAge[i] * m_vecInvLifetime[i] >= 1.0f)
+		{
+			size_t nLast = --m_nCount;
+
+			px[i] = px[nLast];
+			py[i] = py[nLast];
+			pvx[i] = pvx[nLast];
+			pvy[i] = pvy[nLast];
+			pAge[i] = pAge[nLast];
+			m_vecInvLifetime[i] = m_vecInvLifetime[nLast];
+		}
+		else
+			i++;
+	}
+}
+
+void ParticleSystem::Clear()
+{
+	m_nCount = 0;
+}
+
+void ParticleSystem::SetGravity(float gx, float gy)
+{
+	m_fGravityX = gx;
+	m_fGravityY = gy;
+}
+
+void ParticleSystem::SetRamp(const wchar_t* pGlyphs, const short* pColours, int nStops)
+{
+	m_nRampStops = std::min(std::max(nStops, 1), MAX_RAMP_STOPS);
+
+	for (int i = 0; i < m_nRampStops; i++)
+	{
+		m_cRampGlyphs[i] = pGlyphs ? pGlyphs[i] : PIXEL_SOLID;
+		m_nRampColours[i] = pColours ? pColours[i] : FG_WHITE;
+	}
+}
+
+void ParticleSystem::Render(CHAR_INFO* pCells, int nWidth, int nHeight, SMALL_RECT& rTouched, CellColour* pColours) const
+{
+	int nMinX = nWidth, nMinY = nHeight, nMaxX = -1, nMaxY = -1;
+
+	const float fWidth = (float)nWidth;
+	const float fHeight = (float)nHeight;
+	const float fStops = (float)m_nRampStops;
+
+	auto plot = [&](size_t i, int x, int y)
+		{
+			int nStop = std::min((int)(m_vecAge[i] * m_vecInvLifetime[i] * fStops), m_nRampStops - 1);
+			int nCell = y * nWidth + x;
+
+			pCells[nCell].Char.UnicodeChar = m_cRampGlyphs[nStop];
+			pCells[nCell].Attributes = m_nRampColours[nStop];
+
+			if (pColours)
+				pColours[nCell] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+		};
+
+	for (size_t nBatch = 0; nBatch < m_nCount; nBatch += RENDER_BATCH)
+	{
+		size_t nEnd = std::min(nBatch + RENDER_BATCH, m_nCount);
+
+		float fMinX = m_vecX[nBatch], fMaxX = fMinX;
+		float fMinY = m_vecY[nBatch], fMaxY = fMinY;
+
+		// std::min and std::max skip a NaN that isn't first, so it has to be looked for separately
+		bool bNaN = false;
+
+		for (size_t i = nBatch; i < nEnd; i++)
+		{
+			fMinX = std::min(fMinX, m_vecX[i]);
+			fMaxX = std::max(fMaxX, m_vecX[i]);
+			fMinY = std::min(fMinY, m_vecY[i]);
+			fMaxY = std::max(fMaxY, m_vecY[i]);
+
+			bNaN |= std::isnan(m_vecX[i]) || std::isnan(m_vecY[i]);
+		}
+
+		if (fMaxX < 0.0f || fMaxY < 0.0f || fMinX >= fWidth || fMinY >= fHeight)
+			continue;
+
+		// A batch holding a NaN takes the clipped path, which never plots the NaN particle
+		if (!bNaN && fMinX >= 0.0f && fMinY >= 0.0f && fMaxX < fWidth && fMaxY < fHeight)
+		{
+			// The whole batch is on screen so individual particles need no clipping
+			for (size_t i = nBatch; i < nEnd; i++)
+				plot(i, (int)m_vecX[i], (int)m_vecY[i]);
+
+			nMinX = std::min(nMinX, (int)fMinX);
+			nMinY = std::min(nMinY, (int)fMinY);
+			nMaxX = std::max(nMaxX, (int)fMaxX);
+			nMaxY = std::max(nMaxY, (int)fMaxY);
+		}
+		else
+		{
+			for (size_t i = nBatch; i < nEnd; i++)
+			{
+				if (m_vecX[i] >= 0.0f && m_vecX[i] < fWidth && m_vecY[i] >= 0.0f && m_vecY[i] < fHeight)
+				{
+					int x = (int)m_vecX[i];
+					int y = (int)m_vecY[i];
+
+					plot(i, x, y);
+
+					nMinX = std::min(nMinX, x);
+					nMinY = std::min(nMinY, y);
+					nMaxX = std::max(nMaxX, x);
+					nMaxY = std::max(nMaxY, y);
+				}
+			}
+		}
+	}
+
+	if (nMaxX < 0)
+		rTouched = { 0, 0, -1, -1 };
+	else
+		rTouched = { (short)nMinX, (short)nMinY, (short)nMaxX, (short)nMaxY };
+}
+
+size_t ParticleSystem::Count() const
+{
+	return m_nCount;
+}
+
+size_t ParticleSystem::Capacity() const
+{
+	return m_nCapacity;
+}
+
+float ParticleSystem::Random()
+{
+	m_nRandomState ^= m_nRandomState << 13;
+	m_nRandomState ^= m_nRandomState >> 17;
+	m_nRandomState ^= m_nRandomState << 5;
+
+	return (m_nRandomState >> 8) * (1.0f / 16777216.0f);
+}
+
+PathFinder::PathFinder(int nWidth, int nHeight, int nClusterSize, bool bDiagonal)
+{
+	m_nWidth = std::max(nWidth, 1);
+	m_nHeight = std::max(nHeight, 1);
+	m_bDiagonal = bDiagonal;
+
+	// Clusters always exist because cached paths are invalidated per cluster
+	m_bHierarchical = nClusterSize > 0;
+	m_nClusterSize = nClusterSize > 0 ? std::max(nClusterSize, 4) : 16;
+
+	m_nClustersX = (m_nWidth + m_nClusterSize - 1) / m_nClusterSize;
+	m_nClustersY = (m_nHeight + m_nClusterSize - 1) / m_nClusterSize;
+
+	size_t nCells = (size_t)m_nWidth * (size_t)m_nHeight;
+
+	m_vecCost.resize(nCells, 1);
+	m_vecG.resize(nCells);
+	m_vecParent.resize(nCells);
+	m_vecSeen.resize(nCells, 0);
+	m_vecClosed.resize(nCells, 0);
+	m_vecNodeIndex.resize(nCells, -1);
+
+	m_vecClusters.resize(m_nClustersX * m_nClustersY);
+	m_vecEastBorders.resize(m_vecClusters.size());
+	m_vecSouthBorders.resize(m_vecClusters.size());
+	m_vecRebuild.resize(m_vecClusters.size());
+}
+
+void PathFinder::SetCost(int x, int y, uint8_t nCost)
+{
+	if (x < 0 || x >= m_nWidth || y < 0 || y >= m_nHeight)
+		return;
+
+	int nCell = y * m_nWidth + x;
+
+	if (m_vecCost[nCell] == nCost)
+		return;
+
+	m_vecCost[nCell] = nCost;
+
+	Cluster& c = m_vecClusters[ClusterOf(nCell)];
+	c.nVersion++;
+	c.bDirty = true;
+
+	m_bDirty = true;
+}
+
+uint8_t PathFinder::GetCost(int x, int y) const
+{
+	if (x < 0 || x >= m_nWidth || y < 0 || y >= m_nHeight)
+		return 0;
+
+	return m_vecCost[y * m_nWidth + x];
+}
+
+bool PathFinder::FindPath(int sx, int sy, int gx, int gy, Path& vecPath)
+{
+	vecPath.clear();
+
+	if (GetCost(sx, sy) == 0 || GetCost(gx, gy) == 0)
+		return false;
+
+	int nStart = sy * m_nWidth + sx;
+	int nGoal = gy * m_nWidth + gx;
+
+	CacheEntry& entry = m_cache[(uint32_t(nStart) * 2654435761u ^ uint32_t(nGoal)) % CACHE_SIZE];
+
+	if (entry.nStart == nStart && entry.nGoal == nGoal)
+	{
+		bool bValid = true;
+
+		for (const auto& v : entry.vecVersions)
+		{
+			if (m_vecClusters[v.first].nVersion != v.second)
+			{
+				bValid = false;
+				break;
+			}
+		}
+
+		if (bValid)
+		{
+			vecPath = entry.vecPath;
+			return true;
+		}
+	}
+
+	Refresh();
+
+	bool bFound = false;
+	int nDistance = std::max(abs(gx - sx), abs(gy - sy));
+
+	if (!m_bHierarchical || nDistance <= m_nClusterSize || m_vecClusters.size() <= 4)
+	{
+		if (Search(nStart, nGoal, 0, 0, m_nWidth - 1, m_nHeight - 1))
+		{
+			AppendPath(nStart, nGoal, vecPath);
+			bFound = true;
+		}
+	}
+	else
+		bFound = FindAbstractPath(nStart, nGoal, vecPath);
+
+	if (!bFound)
+		return false;
+
+	entry.nStart = nStart;
+	entry.nGoal = nGoal;
+	entry.vecPath = vecPath;
+	entry.vecVersions.clear();
+
+	for (const auto& p : vecPath)
+	{
+		int nCluster = ClusterOf(p.second * m_nWidth + p.first);
+
+		if (entry.vecVersions.empty() || entry.vecVersions.back().first != nCluster)
+			entry.vecVersions.push_back({ nCluster, m_vecClusters[nCluster].nVersion });
+	}
+
+	return true;
+}
+
+int PathFinder::RequestPath(int sx, int sy, int gx, int gy)
+{
+	int nRequest;
+
+	if (m_vecFreeRequests.empty())
+	{
+		nRequest = (int)m_vecRequests.size();
+		m_vecRequests.emplace_back();
+	}
+	else
+	{
+		nRequest = m_vecFreeRequests.back();
+		m_vecFreeRequests.pop_back();
+	}
+
+	Request& r = m_vecRequests[nRequest];
+	r.nStart = sy * m_nWidth + sx;
+	r.nGoal = gy * m_nWidth + gx;
+	r.status = PATH_PENDING;
+	r.vecPath.clear();
+
+	if (GetCost(sx, sy) == 0 || GetCost(gx, gy) == 0)
+		r.status = PATH_NOT_FOUND;
+	else
+		m_vecQueue.push_back(nRequest);
+
+	return nRequest;
+}
+
+void PathFinder::ProcessRequests(float fTimeBudget)
+{
+	auto tpStart = std::chrono::steady_clock::now();
+
+	while (m_nQueueHead < m_vecQueue.size())
+	{
+		int nRequest = m_vecQueue[m_nQueueHead++];
+		Request& r = m_vecRequests[nRequest];
+
+		// Cancelled requests stay in the queue until they are reached here
+		if (r.status != PATH_PENDING)
+		{
+			m_vecFreeRequests.push_back(nRequest);
+			continue;
+		}
+
+		bool bFound = FindPath(r.nStart % m_nWidth, r.nStart / m_nWidth, r.nGoal % m_nWidth, r.nGoal / m_nWidth, r.vecPath);
+		r.status = bFound ? PATH_FOUND : PATH_NOT_FOUND;
+
+		std::chrono::duration<float> elapsed = std::chrono::steady_clock::now() - tpStart;
+
+		if (elapsed.count() >= fTimeBudget)
+			break;
+	}
+
+	// Under steady load the queue rarely drains, so the consumed front goes once it is half the queue
+	if (m_nQueueHead == m_vecQueue.size())
+	{
+		m_vecQueue.clear();
+		m_nQueueHead = 0;
+	}
+	else if (m_nQueueHead * 2 >= m_vecQueue.size())
+	{
+		m_vecQueue.erase(m_vecQueue.begin(), m_vecQueue.begin() + m_nQueueHead);
+		m_nQueueHead = 0;
+	}
+}
+
+PathStatus PathFinder::GetRequestStatus(int nRequest) const
+{
+	if (nRequest < 0 || nRequest >= (int)m_vecRequests.size())
+		return PATH_INVALID;
+
+	return m_vecRequests[nRequest].status;
+}
+
+bool PathFinder::TakePath(int nRequest, Path& vecPath)
+{
+	PathStatus status = GetRequestStatus(nRequest);
+
+	if (status != PATH_FOUND && status != PATH_NOT_FOUND)
+		return false;
+
+	Request& r = m_vecRequests[nRequest];
+	std::swap(vecPath, r.vecPath);
+
+	r.status = PATH_INVALID;
+	m_vecFreeRequests.push_back(nRequest);
+
+	return status == PATH_FOUND;
+}
+
+void PathFinder::CancelRequest(int nRequest)
+{
+	if (GetRequestStatus(nRequest) == PATH_INVALID)
+		return;
+
+	bool bQueued = m_vecRequests[nRequest].status == PATH_PENDING;
+	m_vecRequests[nRequest].status = PATH_INVALID;
+
+	// A queued slot can only be reused once the queue has moved past it
+	if (!bQueued)
+		m_vecFreeRequests.push_back(nRequest);
+}
+
+int PathFinder::Width() const
+{
+	return m_nWidth;
+}
+
+int PathFinder::Height() const
+{
+	return m_nHeight;
+}
+
+int PathFinder::ClusterOf(int nCell) const
+{
+	return ((nCell / m_nWidth) / m_nClusterSize) * m_nClustersX + (nCell % m_nWidth) / m_nClusterSize;
+}
+
+void PathFinder::ClusterBounds(int nCluster, int& x1, int& y1, int& x2, int& y2) const
+{
+	x1 = (nCluster % m_nClustersX) * m_nClusterSize;
+	y1 = (nCluster / m_nClustersX) * m_nClusterSize;
+	x2 = std::min(x1 + m_nClusterSize, m_nWidth) - 1;
+	y2 = std::min(y1 + m_nClusterSize, m_nHeight) - 1;
+}
+
+uint32_t PathFinder::Heuristic(int a, int b) const
+{
+	uint32_t dx = abs(a % m_nWidth - b % m_nWidth);
+	uint32_t dy = abs(a / m_nWidth - b / m_nWidth);
+
+	if (m_bDiagonal)
+		return 10 * std::max(dx, dy) + 4 * std::min(dx, dy);
+
+	return 10 * (dx + dy);
+}
+
+bool PathFinder::Search(int nStart, int nGoal, int x1, int y1, int x2, int y2)
+{
+	static const int nOffsetX[8] = { 1, -1, 0, 0, 1, 1, -1, -1 };
+	static const int nOffsetY[8] = { 0, 0, 1, -1, 1, -1, 1, -1 };
+
+	if (++m_nStamp == 0)
+	{
+		// The stamp wrapped around so old values could be mistaken for current ones
+		std::fill(m_vecSeen.begin(), m_vecSeen.end(), 0);
+		std::fill(m_vecClosed.begin(), m_vecClosed.end(), 0);
+		m_nStamp = 1;
+	}
+
+	auto greater = [](const std::pair<uint32_t, int>& a, const std::pair<uint32_t, int>& b) { return a.first > b.first; };
+
+	m_vecOpen.clear();
+
+	m_vecG[nStart] = 0;
+	m_vecParent[nStart] = -1;
+	m_vecSeen[nStart] = m_nStamp;
+	m_vecOpen.push_back({ nGoal >= 0 ? Heuristic(nStart, nGoal) : 0, nStart });
+
+	int nDirections = m_bDiagonal ? 8 : 4;
+
+	while (!m_vecOpen.empty())
+	{
+		std::pop_heap(m_vecOpen.begin(), m_vecOpen.end(), greater);
+		int n = m_vecOpen.back().second;
+		m_vecOpen.pop_back();
+
+		if (m_vecClosed[n] == m_nStamp)
+			continue;
+
+		m_vecClosed[n] = m_nStamp;
+
+		if (n == nGoal)
+			return true;
+
+		int x = n % m_nWidth;
+		int y = n / m_nWidth;
+
+		for (int d = 0; d < nDirections; d++)
+		{
+			int nx = x + nOffsetX[d];
+			int ny = y + nOffsetY[d];
+
+			if (nx < x1 || nx > x2 || ny < y1 || ny > y2)
+				continue;
+
+			int m = ny * m_nWidth + nx;
+
+			if (m_vecCost[m] == 0 || m_vecClosed[m] == m_nStamp)
+				continue;
+
+			// Don't cut corners of walls
+			if (d >= 4 && (m_vecCost[y * m_nWidth + nx] == 0 || m_vecCost[ny * m_nWidth + x] == 0))
+				continue;
+
+			uint32_t g = m_vecG[n] + (d >= 4 ? 14 : 10) * m_vecCost[m];
+
+			if (m_vecSeen[m] != m_nStamp || g < m_vecG[m])
+			{
+				m_vecSeen[m] = m_nStamp;
+				m_vecG[m] = g;
+				m_vecParent[m] = n;
+
+				m_vecOpen.push_back({ g + (nGoal >= 0 ? Heuristic(m, nGoal) : 0), m });
+				std::push_heap(m_vecOpen.begin(), m_vecOpen.end(), greater);
+			}
+		}
+	}
+
+	return false;
+}
+
+void PathFinder::AppendPath(int nStart, int nGoal, Path& vecPath)
+{
+	size_t nFirst = vecPath.size();
+
+	for (int n = nGoal; n != nStart; n = m_vecParent[n])
+		vecPath.push_back({ n % m_nWidth, n / m_nWidth });
+
+	// Joining two segments must not repeat the shared cell
+	if (nFirst == 0 || vecPath[nFirst - 1] != std::make_pair(nStart % m_nWidth, nStart / m_nWidth))
+		vecPath.push_back({ nStart % m_nWidth, nStart / m_nWidth });
+
+	std::reverse(vecPath.begin() + nFirst, vecPath.end());
+}
+
+void PathFinder::Refresh()
+{
+	if (!m_bDirty)
+		return;
+
+	m_bDirty = false;
+
+	if (!m_bHierarchical)
+	{
+		for (auto& c : m_vecClusters)
+			c.bDirty = false;
+
+		return;
+	}
+
+	std::fill(m_vecRebuild.begin(), m_vecRebuild.end(), 0);
+
+	for (int i = 0; i < (int)m_vecClusters.size(); i++)
+	{
+		if (!m_vecClusters[i].bDirty)
+			continue;
+
+		int cx = i % m_nClustersX;
+		int cy = i / m_nClustersX;
+
+		// Entrances on all four sides may have changed, so both clusters of each border are rebuilt
+		BuildBorder(i, true);
+		BuildBorder(i, false);
+		m_vecRebuild[i] = 1;
+
+		if (cx > 0)
+		{
+			BuildBorder(i - 1, true);
+			m_vecRebuild[i - 1] = 1;
+		}
+
+		if (cx + 1 < m_nClustersX)
+			m_vecRebuild[i + 1] = 1;
+
+		if (cy > 0)
+		{
+			BuildBorder(i - m_nClustersX, false);
+			m_vecRebuild[i - m_nClustersX] = 1;
+		}
+
+		if (cy + 1 < m_nClustersY)
+			m_vecRebuild[i + m_nClustersX] = 1;
+	}
+
+	for (int i = 0; i < (int)m_vecClusters.size(); i++)
+	{
+		if (m_vecRebuild[i])
+			BuildCluster(i);
+	}
+}
+
+void PathFinder::BuildBorder(int nCluster, bool bEast)
+{
+	auto& vecEntrances = bEast ? m_vecEastBorders[nCluster] : m_vecSouthBorders[nCluster];
+	vecEntrances.clear();
+
+	int x1, y1, x2, y2;
+	ClusterBounds(nCluster, x1, y1, x2, y2);
+
+	if ((bEast && x2 + 1 >= m_nWidth) || (!bEast && y2 + 1 >= m_nHeight))
+		return;
+
+	int nLength = bEast ? y2 - y1 + 1 : x2 - x1 + 1;
+
+	auto inside = [&](int i) { return bEast ? y1 * m_nWidth + i * m_nWidth + x2 : y2 * m_nWidth + x1 + i; };
+	auto outside = [&](int i) { return bEast ? inside(i) + 1 : inside(i) + m_nWidth; };
+
+	// Every run of open cells on both sides becomes one entrance in its middle, long runs get one at each end
+	for (int i = 0; i < nLength;)
+	{
+		if (m_vecCost[inside(i)] == 0 || m_vecCost[outside(i)] == 0)
+		{
+			i++;
+			continue;
+		}
+
+		int nRunStart = i;
+
+		while (i < nLength && m_vecCost[inside(i)] != 0 && m_vecCost[outside(i)] != 0)
+			i++;
+
+		int nRunEnd = i - 1;
+
+		if (nRunEnd - nRunStart + 1 >= 6)
+		{
+			vecEntrances.push_back({ inside(nRunStart), outside(nRunStart) });
+			vecEntrances.push_back({ inside(nRunEnd), outside(nRunEnd) });
+		}
+		else
+		{
+			int nMiddle = (nRunStart + nRunEnd) / 2;
+			vecEntrances.push_back({ inside(nMiddle), outside(nMiddle) });
+		}
+	}
+}
+
+void PathFinder::BuildCluster(int nCluster)
+{
+	Cluster& c = m_vecClusters[nCluster];
+
+	for (int n : c.vecNodes)
+		m_vecNodeIndex[n] = -1;
+
+	c.vecNodes.clear();
+	c.vecEdges.clear();
+	c.bDirty = false;
+
+	int cx = nCluster % m_nClustersX;
+	int cy = nCluster / m_nClustersX;
+
+	auto addNode = [&](int nCell)
+		{
+			if (m_vecNodeIndex[nCell] < 0)
+			{
+				m_vecNodeIndex[nCell] = (int)c.vecNodes.size();
+				c.vecNodes.push_back(nCell);
+				c.vecEdges.emplace_back();
+			}
+
+			return m_vecNodeIndex[nCell];
+		};
+
+	auto addCrossing = [&](int nFrom, int nTo)
+		{
+			c.vecEdges[addNode(nFrom)].push_back({ nTo, 10u * m_vecCost[nTo] });
+		};
+
+	for (const auto& e : m_vecEastBorders[nCluster])
+		addCrossing(e.first, e.second);
+
+	for (const auto& e : m_vecSouthBorders[nCluster])
+		addCrossing(e.first, e.second);
+
+	if (cx > 0)
+	{
+		for (const auto& e : m_vecEastBorders[nCluster - 1])
+			addCrossing(e.second, e.first);
+	}
+
+	if (cy > 0)
+	{
+		for (const auto& e : m_vecSouthBorders[nCluster - m_nClustersX])
+			addCrossing(e.second, e.first);
+	}
+
+	int x1, y1, x2, y2;
+	ClusterBounds(nCluster, x1, y1, x2, y2);
+
+	for (size_t i = 0; i < c.vecNodes.size(); i++)
+	{
+		Search(c.vecNodes[i], -1, x1, y1, x2, y2);
+
+		for (size_t j = 0; j < c.vecNodes.size(); j++)
+		{
+			int n = c.vecNodes[j];
+
+			if (i != j && m_vecClosed[n] == m_nStamp)
+				c.vecEdges[i].push_back({ n, m_vecG[n] });
+		}
+	}
+}
+
+bool PathFinder::FindAbstractPath(int nStart, int nGoal, Path& vecPath)
+{
+	int nStartCluster = ClusterOf(nStart);
+	int nGoalCluster = ClusterOf(nGoal);
+
+	int x1, y1, x2, y2;
+
+	// Staying inside a shared cluster is good enough when it's possible at all
+	if (nStartCluster == nGoalCluster)
+	{
+		ClusterBounds(nStartCluster, x1, y1, x2, y2);
+
+		if (Search(nStart, nGoal, x1, y1, x2, y2))
+		{
+			AppendPath(nStart, nGoal, vecPath);
+			return true;
+		}
+	}
+
+	// Temporary edges from the start and into the goal to the entrances of their clusters
+	const Cluster& cs = m_vecClusters[nStartCluster];
+	const Cluster& cg = m_vecClusters[nGoalCluster];
+
+	ClusterBounds(nStartCluster, x1, y1, x2, y2);
+	Search(nStart, -1, x1, y1, x2, y2);
+
+	m_vecStartEdges.clear();
+
+	for (int n : cs.vecNodes)
+	{
+		if (m_vecClosed[n] == m_nStamp)
+			m_vecStartEdges.push_back({ n, m_vecG[n] });
+	}
+
+	ClusterBounds(nGoalCluster, x1, y1, x2, y2);
+	Search(nGoal, -1, x1, y1, x2, y2);
+
+	m_vecGoalEdges.assign(cg.vecNodes.size(), INF);
+
+	for (size_t i = 0; i < cg.vecNodes.size(); i++)
+	{
+		if (m_vecClosed[cg.vecNodes[i]] == m_nStamp)
+			m_vecGoalEdges[i] = m_vecG[cg.vecNodes[i]];
+	}
+
+	if (m_vecStartEdges.empty())
+		return false;
+
+	// A* over the entrance graph, reusing the per cell search state
+	if (++m_nStamp == 0)
+	{
+		std::fill(m_vecSeen.begin(), m_vecSeen.end(), 0);
+		std::fill(m_vecClosed.begin(), m_vecClosed.end(), 0);
+		m_nStamp = 1;
+	}
+
+	auto greater = [](const std::pair<uint32_t, int>& a, const std::pair<uint32_t, int>& b) { return a.first > b.first; };
+
+	m_vecOpen.clear();
+
+	auto relax = [&](int nFrom, int nTo, uint32_t nCost)
+		{
+			if (m_vecClosed[nTo] == m_nStamp)
+				return;
+
+			uint32_t g = m_vecG[nFrom] + nCost;
+
+			if (m_vecSeen[nTo] != m_nStamp || g < m_vecG[nTo])
+			{
+				m_vecSeen[nTo] = m_nStamp;
+				m_vecG[nTo] = g;
+				m_vecParent[nTo] = nFrom;
+
+				m_vecOpen.push_back({ g + Heuristic(nTo, nGoal), nTo });
+				std::push_heap(m_vecOpen.begin(), m_vecOpen.end(), greater);
+			}
+		};
+
+	m_vecG[nStart] = 0;
+	m_vecParent[nStart] = -1;
+	m_vecSeen[nStart] = m_nStamp;
+	m_vecOpen.push_back({ Heuristic(nStart, nGoal), nStart });
+
+	bool bFound = false;
+
+	while (!m_vecOpen.empty())
+	{
+		std::pop_heap(m_vecOpen.begin(), m_vecOpen.end(), greater);
+		int n = m_vecOpen.back().second;
+		m_vecOpen.pop_back();
+
+		if (m_vecClosed[n] == m_nStamp)
+			continue;
+
+		m_vecClosed[n] = m_nStamp;
+
+		if (n == nGoal)
+		{
+			bFound = true;
+			break;
+		}
+
+		if (n == nStart)
+		{
+			for (const auto& e : m_vecStartEdges)
+				relax(n, e.nTo, e.nCost);
+		}
+
+		int nLocal = m_vecNodeIndex[n];
+
+		if (nLocal < 0)
+			continue;
+
+		int nCluster = ClusterOf(n);
+
+		for (const auto& e : m_vecClusters[nCluster].vecEdges[nLocal])
+			relax(n, e.nTo, e.nCost);
+
+		if (nCluster == nGoalCluster && m_vecGoalEdges[nLocal] != INF)
+			relax(n, nGoal, m_vecGoalEdges[nLocal]);
+	}
+
+	if (!bFound)
+		return false;
+
+	m_vecAbstractPath.clear();
+
+	for (int n = nGoal; n != -1; n = m_vecParent[n])
+		m_vecAbstractPath.push_back(n);
+
+	std::reverse(m_vecAbstractPath.begin(), m_vecAbstractPath.end());
+
+	// Refine every hop, neighbours across a border are adjacent cells already
+	vecPath.push_back({ nStart % m_nWidth, nStart / m_nWidth });
+
+	for (size_t i = 1; i < m_vecAbstractPath.size(); i++)
+	{
+		int a = m_vecAbstractPath[i - 1];
+		int b = m_vecAbstractPath[i];
+
+		if (a == b)
+			continue;
+
+		int nCluster = ClusterOf(a);
+
+		if (nCluster != ClusterOf(b))
+		{
+			vecPath.push_back({ b % m_nWidth, b / m_nWidth });
+			continue;
+		}
+
+		ClusterBounds(nCluster, x1, y1, x2, y2);
+
+		if (!Search(a, b, x1, y1, x2, y2))
+		{
+			vecPath.clear();
+			return false;
+		}
+
+		AppendPath(a, b, vecPath);
+	}
+
+	return true;
+}
+
+Raycaster::Raycaster(int nMapWidth, int nMapHeight)
+{
+	m_nMapWidth = std::max(nMapWidth, 1);
+	m_nMapHeight = std::max(nMapHeight, 1);
+
+	m_vecMap.resize((size_t)m_nMapWidth * (size_t)m_nMapHeight, 0);
+
+	for (int i = 0; i < 256; i++)
+		m_nWallColours[i] = FG_GREY;
+}
+
+void Raycaster::SetCell(int x, int y, uint8_t nWall)
+{
+	if (x >= 0 && x < m_nMapWidth && y >= 0 && y < m_nMapHeight)
+		m_vecMap[y * m_nMapWidth + x] = nWall;
+}
+
+uint8_t Raycaster::GetCell(int x, int y) const
+{
+	if (x >= 0 && x < m_nMapWidth && y >= 0 && y < m_nMapHeight)
+		return m_vecMap[y * m_nMapWidth + x];
+
+	return 0;
+}
+
+void Raycaster::SetTexture(uint8_t nWall, const Sprite* sprite, short nUntexturedColour)
+{
+	m_pTextures[nWall] = sprite;
+	m_nWallColours[nWall] = nUntexturedColour;
+}
+
+void Raycaster::SetFieldOfView(float fFov)
+{
+	m_fFov = fFov;
+}
+
+void Raycaster::SetMaxDepth(float fDepth)
+{
+	m_fMaxDepth = fDepth;
+}
+
+void Raycaster::SetCeiling(wchar_t c, short col)
+{
+	m_cCeiling = c;
+	m_nCeilingColour = col;
+}
+
+void Raycaster::SetFloor(wchar_t c, short col)
+{
+	m_cFloor = c;
+	m_nFloorColour = col;
+}
+
+void Raycaster::Render(CHAR_INFO* pCells, int nWidth, int nHeight, float px, float py, float fAngle, ThreadPool* pPool)
+{
+	if (nWidth <= 0 || nHeight <= 0)
+		return;
+
+	if ((int)m_vecCameraX.size() != nWidth)
+	{
+		m_vecCameraX.resize(nWidth);
+		m_vecDepth.resize(nWidth);
+
+		for (int x = 0; x < nWidth; x++)
+			m_vecCameraX[x] = 2.0f * (x + 0.5f) / (float)nWidth - 1.0f;
+	}
+
+	float fPlane = tanf(m_fFov * 0.5f);
+
+	m_fPosX = px;
+	m_fPosY = py;
+	m_fDirX = cosf(fAngle);
+	m_fDirY = sinf(fAngle);
+	m_fPlaneX = -m_fDirY * fPlane;
+	m_fPlaneY = m_fDirX * fPlane;
+
+	// Chunks of columns keep threads from sharing cache lines on every row
+	if (pPool)
+		pPool->ParallelFor(0, nWidth, 32, [&](size_t nFrom, size_t nTo) { RenderColumns(pCells, nWidth, nHeight, (int)nFrom, (int)nTo); });
+	else
+		RenderColumns(pCells, nWidth, nHeight, 0, nWidth);
+}
+
+void Raycaster::RenderColumns(CHAR_INFO* pCells, int nWidth, int nHeight, int nFrom, int nTo)
+{
+	static const wchar_t cShades[4] = { PIXEL_SOLID, PIXEL_THREEQUARTERS, PIXEL_HALF, PIXEL_QUARTER };
+
+	for (int x = nFrom; x < nTo; x++)
+	{
+		float fRayX = m_fDirX + m_fPlaneX * m_vecCameraX[x];
+		float fRayY = m_fDirY + m_fPlaneY * m_vecCameraX[x];
+
+		int nMapX = (int)floorf(m_fPosX);
+		int nMapY = (int)floorf(m_fPosY);
+
+		float fDeltaX = fRayX == 0.0f ? 1e30f : fabsf(1.0f / fRayX);
+		float fDeltaY = fRayY == 0.0f ? 1e30f : fabsf(1.0f / fRayY);
+
+		int nStepX = fRayX < 0.0f ? -1 : 1;
+		int nStepY = fRayY < 0.0f ? -1 : 1;
+
+		float fSideX = fRayX < 0.0f ? (m_fPosX - nMapX) * fDeltaX : (nMapX + 1.0f - m_fPosX) * fDeltaX;
+		float fSideY = fRayY < 0.0f ? (m_fPosY - nMapY) * fDeltaY : (nMapY + 1.0f - m_fPosY) * fDeltaY;
+
+		uint8_t nWall = 0;
+		bool bSideY = false;
+		float fDistance = m_fMaxDepth;
+
+		while (true)
+		{
+			if (fSideX < fSideY)
+			{
+				if (fSideX > m_fMaxDepth)
+					break;
+
+				fSideX += fDeltaX;
+				nMapX += nStepX;
+				bSideY = false;
+			}
+			else
+			{
+				if (fSideY > m_fMaxDepth)
+					break;
+
+				fSideY += fDeltaY;
+				nMapY += nStepY;
+				bSideY = true;
+			}
+
+			if (nMapX < 0 || nMapX >= m_nMapWidth || nMapY < 0 || nMapY >= m_nMapHeight)
+				break;
+
+			nWall = m_vecMap[nMapY * m_nMapWidth + nMapX];
+
+			if (nWall)
+			{
+				fDistance = bSideY ? fSideY - fDeltaY : fSideX - fDeltaX;
+				break;
+			}
+		}
+
+		fDistance = std::max(fDistance, 1e-4f);
+		m_vecDepth[x] = nWall ? fDistance : INFINITY;
+
+		int nLineHeight = nWall ? (int)std::min((float)nHeight / fDistance, 1e6f) : 0;
+		int nStart = std::max((nHeight - nLineHeight) / 2, 0);
+		int nEnd = std::min((nHeight + nLineHeight) / 2, nHeight);
+
+		CHAR_INFO* pCell = pCells + x;
+		int y = 0;
+
+		for (; y < nStart; y++, pCell += nWidth)
+		{
+			pCell->Char.UnicodeChar = m_cCeiling;
+			pCell->Attributes = m_nCeilingColour;
+		}
+
+		if (nWall)
+		{
+			const Sprite* pTexture = m_pTextures[nWall];
+
+			if (pTexture && pTexture->nWidth > 0 && pTexture->nHeight > 0)
+			{
+				float fWallX = bSideY ? m_fPosX + fDistance * fRayX : m_fPosY + fDistance * fRayY;
+				fWallX -= floorf(fWallX);
+
+				int nTexX = std::min((int)(fWallX * pTexture->nWidth), pTexture->nWidth - 1);
+
+				if ((!bSideY && fRayX < 0.0f) || (bSideY && fRayY > 0.0f))
+					nTexX = pTexture->nWidth - nTexX - 1;
+
+				// 16.16 fixed point walk down the texture column
+				int64_t nStep = ((int64_t)pTexture->nHeight << 16) / std::max(nLineHeight, 1);
+				int64_t nTexY = (int64_t)(nStart - (nHeight - nLineHeight) / 2) * nStep;
+
+				const wchar_t* pGlyphs = pTexture->GlyphData() + nTexX;
+				const short* pColours = pTexture->ColourData() + nTexX;
+
+				for (; y < nEnd; y++, pCell += nWidth, nTexY += nStep)
+				{
+					int nRow = std::min((int)(nTexY >> 16), pTexture->nHeight - 1) * pTexture->nWidth;
+
+					pCell->Char.UnicodeChar = pGlyphs[nRow];
+					pCell->Attributes = pColours[nRow];
+				}
+			}
+			else
+			{
+				int nShade = std::min((int)(4.0f * fDistance / m_fMaxDepth), 3);
+
+				// Darker Y sides give corners some definition
+				wchar_t c = cShades[std::min(nShade + (bSideY ? 1 : 0), 3)];
+
+				for (; y < nEnd; y++, pCell += nWidth)
+				{
+					pCell->Char.UnicodeChar = c;
+					pCell->Attributes = m_nWallColours[nWall];
+				}
+			}
+		}
+
+		for (; y < nHeight; y++, pCell += nWidth)
+		{
+			pCell->Char.UnicodeChar = m_cFloor;
+			pCell->Attributes = m_nFloorColour;
+		}
+	}
+}
+
+void Raycaster::DrawBillboard(CHAR_INFO* pCells, int nWidth, int nHeight, float x, float y, const Sprite* sprite, float fScale,
+	CellColour* pColours) const
+{
+	if (!sprite || sprite->nWidth <= 0 || sprite->nHeight <= 0 || (int)m_vecDepth.size() != nWidth)
+		return;
+
+	// Camera space through the inverse of the [plane dir] matrix
+	float rx = x - m_fPosX;
+	float ry = y - m_fPosY;
+
+	float fInvDet = 1.0f / (m_fPlaneX * m_fDirY - m_fDirX * m_fPlaneY);
+	float tx = fInvDet * (m_fDirY * rx - m_fDirX * ry);
+	float fDepth = fInvDet * (-m_fPlaneY * rx + m_fPlaneX * ry);
+
+	if (fDepth <= 0.05f)
+		return;
+
+	int nCentreX = (int)((nWidth / 2.0f) * (1.0f + tx / fDepth));
+	int nSize = (int)(nHeight / fDepth * fScale);
+
+	if (nSize <= 0)
+		return;
+
+	int nSizeX = nSize * sprite->nWidth / sprite->nHeight;
+
+	int x1 = nCentreX - nSizeX / 2;
+	int y1 = (nHeight - nSize) / 2 + (int)(nHeight / fDepth * (1.0f - fScale) * 0.5f);
+
+	int sx = std::max(x1, 0), ex = std::min(x1 + nSizeX, nWidth);
+	int sy = std::max(y1, 0), ey = std::min(y1 + nSize, nHeight);
+
+	for (int i = sx; i < ex; i++)
+	{
+		if (m_vecDepth[i] < fDepth)
+			continue;
+
+		int nTexX = std::min((i - x1) * sprite->nWidth / nSizeX, sprite->nWidth - 1);
+
+		for (int j = sy; j < ey; j++)
+		{
+			int nTex = std::min((j - y1) * sprite->nHeight / nSize, sprite->nHeight - 1) * sprite->nWidth + nTexX;
+			wchar_t c = sprite->GlyphData()[nTex];
+
+			if (c != L' ')
+			{
+				pCells[j * nWidth + i].Char.UnicodeChar = c;
+				pCells[j * nWidth + i].Attributes = sprite->ColourData()[nTex];
+
+				if (pColours)
+					pColours[j * nWidth + i] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+			}
+		}
+	}
+}
+
+const std::vector<float>& Raycaster::DepthBuffer() const
+{
+	return m_vecDepth;
+}
+
+Mat4 Mat4::operator*(const Mat4& b) const
+{
+	Mat4 r;
+
+	for (int i = 0; i < 4; i++)
+		for (int j = 0; j < 4; j++)
+			r.m[i][j] = m[i][0] * b.m[0][j] + m[i][1] * b.m[1][j] + m[i][2] * b.m[2][j] + m[i][3] * b.m[3][j];
+
+	return r;
+}
+
+Vec3 Mat4::TransformPoint(const Vec3& v) const
+{
+	return
+	{
+		v.x * m[0][0] + v.y * m[1][0] + v.z * m[2][0] + m[3][0],
+		v.x * m[0][1] + v.y * m[1][1] + v.z * m[2][1] + m[3][1],
+		v.x * m[0][2] + v.y * m[1][2] + v.z * m[2][2] + m[3][2]
+	};
+}
+
+Vec3 Mat4::TransformVector(const Vec3& v) const
+{
+	return
+	{
+		v.x * m[0][0] + v.y * m[1][0] + v.z * m[2][0],
+		v.x * m[0][1] + v.y * m[1][1] + v.z * m[2][1],
+		v.x * m[0][2] + v.y * m[1][2] + v.z * m[2][2]
+	};
+}
+
+Mat4 Mat4::Identity()
+{
+	Mat4 r;
+	r.m[0][0] = r.m[1][1] = r.m[2][2] = r.m[3][3] = 1.0f;
+	return r;
+}
+
+Mat4 Mat4::Translation(float x, float y, float z)
+{
+	Mat4 r = Identity();
+	r.m[3][0] = x;
+	r.m[3][1] = y;
+	r.m[3][2] = z;
+	return r;
+}
+
+Mat4 Mat4::Scale(float x, float y, float z)
+{
+	Mat4 r = Identity();
+	r.m[0][0] = x;
+	r.m[1][1] = y;
+	r.m[2][2] = z;
+	return r;
+}
+
+Mat4 Mat4::RotationX(float a)
+{
+	Mat4 r = Identity();
+	r.m[1][1] = cosf(a);
+	r.m[1][2] = sinf(a);
+	r.m[2][1] = -sinf(a);
+	r.m[2][2] = cosf(a);
+	return r;
+}
+
+Mat4 Mat4::RotationY(float a)
+{
+	Mat4 r = Identity();
+	r.m[0][0] = cosf(a);
+	r.m[0][2] = -sinf(a);
+	r.m[2][0] = sinf(a);
+	r.m[2][2] = cosf(a);
+	return r;
+}
+
+Mat4 Mat4::RotationZ(float a)
+{
+	Mat4 r = Identity();
+	r.m[0][0] = cosf(a);
+	r.m[0][1] = sinf(a);
+	r.m[1][0] = -sinf(a);
+	r.m[1][1] = cosf(a);
+	return r;
+}
+
+Mat4 Mat4::LookAt(const Vec3& eye, const Vec3& target, const Vec3& up)
+{
+	Vec3 f = (target - eye).Normalise();
+	Vec3 r = up.Cross(f).Normalise();
+	Vec3 u = f.Cross(r);
+
+	Mat4 v = Identity();
+
+	v.m[0][0] = r.x; v.m[1][0] = r.y; v.m[2][0] = r.z;
+	v.m[0][1] = u.x; v.m[1][1] = u.y; v.m[2][1] = u.z;
+	v.m[0][2] = f.x; v.m[1][2] = f.y; v.m[2][2] = f.z;
+
+	v.m[3][0] = -r.Dot(eye);
+	v.m[3][1] = -u.Dot(eye);
+	v.m[3][2] = -f.Dot(eye);
+
+	return v;
+}
+
+bool Mesh::LoadObj(const std::wstring& sFileName)
+{
+	std::ifstream file(sFileName, std::ios::in);
+
+	if (!file.is_open())
+		return false;
+
+	vecVertices.clear();
+	vecIndices.clear();
+
+	std::string sLine;
+	std::vector<uint32_t> vecFace;
+
+	while (std::getline(file, sLine))
+	{
+		if (sLine.size() > 2 && sLine[0] == 'v' && sLine[1] == ' ')
+		{
+			Vec3 v;
+
+			if (sscanf(sLine.c_str() + 2, "%f %f %f", &v.x, &v.y, &v.z) == 3)
+				vecVertices.push_back(v);
+		}
+		else if (sLine.size() > 2 && sLine[0] == 'f' && sLine[1] == ' ')
+		{
+			vecFace.clear();
+
+			// Entries look like "1", "1/2" or "1/2/3" and only the position index is used
+			for (const char* p = sLine.c_str() + 2; *p;)
+			{
+				while (*p == ' ' || *p == '\t')
+					p++;
+
+				if (!*p || *p == '\r')
+					break;
+
+				long nIndex = strtol(p, nullptr, 10);
+
+				if (nIndex < 0)
+					nIndex += (long)vecVertices.size() + 1;
+
+				if (nIndex > 0 && nIndex <= (long)vecVertices.size())
+					vecFace.push_back(uint32_t(nIndex - 1));
+
+				while (*p && *p != ' ' && *p != '\t')
+					p++;
+			}
+
+			for (size_t i = 2; i < vecFace.size(); i++)
+			{
+				vecIndices.push_back(vecFace[0]);
+				vecIndices.push_back(vecFace[i - 1]);
+				vecIndices.push_back(vecFace[i]);
+			}
+		}
+	}
+
+	return true;
+}
+
+Renderer3D::Renderer3D(int nWidth, int nHeight)
+{
+	Resize(nWidth, nHeight);
+	SetProjection(3.14159f / 2.0f, 1.0f, 0.1f, 1000.0f);
+}
+
+void Renderer3D::Resize(int nWidth, int nHeight)
+{
+	m_nWidth = std::max(nWidth, 1);
+	m_nHeight = std::max(nHeight, 1);
+
+	m_vecDepth.resize((size_t)m_nWidth * (size_t)m_nHeight);
+	m_vecBins.resize(size_t((m_nWidth + TILE_SIZE - 1) / TILE_SIZE) * size_t((m_nHeight + TILE_SIZE - 1) / TILE_SIZE));
+
+	ClearDepth();
+}
+
+void Renderer3D::ClearDepth()
+{
+	std::fill(m_vecDepth.begin(), m_vecDepth.end(), 1.0f);
+}
+
+void Renderer3D::SetProjection(float fFov, float fAspect, float fNear, float fFar)
+{
+	float f = 1.0f / tanf(fFov * 0.5f);
+
+	m_fScaleX = f / fAspect;
+	m_fScaleY = f;
+	m_fNear = fNear;
+	m_fFar = fFar;
+}
+
+void Renderer3D::SetView(const Mat4& matView)
+{
+	m_matView = matView;
+}
+
+void Renderer3D::SetLight(const Vec3& vDirection)
+{
+	m_vLight = vDirection.Normalise();
+}
+
+void Renderer3D::SetCulling(bool bCullBackFaces)
+{
+	m_bCullBackFaces = bCullBackFaces;
+}
+
+void Renderer3D::DrawMesh(CHAR_INFO* pCells, const Mesh& mesh, const Mat4& matModel, short col, bool bLit, wchar_t c, ThreadPool* pPool)
+{
+	static const wchar_t cShades[4] = { PIXEL_QUARTER, PIXEL_HALF, PIXEL_THREEQUARTERS, PIXEL_SOLID };
+
+	size_t nVertices = mesh.vecVertices.size();
+
+	m_vecWorld.resize(nVertices);
+	m_vecClip.resize(nVertices);
+
+	// Transform the whole vertex batch up front, shared vertices are only transformed once
+	Mat4 matModelView = matModel * m_matView;
+	float fDepthScale = m_fFar / (m_fFar - m_fNear);
+
+	for (size_t i = 0; i < nVertices; i++)
+	{
+		m_vecWorld[i] = matModel.TransformPoint(mesh.vecVertices[i]);
+
+		Vec3 v = matModelView.TransformPoint(mesh.vecVertices[i]);
+		m_vecClip[i] = { v.x * m_fScaleX, v.y * m_fScaleY, (v.z - m_fNear) * fDepthScale, v.z };
+	}
+
+	m_vecTriangles.clear();
+
+	for (size_t i = 0; i + 2 < mesh.vecIndices.size(); i += 3)
+	{
+		uint32_t i0 = mesh.vecIndices[i], i1 = mesh.vecIndices[i + 1], i2 = mesh.vecIndices[i + 2];
+
+		if (i0 >= nVertices || i1 >= nVertices || i2 >= nVertices)
+			continue;
+
+		const ClipVertex* v[3] = { &m_vecClip[i0], &m_vecClip[i1], &m_vecClip[i2] };
+
+		// Trivially reject triangles wholly outside one of the frustum planes before shading them
+		if ((v[0]->x > v[0]->w && v[1]->x > v[1]->w && v[2]->x > v[2]->w) ||
+			(v[0]->x < -v[0]->w && v[1]->x < -v[1]->w && v[2]->x < -v[2]->w) ||
+			(v[0]->y > v[0]->w && v[1]->y > v[1]->w && v[2]->y > v[2]->w) ||
+			(v[0]->y < -v[0]->w && v[1]->y < -v[1]->w && v[2]->y < -v[2]->w) ||
+			(v[0]->w < m_fNear && v[1]->w < m_fNear && v[2]->w < m_fNear) ||
+			(v[0]->w > m_fFar && v[1]->w > m_fFar && v[2]->w > m_fFar))
+			continue;
+
+		CHAR_INFO cell;
+		cell.Char.UnicodeChar = c;
+		cell.Attributes = col;
+
+		if (bLit)
+		{
+			Vec3 n = (m_vecWorld[i1] - m_vecWorld[i0]).Cross(m_vecWorld[i2] - m_vecWorld[i0]).Normalise();
+			float fLight = std::max(0.0f, -n.Dot(m_vLight));
+
+			int nShade = std::min((int)(fLight * 5.0f), 4);
+
+			// The darkest step blanks the cell so unlit faces still occlude what's behind them
+			cell.Char.UnicodeChar = nShade > 0 ? cShades[nShade - 1] : L' ';
+			cell.Attributes = col & 0x0F;
+		}
+
+		// Clip against the near plane (w >= near), giving zero, one or two triangles
+		const ClipVertex* pInside[3];
+		const ClipVertex* pOutside[3];
+		int nInside = 0, nOutside = 0;
+
+		for (int k = 0; k < 3; k++)
+		{
+			if (v[k]->w >= m_fNear)
+				pInside[nInside++] = v[k];
+			else
+				pOutside[nOutside++] = v[k];
+		}
+
+		auto intersect = [&](const ClipVertex* a, const ClipVertex* b)
+			{
+				float t = (m_fNear - a->w) / (b->w - a->w);
+				return ClipVertex{ a->x + (b->x - a->x) * t, a->y + (b->y - a->y) * t, a->z + (b->z - a->z) * t, m_fNear };
+			};
+
+		if (nInside == 3)
+			SetupTriangle(*v[0], *v[1], *v[2], cell);
+		else if (nInside == 1)
+		{
+			// Keep the original winding by rotating the inside vertex to the front
+			int k = v[0] == pInside[0] ? 0 : v[1] == pInside[0] ? 1 : 2;
+			const ClipVertex* a = v[k], * b = v[(k + 1) % 3], * d = v[(k + 2) % 3];
+
+			SetupTriangle(*a, intersect(a, b), intersect(a, d), cell);
+		}
+		else if (nInside == 2)
+		{
+			int k = v[0] == pOutside[0] ? 0 : v[1] == pOutside[0] ? 1 : 2;
+			const ClipVertex* o = v[k], * b = v[(k + 1) % 3], * d = v[(k + 2) % 3];
+
+			ClipVertex ob = intersect(b, o);
+			ClipVertex od = intersect(d, o);
+
+			SetupTriangle(ob, *b, *d, cell);
+			SetupTriangle(ob, *d, od, cell);
+		}
+	}
+
+	if (!pPool || m_vecTriangles.size() < BINNING_THRESHOLD)
+	{
+		for (const auto& t : m_vecTriangles)
+			Rasterize(t, pCells, 0, 0, m_nWidth - 1, m_nHeight - 1);
+
+		return;
+	}
+
+	int nTilesX = (m_nWidth + TILE_SIZE - 1) / TILE_SIZE;
+
+	for (auto& bin : m_vecBins)
+		bin.clear();
+
+	for (uint32_t i = 0; i < (uint32_t)m_vecTriangles.size(); i++)
+	{
+		const RasterTriangle& t = m_vecTriangles[i];
+
+		for (int ty = t.nMinY / TILE_SIZE; ty <= t.nMaxY / TILE_SIZE; ty++)
+			for (int tx = t.nMinX / TILE_SIZE; tx <= t.nMaxX / TILE_SIZE; tx++)
+				m_vecBins[ty * nTilesX + tx].push_back(i);
+	}
+
+	// Tiles don't overlap so they can be rasterized in any order on any thread,
+	// within a tile triangles keep submission order
+	pPool->ParallelFor(0, m_vecBins.size(), 1, [&](size_t nFrom, size_t nTo)
+		{
+			for (size_t nTile = nFrom; nTile < nTo; nTile++)
+			{
+				int x1 = int(nTile % nTilesX) * TILE_SIZE;
+				int y1 = int(nTile / nTilesX) * TILE_SIZE;
+				int x2 = std::min(x1 + TILE_SIZE, m_nWidth) - 1;
+				int y2 = std::min(y1 + TILE_SIZE, m_nHeight) - 1;
+
+				for (uint32_t i : m_vecBins[nTile])
+					Rasterize(m_vecTriangles[i], pCells, x1, y1, x2, y2);
+			}
+		});
+}
+
+const float* Renderer3D::DepthBuffer() const
+{
+	return m_vecDepth.data();
+}
+
+int Renderer3D::Width() const
+{
+	return m_nWidth;
+}
+
+int Renderer3D::Height() const
+{
+	return m_nHeight;
+}
+
+void Renderer3D::SetupTriangle(const ClipVertex& a, const ClipVertex& b, const ClipVertex& c, const CHAR_INFO& cell)
+{
+	const ClipVertex* v[3] = { &a, &b, &c };
+
+	float x[3], y[3], z[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		float fInvW = 1.0f / v[i]->w;
+
+		x[i] = (v[i]->x * fInvW + 1.0f) * 0.5f * m_nWidth;
+		y[i] = (1.0f - v[i]->y * fInvW) * 0.5f * m_nHeight;
+		z[i] = v[i]->z * fInvW;
+	}
+
+	float fMinX = std::min(x[0], std::min(x[1], x[2]));
+	float fMaxX = std::max(x[0], std::max(x[1], x[2]));
+	float fMinY = std::min(y[0], std::min(y[1], y[2]));
+	float fMaxY = std::max(y[0], std::max(y[1], y[2]));
+
+	// Screen clipping happens here, the rasterizer never walks outside these bounds
+	if (fMaxX < 0.0f || fMaxY < 0.0f || fMinX >= (float)m_nWidth || fMinY >= (float)m_nHeight)
+		return;
+
+	// Vertices close to the near plane can land far off screen, keep them in range of the fixed point maths
+	const float fGuard = float(1 << 20);
+
+	int64_t X[3], Y[3];
+
+	for (int i = 0; i < 3; i++)
+	{
+		X[i] = (int64_t)std::clamp(x[i] * (1 << SUBPIXEL_BITS), -fGuard, fGuard);
+		Y[i] = (int64_t)std::clamp(y[i] * (1 << SUBPIXEL_BITS), -fGuard, fGuard);
+	}
+
+	// Counter-clockwise with y pointing up is clockwise here, so front faces have negative area
+	int64_t nArea = (X[1] - X[0]) * (Y[2] - Y[0]) - (X[2] - X[0]) * (Y[1] - Y[0]);
+
+	if (nArea == 0 || (m_bCullBackFaces && nArea > 0))
+		return;
+
+	// The edge functions expect a positive area
+	if (nArea < 0)
+	{
+		std::swap(X[1], X[2]);
+		std::swap(Y[1], Y[2]);
+		std::swap(z[1], z[2]);
+		nArea = -nArea;
+	}
+
+	RasterTriangle t;
+
+	// Edge i is opposite vertex i, so its function is that vertex's barycentric weight
+	for (int i = 0; i < 3; i++)
+	{
+		int j = (i + 1) % 3, k = (i + 2) % 3;
+
+		t.nEdgeA[i] = Y[j] - Y[k];
+		t.nEdgeB[i] = X[k] - X[j];
+		t.nEdgeC[i] = X[j] * Y[k] - Y[j] * X[k];
+		t.z[i] = z[i];
+	}
+
+	t.fInvArea = 1.0f / (float)nArea;
+	t.nMinX = std::max((int)fMinX, 0);
+	t.nMinY = std::max((int)fMinY, 0);
+	t.nMaxX = std::min((int)fMaxX, m_nWidth - 1);
+	t.nMaxY = std::min((int)fMaxY, m_nHeight - 1);
+	t.cell = cell;
+
+	m_vecTriangles.push_back(t);
+}
+
+void Renderer3D::Rasterize(const RasterTriangle& t, CHAR_INFO* pCells, int x1, int y1, int x2, int y2)
+{
+	int sx = std::max(t.nMinX, x1), ex = std::min(t.nMaxX, x2);
+	int sy = std::max(t.nMinY, y1), ey = std::min(t.nMaxY, y2);
+
+	if (sx > ex || sy > ey)
+		return;
+
+	const int64_t nStep = 1 << SUBPIXEL_BITS;
+	const int64_t nHalf = nStep / 2;
+
+	int64_t px = sx * nStep + nHalf;
+	int64_t py = sy * nStep + nHalf;
+
+	int64_t w0Row = t.nEdgeA[0] * px + t.nEdgeB[0] * py + t.nEdgeC[0];
+	int64_t w1Row = t.nEdgeA[1] * px + t.nEdgeB[1] * py + t.nEdgeC[1];
+	int64_t w2Row = t.nEdgeA[2] * px + t.nEdgeB[2] * py + t.nEdgeC[2];
+
+	int64_t a0 = t.nEdgeA[0] * nStep, a1 = t.nEdgeA[1] * nStep, a2 = t.nEdgeA[2] * nStep;
+	int64_t b0 = t.nEdgeB[0] * nStep, b1 = t.nEdgeB[1] * nStep, b2 = t.nEdgeB[2] * nStep;
+
+	for (int y = sy; y <= ey; y++)
+	{
+		int64_t w0 = w0Row, w1 = w1Row, w2 = w2Row;
+
+		float* pDepth = m_vecDepth.data() + y * m_nWidth;
+		CHAR_INFO* pRow = pCells + y * m_nWidth;
+
+		for (int x = sx; x <= ex; x++)
+		{
+			if ((w0 | w1 | w2) >= 0)
+			{
+				// Depth is only interpolated for covered cells and tested before anything is written
+				float z = ((float)w0 * t.z[0] + (float)w1 * t.z[1] + (float)w2 * t.z[2]) * t.fInvArea;
+
+				if (z >= 0.0f && z < pDepth[x])
+				{
+					pDepth[x] = z;
+					pRow[x] = t.cell;
+				}
+			}
+
+			w0 += a0;
+			w1 += a1;
+			w2 += a2;
+		}
+
+		w0Row += b0;
+		w1Row += b1;
+		w2Row += b2;
+	}
+}
+
+FrameRecorder::~FrameRecorder()
+{
+	Stop();
+}
+
+bool FrameRecorder::Start(const std::wstring& sFileName)
+{
+	Stop();
+
+	m_file.open(sFileName, std::ios::out | std::ios::binary);
+
+	if (!m_file.is_open())
+		return false;
+
+	const uint32_t nVersion = VERSION;
+
+	m_file.write("CGER", 4);
+	m_file.write((const char*)&nVersion, sizeof(nVersion));
+
+	m_nHead = m_nTail = 0;
+	m_nDropped = 0;
+	m_dTime = 0.0;
+	m_bFailed = false;
+	m_bForceKeyframe = true;
+	m_bRecording = true;
+
+	m_thrWriter = std::thread(&FrameRecorder::Write, this);
+
+	return true;
+}
+
+bool FrameRecorder::Stop()
+{
+	if (!m_bRecording)
+		return !m_bFailed;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_bRecording = false;
+	}
+
+	m_cv.notify_all();
+	m_thrWriter.join();
+
+	m_file.close();
+
+	return !m_bFailed;
+}
+
+bool FrameRecorder::IsRecording() const
+{
+	return m_bRecording;
+}
+
+size_t FrameRecorder::DroppedFrames() const
+{
+	return m_nDropped;
+}
+
+void FrameRecorder::Capture(const CHAR_INFO* pScreen, int nWidth, int nHeight, float fDeltaTime)
+{
+	if (!m_bRecording)
+		return;
+
+	m_dTime += fDeltaTime;
+
+	size_t nSlot;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+
+		if (m_nHead - m_nTail == RING_SIZE)
+		{
+			// The writer is behind, skipping the frame breaks the delta chain so restart it
+			m_nDropped++;
+			m_bForceKeyframe = true;
+			return;
+		}
+
+		nSlot = m_nHead % RING_SIZE;
+	}
+
+	// The writer never touches slots between tail and head, so this one can be filled unlocked
+	bool bKeyframe = m_bForceKeyframe || nWidth != m_nPrevWidth || nHeight != m_nPrevHeight;
+	EncodeFrame(m_vecSlots[nSlot], pScreen, bKeyframe ? nullptr : m_vecPrevious.data(), nWidth, nHeight, (uint32_t)(m_dTime * 1000.0));
+
+	m_vecPrevious.assign(pScreen, pScreen + nWidth * nHeight);
+	m_nPrevWidth = nWidth;
+	m_nPrevHeight = nHeight;
+	m_bForceKeyframe = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_nHead++;
+	}
+
+	m_cv.notify_one();
+}
+
+void FrameRecorder::EncodeFrame(std::vector<uint8_t>& vecOut, const CHAR_INFO* pScreen, const CHAR_INFO* pPrevious, int nWidth, int nHeight, uint32_t nTime)
+{
+	auto put = [&](const void* pData, size_t nSize)
+		{
+			size_t nOffset = vecOut.size();
+			vecOut.resize(nOffset + nSize);
+			memcpy(vecOut.data() + nOffset, pData, nSize);
+		};
+
+	vecOut.clear();
+
+	uint32_t nPayloadSize = 0;
+	uint16_t nSize[2] = { (uint16_t)nWidth, (uint16_t)nHeight };
+	uint8_t nFlags = pPrevious ? 0 : FLAG_KEYFRAME;
+	uint32_t nRuns = 0;
+
+	put(&nPayloadSize, sizeof(nPayloadSize));
+	put(&nTime, sizeof(nTime));
+	put(nSize, sizeof(nSize));
+	put(&nFlags, sizeof(nFlags));
+
+	size_t nRunsOffset = vecOut.size();
+	put(&nRuns, sizeof(nRuns));
+
+	uint32_t nCells = uint32_t(nWidth * nHeight);
+
+	if (!pPrevious)
+	{
+		uint32_t nRun[2] = { 0, nCells };
+
+		put(nRun, sizeof(nRun));
+		put(pScreen, nCells * sizeof(CHAR_INFO));
+
+		nRuns = 1;
+	}
+	else
+	{
+		auto changed = [&](uint32_t i)
+			{
+				return memcmp(&pScreen[i], &pPrevious[i], sizeof(CHAR_INFO)) != 0;
+			};
+
+		// A run header costs as much as two cells, so runs separated by fewer unchanged cells are merged
+		const uint32_t nMaxGap = 2;
+
+		for (uint32_t i = 0; i < nCells;)
+		{
+			if (!changed(i))
+			{
+				i++;
+				continue;
+			}
+
+			uint32_t nStart = i, nEnd = i + 1;
+
+			for (uint32_t j = nEnd; j < nCells && j - nEnd <= nMaxGap; j++)
+			{
+				if (changed(j))
+					nEnd = j + 1;
+			}
+
+			uint32_t nRun[2] = { nStart, nEnd - nStart };
+
+			put(nRun, sizeof(nRun));
+			put(pScreen + nStart, (nEnd - nStart) * sizeof(CHAR_INFO));
+
+			nRuns++;
+			i = nEnd;
+		}
+	}
+
+	nPayloadSize = uint32_t(vecOut.size() - sizeof(nPayloadSize));
+
+	memcpy(vecOut.data(), &nPayloadSize, sizeof(nPayloadSize));
+	memcpy(vecOut.data() + nRunsOffset, &nRuns, sizeof(nRuns));
+}
+
+void FrameRecorder::Write()
+{
+	std::unique_lock<std::mutex> lock(m_mux);
+
+	while (true)
+	{
+		m_cv.wait(lock, [&] { return m_nTail != m_nHead || !m_bRecording; });
+
+		if (m_nTail == m_nHead)
+			break;
+
+		std::vector<uint8_t>& vecSlot = m_vecSlots[m_nTail % RING_SIZE];
+
+		lock.unlock();
+
+		m_file.write((const char*)vecSlot.data(), vecSlot.size());
+
+		if (!m_file)
+			m_bFailed = true;
+
+		lock.lock();
+		m_nTail++;
+	}
+}
+
+bool FramePlayer::Open(const std::wstring& sFileName)
+{
+	Close();
+
+	m_file.open(sFileName, std::ios::in | std::ios::binary);
+
+	if (!m_file.is_open())
+		return false;
+
+	char sMagic[4];
+	uint32_t nVersion = 0;
+
+	m_file.read(sMagic, 4);
+	m_file.read((char*)&nVersion, sizeof(nVersion));
+
+	if (!m_file || memcmp(sMagic, "CGER", 4) != 0 || nVersion != FrameRecorder::VERSION)
+	{
+		Close();
+		return false;
+	}
+
+	m_bFinished = false;
+
+	return true;
+}
+
+void FramePlayer::Close()
+{
+	if (m_file.is_open())
+		m_file.close();
+
+	m_vecFrame.clear();
+	m_nWidth = m_nHeight = 0;
+	m_dTime = 0.0;
+	m_bPending = false;
+	m_bFinished = true;
+}
+
+bool FramePlayer::IsOpen() const
+{
+	return m_file.is_open();
+}
+
+bool FramePlayer::IsFinished() const
+{
+	return m_bFinished;
+}
+
+void FramePlayer::SetSpeed(float fSpeed)
+{
+	m_fSpeed = std::max(fSpeed, 0.0f);
+}
+
+bool FramePlayer::Update(float fElapsed)
+{
+	if (m_bFinished)
+		return false;
+
+	if (m_fSpeed == 0.0f)
+	{
+		// A frame read ahead during normal playback is the next one in the delta chain
+		if ((!m_bPending && !ReadFrame()) || !DecodeFrame(m_vecPayload.data(), m_vecPayload.size(), m_vecFrame, m_nWidth, m_nHeight))
+			m_bFinished = true;
+		else
+			m_dTime = m_nPendingTime / 1000.0;
+
+		m_bPending = false;
+
+		return !m_bFinished;
+	}
+
+	m_dTime += fElapsed * m_fSpeed;
+
+	// Frames in between still have to be applied since each one is a delta of the last
+	while (true)
+	{
+		if (!m_bPending && !ReadFrame())
+		{
+			m_bFinished = true;
+			break;
+		}
+
+		if (m_nPendingTime > (uint32_t)(m_dTime * 1000.0))
+			break;
+
+		m_bPending = false;
+
+		if (!DecodeFrame(m_vecPayload.data(), m_vecPayload.size(), m_vecFrame, m_nWidth, m_nHeight))
+		{
+			m_bFinished = true;
+			break;
+		}
+	}
+
+	return !m_bFinished;
+}
+
+const CHAR_INFO* FramePlayer::Frame() const
+{
+	return m_vecFrame.data();
+}
+
+int FramePlayer::Width() const
+{
+	return m_nWidth;
+}
+
+int FramePlayer::Height() const
+{
+	return m_nHeight;
+}
+
+bool FramePlayer::ReadFrame()
+{
+	uint32_t nPayloadSize = 0;
+
+	if (!m_file.read((char*)&nPayloadSize, sizeof(nPayloadSize)))
+		return false;
+
+	// Time, size, flags and run count
+	if (nPayloadSize < 13)
+		return false;
+
+	m_vecPayload.resize(nPayloadSize);
+
+	if (!m_file.read((char*)m_vecPayload.data(), nPayloadSize))
+		return false;
+
+	memcpy(&m_nPendingTime, m_vecPayload.data(), sizeof(m_nPendingTime));
+	m_bPending = true;
+
+	return true;
+}
+
+bool FramePlayer::DecodeFrame(const uint8_t* pPayload, size_t nSize, std::vector<CHAR_INFO>& vecFrame, int& nWidth, int& nHeight)
+{
+	// Time, size, flags and run count
+	if (nSize < 13)
+		return false;
+
+	const uint8_t* p = pPayload + sizeof(uint32_t);
+	const uint8_t* pEnd = pPayload + nSize;
+
+	uint16_t nFrameSize[2];
+	uint8_t nFlags;
+	uint32_t nRuns;
+
+	memcpy(nFrameSize, p, sizeof(nFrameSize)); p += sizeof(nFrameSize);
+	memcpy(&nFlags, p, sizeof(nFlags)); p += sizeof(nFlags);
+	memcpy(&nRuns, p, sizeof(nRuns)); p += sizeof(nRuns);
+
+	if (nFlags & FrameRecorder::FLAG_KEYFRAME)
+	{
+		nWidth = nFrameSize[0];
+		nHeight = nFrameSize[1];
+		vecFrame.assign(size_t(nWidth * nHeight), CHAR_INFO{});
+	}
+	else if (nFrameSize[0] != nWidth || nFrameSize[1] != nHeight)
+		return false;
+
+	size_t nCells = vecFrame.size();
+
+	for (uint32_t i = 0; i < nRuns; i++)
+	{
+		uint32_t nRun[2];
+
+		if (pEnd - p < (ptrdiff_t)sizeof(nRun))
+			return false;
+
+		memcpy(nRun, p, sizeof(nRun));
+		p += sizeof(nRun);
+
+		size_t nBytes = size_t(nRun[1]) * sizeof(CHAR_INFO);
+
+		if (nRun[0] > nCells || nRun[1] > nCells - nRun[0] || size_t(pEnd - p) < nBytes)
+			return false;
+
+		memcpy(vecFrame.data() + nRun[0], p, nBytes);
+		p += nBytes;
+	}
+
+	return true;
+}
+
+#ifdef CONSOLE_GAME_ENGINE_STREAMING
+FrameServer::~FrameServer()
+{
+	Stop();
+}
+
+bool FrameServer::Start(const std::string& sPath)
+{
+	Stop();
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+
+	if (sPath.size() >= sizeof(addr.sun_path))
+		return false;
+
+	memcpy(addr.sun_path, sPath.c_str(), sPath.size() + 1);
+
+	WSADATA wsaData;
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+		return false;
+
+	// A socket file left behind by a previous run would make bind fail
+	DeleteFileA(sPath.c_str());
+
+	m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	u_long nNonBlocking = 1;
+
+	if (m_socket == INVALID_SOCKET ||
+		bind(m_socket, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		listen(m_socket, SOMAXCONN) == SOCKET_ERROR ||
+		ioctlsocket(m_socket, FIONBIO, &nNonBlocking) == SOCKET_ERROR)
+	{
+		if (m_socket != INVALID_SOCKET)
+			closesocket(m_socket);
+
+		m_socket = INVALID_SOCKET;
+		WSACleanup();
+
+		return false;
+	}
+
+	m_sPath = sPath;
+
+	m_delta.reset();
+	m_keyframe.reset();
+	m_nFrame = 0;
+	m_nPrevWidth = m_nPrevHeight = 0;
+	m_dTime = 0.0;
+	m_bRunning = true;
+
+	m_thrServer = std::thread(&FrameServer::Serve, this);
+
+	return true;
+}
+
+void FrameServer::Stop()
+{
+	if (!m_bRunning)
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+		m_bRunning = false;
+	}
+
+	m_cv.notify_all();
+	m_thrServer.join();
+
+	for (auto& viewer : m_vecViewers)
+		closesocket(viewer.socket);
+
+	m_vecViewers.clear();
+	m_nViewers = 0;
+
+	closesocket(m_socket);
+	m_socket = INVALID_SOCKET;
+
+	DeleteFileA(m_sPath.c_str());
+	WSACleanup();
+}
+
+bool FrameServer::IsRunning() const
+{
+	return m_bRunning;
+}
+
+size_t FrameServer::ViewerCount() const
+{
+	return m_nViewers;
+}
+
+void FrameServer::Publish(const CHAR_INFO* pScreen, int nWidth, int nHeight, float fDeltaTime)
+{
+	if (!m_bRunning)
+		return;
+
+	m_dTime += fDeltaTime;
+
+	// Nobody to send to, the next frame is a keyframe for whoever connects
+	if (m_nViewers == 0 && !m_bKeyframeWanted)
+	{
+		m_nPrevWidth = m_nPrevHeight = 0;
+		return;
+	}
+
+	uint32_t nTime = (uint32_t)(m_dTime * 1000.0);
+	bool bHasPrevious = nWidth == m_nPrevWidth && nHeight == m_nPrevHeight;
+
+	auto delta = NextPacket();
+	FrameRecorder::EncodeFrame(*delta, pScreen, bHasPrevious ? m_vecPrevious.data() : nullptr, nWidth, nHeight, nTime);
+
+	Packet keyframe;
+
+	// Keeps encoding keyframes until the server thread gets one to the viewer that asked
+	if (!bHasPrevious)
+		keyframe = delta;
+	else if (m_bKeyframeWanted)
+	{
+		auto full = NextPacket();
+		FrameRecorder::EncodeFrame(*full, pScreen, nullptr, nWidth, nHeight, nTime);
+		keyframe = full;
+	}
+
+	m_vecPrevious.assign(pScreen, pScreen + nWidth * nHeight);
+	m_nPrevWidth = nWidth;
+	m_nPrevHeight = nHeight;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+
+		m_delta = delta;
+		m_keyframe = keyframe;
+		m_nFrame++;
+	}
+
+	m_cv.notify_one();
+}
+
+std::shared_ptr<std::vector<uint8_t>> FrameServer::NextPacket()
+{
+	for (auto& packet : m_vecPackets)
+	{
+		if (packet.use_count() == 1)
+		{
+			// The server thread dropped its last reference, make its reads happen before our writes
+			std::atomic_thread_fence(std::memory_order_acquire);
+			return packet;
+		}
+	}
+
+	m_vecPackets.push_back(std::make_shared<std::vector<uint8_t>>());
+	return m_vecPackets.back();
+}
+
+void FrameServer::Serve()
+{
+	uint64_t nFrame = 0;
+	Packet delta, keyframe;
+
+	while (true)
+	{
+		bool bSending = false;
+
+		for (auto& viewer : m_vecViewers)
+			bSending |= viewer.packet != nullptr;
+
+		{
+			std::unique_lock<std::mutex> lock(m_mux);
+
+			// Sockets are polled, more often while a viewer is part way through a packet
+			m_cv.wait_for(lock, std::chrono::milliseconds(bSending ? 1 : 10), [&] { return m_nFrame != nFrame || !m_bRunning; });
+
+			if (!m_bRunning)
+				break;
+
+			nFrame = m_nFrame;
+			delta = m_delta;
+			keyframe = m_keyframe;
+		}
+
+		for (SOCKET s; (s = accept(m_socket, nullptr, nullptr)) != INVALID_SOCKET;)
+		{
+			u_long nNonBlocking = 1;
+			ioctlsocket(s, FIONBIO, &nNonBlocking);
+
+			Viewer viewer;
+			viewer.socket = s;
+
+			m_vecViewers.push_back(viewer);
+			m_bKeyframeWanted = true;
+		}
+
+		for (size_t i = 0; i < m_vecViewers.size();)
+		{
+			Viewer& viewer = m_vecViewers[i];
+
+			if (!viewer.packet && nFrame != 0 && viewer.nFrame != nFrame)
+			{
+				// Deltas only apply on top of the frame right before them, anyone further behind needs a keyframe
+				if (viewer.nFrame != 0 && viewer.nFrame + 1 == nFrame)
+					viewer.packet = delta;
+				else if (keyframe)
+				{
+					viewer.packet = keyframe;
+					m_bKeyframeWanted = false;
+				}
+				else
+					m_bKeyframeWanted = true;
+
+				if (viewer.packet)
+				{
+					viewer.nSent = 0;
+					viewer.nFrame = nFrame;
+				}
+			}
+
+			bool bClosed = false;
+
+			while (viewer.packet)
+			{
+				int nResult = send(viewer.socket, (const char*)viewer.packet->data() + viewer.nSent, int(viewer.packet->size() - viewer.nSent), 0);
+
+				if (nResult == SOCKET_ERROR)
+				{
+					bClosed = WSAGetLastError() != WSAEWOULDBLOCK;
+					break;
+				}
+
+				viewer.nSent += nResult;
+
+				if (viewer.nSent == viewer.packet->size())
+					viewer.packet.reset();
+			}
+
+			if (bClosed)
+			{
+				closesocket(viewer.socket);
+				m_vecViewers.erase(m_vecViewers.begin() + i);
+			}
+			else
+				i++;
+		}
+
+		m_nViewers = m_vecViewers.size();
+	}
+}
+
+FrameStreamClient::~FrameStreamClient()
+{
+	Disconnect();
+}
+
+bool FrameStreamClient::Connect(const std::string& sPath)
+{
+	Disconnect();
+
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+
+	if (sPath.size() >= sizeof(addr.sun_path))
+		return false;
+
+	memcpy(addr.sun_path, sPath.c_str(), sPath.size() + 1);
+
+	WSADATA wsaData;
+
+	if (WSAStartup(MAKEWORD(2, 2), &wsaData) != 0)
+		return false;
+
+	m_socket = socket(AF_UNIX, SOCK_STREAM, 0);
+
+	u_long nNonBlocking = 1;
+
+	if (m_socket == INVALID_SOCKET ||
+		connect(m_socket, (const sockaddr*)&addr, sizeof(addr)) == SOCKET_ERROR ||
+		ioctlsocket(m_socket, FIONBIO, &nNonBlocking) == SOCKET_ERROR)
+	{
+		if (m_socket != INVALID_SOCKET)
+			closesocket(m_socket);
+
+		m_socket = INVALID_SOCKET;
+		WSACleanup();
+
+		return false;
+	}
+
+	m_vecReceived.clear();
+	m_vecFrame.clear();
+	m_nWidth = m_nHeight = 0;
+
+	return true;
+}
+
+void FrameStreamClient::Disconnect()
+{
+	if (m_socket == INVALID_SOCKET)
+		return;
+
+	closesocket(m_socket);
+	m_socket = INVALID_SOCKET;
+
+	WSACleanup();
+}
+
+bool FrameStreamClient::IsConnected() const
+{
+	return m_socket != INVALID_SOCKET;
+}
+
+bool FrameStreamClient::Poll()
+{
+	if (m_socket == INVALID_SOCKET)
+		return false;
+
+	while (true)
+	{
+		size_t nOffset = m_vecReceived.size();
+		m_vecReceived.resize(nOffset + 65536);
+
+		int nResult = recv(m_socket, (char*)m_vecReceived.data() + nOffset, 65536, 0);
+
+		m_vecReceived.resize(nOffset + std::max(nResult, 0));
+
+		if (nResult > 0)
+			continue;
+
+		if (nResult == 0 || WSAGetLastError() != WSAEWOULDBLOCK)
+			Disconnect();
+
+		break;
+	}
+
+	bool bChanged = false;
+	size_t nRead = 0;
+
+	while (m_vecReceived.size() - nRead >= sizeof(uint32_t))
+	{
+		uint32_t nPayloadSize;
+		memcpy(&nPayloadSize, m_vecReceived.data() + nRead, sizeof(nPayloadSize));
+
+		if (m_vecReceived.size() - nRead - sizeof(uint32_t) < nPayloadSize)
+			break;
+
+		if (!FramePlayer::DecodeFrame(m_vecReceived.data() + nRead + sizeof(uint32_t), nPayloadSize, m_vecFrame, m_nWidth, m_nHeight))
+		{
+			Disconnect();
+			return bChanged;
+		}
+
+		nRead += sizeof(uint32_t) + nPayloadSize;
+		bChanged = true;
+	}
+
+	m_vecReceived.erase(m_vecReceived.begin(), m_vecReceived.begin() + nRead);
+
+	return bChanged;
+}
+
+const CHAR_INFO* FrameStreamClient::Frame() const
+{
+	return m_vecFrame.data();
+}
+
+int FrameStreamClient::Width() const
+{
+	return m_nWidth;
+}
+
+int FrameStreamClient::Height() const
+{
+	return m_nHeight;
+}
+#endif
+
+Surface::Surface(int nWidth, int nHeight, wchar_t c, short col)
+{
+	this->nWidth = std::max(nWidth, 0);
+	this->nHeight = std::max(nHeight, 0);
+
+	CHAR_INFO cell;
+	cell.Char.UnicodeChar = c;
+	cell.Attributes = col;
+
+	m_vecCells.assign((size_t)this->nWidth * (size_t)this->nHeight, cell);
+}
+
+Surface::Surface(const SpriteView& sprite) : Surface(sprite.nWidth, sprite.nHeight)
+{
+	for (int i = 0; i < nWidth * nHeight; i++)
+	{
+		m_vecCells[i].Char.UnicodeChar = sprite.GlyphData()[i];
+		m_vecCells[i].Attributes = sprite.ColourData()[i];
+	}
+}
+
+CHAR_INFO* Surface::Cells()
+{
+	return m_vecCells.data();
+}
+
+const CHAR_INFO* Surface::Cells() const
+{
+	return m_vecCells.data();
+}
+
+wchar_t Surface::GetGlyph(int x, int y) const
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		return m_vecCells[y * nWidth + x].Char.UnicodeChar;
+
+	return L' ';
+}
+
+short Surface::GetColour(int x, int y) const
+{
+	if (x >= 0 && x < nWidth && y >= 0 && y < nHeight)
+		return m_vecCells[y * nWidth + x].Attributes;
+
+	return FG_BLACK;
+}
+
+bool Surface::CopyTo(Sprite& sprite) const
+{
+	if (sprite.nWidth != nWidth || sprite.nHeight != nHeight)
+		return false;
+
+	for (int y = 0; y < nHeight; y++)
+		for (int x = 0; x < nWidth; x++)
+		{
+			sprite.SetGlyph(x, y, m_vecCells[y * nWidth + x].Char.UnicodeChar);
+			sprite.SetColour(x, y, m_vecCells[y * nWidth + x].Attributes);
+		}
+
+	return true;
+}
+
+FrameArena::FrameArena(size_t nInitialSize)
+{
+	m_vecBlocks.push_back({ new uint8_t[std::max<size_t>(nInitialSize, 64)], std::max<size_t>(nInitialSize, 64) });
+}
+
+FrameArena::~FrameArena()
+{
+	for (auto& block : m_vecBlocks)
+		delete[] block.pData;
+}
+
+void* FrameArena::Allocate(size_t nSize, size_t nAlign)
+{
+	while (true)
+	{
+		Block& block = m_vecBlocks[m_nBlock];
+
+		uintptr_t nStart = (uintptr_t)block.pData + m_nOffset;
+		uintptr_t nAligned = (nStart + nAlign - 1) & ~uintptr_t(nAlign - 1);
+
+		if (nAligned + nSize <= (uintptr_t)block.pData + block.nSize)
+		{
+			m_nOffset = nAligned + nSize - (uintptr_t)block.pData;
+			return (void*)nAligned;
+		}
+
+		m_nUsedBefore += block.nSize;
+		m_nOffset = 0;
+
+		// Blocks after the current one are only left over from a Rewind, otherwise grow geometrically
+		if (++m_nBlock == m_vecBlocks.size())
+		{
+			size_t nBlockSize = std::max(m_vecBlocks.back().nSize * 2, nSize + nAlign);
+			m_vecBlocks.push_back({ new uint8_t[nBlockSize], nBlockSize });
+		}
+	}
+}
+
+void FrameArena::Reset()
+{
+	if (m_vecBlocks.size() > 1)
+	{
+		size_t nTotal = Capacity();
+
+		for (auto& block : m_vecBlocks)
+			delete[] block.pData;
+
+		m_vecBlocks.clear();
+		m_vecBlocks.push_back({ new uint8_t[nTotal], nTotal });
+	}
+
+	m_nBlock = 0;
+	m_nOffset = 0;
+	m_nUsedBefore = 0;
+}
+
+FrameArena::Marker FrameArena::Mark() const
+{
+	return { m_nBlock, m_nOffset };
+}
+
+void FrameArena::Rewind(const Marker& mark)
+{
+	// Blocks that were moved past count as fully used, so walk back over them
+	while (m_nBlock > mark.nBlock)
+	{
+		m_nBlock--;
+		m_nUsedBefore -= m_vecBlocks[m_nBlock].nSize;
+	}
+
+	m_nOffset = mark.nOffset;
+}
+
+size_t FrameArena::Used() const
+{
+	return m_nUsedBefore + m_nOffset;
+}
+
+size_t FrameArena::Capacity() const
+{
+	size_t nTotal = 0;
+
+	for (auto& block : m_vecBlocks)
+		nTotal += block.nSize;
+
+	return nTotal;
+}
+
+void VtEncoder::Encode(std::wstring& sOut, const CHAR_INFO* pCells, const CellColour* pColours, int nWidth, int nHeight, bool bFull,
+	int nFirstRow, int nRows)
+{
+	// Console attributes are BGR ordered while SGR colours are RGB ordered
+	static const int nAnsiIndex[8] = { 0, 4, 2, 6, 1, 5, 3, 7 };
+
+	auto digits = [](uint32_t n)
+		{
+			int len = 1;
+
+			while (n >= 10)
+			{
+				n /= 10;
+				len++;
+			}
+
+			return len;
+		};
+
+	auto appendNumber = [&](uint32_t n)
+		{
+			wchar_t buf[10];
+			int len = 0;
+
+			do
+			{
+				buf[len++] = L'0' + n % 10;
+				n /= 10;
+			} while (n > 0);
+
+			while (len > 0)
+				sOut += buf[--len];
+		};
+
+	// Palette colours are tagged with a bit that can't appear in an extended colour
+	auto appendColour = [&](uint32_t colour, bool bForeground)
+		{
+			switch (colour & 0xFF000000)
+			{
+			case EXT_COLOUR_RGB:
+			{
+				sOut += bForeground ? L"38;2;" : L"48;2;";
+				appendNumber((colour >> 16) & 0xFF); sOut += L';';
+				appendNumber((colour >> 8) & 0xFF); sOut += L';';
+				appendNumber(colour & 0xFF);
+			}
+			break;
+
+			case EXT_COLOUR_INDEXED:
+			{
+				sOut += bForeground ? L"38;5;" : L"48;5;";
+				appendNumber(colour & 0xFF);
+			}
+			break;
+
+			default:
+			{
+				uint32_t nBase = bForeground ? 30 : 40;
+
+				if (colour & 0x8)
+					nBase += 60;
+
+				appendNumber(nBase + nAnsiIndex[colour & 0x7]);
+			}
+			break;
+
+			}
+		};
+
+	sOut.clear();
+
+	if (nWidth != m_nWidth || nHeight != m_nHeight)
+	{
+		m_vecPrevious.resize((size_t)nWidth * (size_t)nHeight);
+		m_nWidth = nWidth;
+		m_nHeight = nHeight;
+		bFull = true;
+	}
+
+	bool bStarted = false;
+
+	auto begin = [&]()
+		{
+			if (!bStarted && m_bSynchronized)
+				sOut += L"\x1b[?2026h";
+
+			bStarted = true;
+		};
+
+	if (bFull)
+	{
+		// Also clears whatever is left outside the frame, e.g. after the screen shrank
+		begin();
+		sOut += L"\x1b[?25l\x1b[0m\x1b[2J";
+
+		m_nFg = COLOUR_UNKNOWN;
+		m_nBg = COLOUR_UNKNOWN;
+	}
+
+	// Where the next glyph lands, -1 when unknown. That is the case at the start of a frame
+	// and after writing the last column, where terminals differ in how they wrap
+	int cx = -1, cy = -1;
+
+	if (bFull || nHeight <= 0)
+	{
+		nFirstRow = 0;
+		nRows = nHeight;
+	}
+	else
+	{
+		nFirstRow = ((nFirstRow % nHeight) + nHeight) % nHeight;
+		nRows = std::clamp(nRows, 0, nHeight);
+	}
+
+	for (int r = 0; r < nRows; r++)
+	{
+		int y = (nFirstRow + r) % nHeight;
+
+		for (int x = 0; x < nWidth; x++)
+		{
+			int i = y * nWidth + x;
+
+			const CHAR_INFO& info = pCells[i];
+
+			Cell cell;
+			cell.c = info.Char.UnicodeChar ? info.Char.UnicodeChar : L' ';
+			cell.fg = pColours && pColours[i].fg != EXT_COLOUR_NONE ? pColours[i].fg : 0x80000000 | (info.Attributes & 0x0F);
+			cell.bg = pColours && pColours[i].bg != EXT_COLOUR_NONE ? pColours[i].bg : 0x80000000 | ((info.Attributes >> 4) & 0x0F);
+
+			Cell& prev = m_vecPrevious[i];
+
+			if (!bFull && cell.c == prev.c && cell.fg == prev.fg && cell.bg == prev.bg)
+				continue;
+
+			prev = cell;
+			begin();
+
+			if (cy != y || cx < 0 || cx > x)
+			{
+				// CUP, the column can be left out when it is the first one
+				sOut += L"\x1b[";
+				appendNumber(y + 1);
+
+				if (x > 0)
+				{
+					sOut += L';';
+					appendNumber(x + 1);
+				}
+
+				sOut += L'H';
+			}
+			else if (cx < x)
+			{
+				// The cells in between are unchanged, so rewriting them is free of side effects
+				// as long as they don't need different colours
+				int nGap = x - cx;
+				bool bRewrite = nGap <= 3 + digits(nGap);
+
+				for (int j = cx; bRewrite && j < x; j++)
+					bRewrite = m_vecPrevious[y * nWidth + j].fg == m_nFg && m_vecPrevious[y * nWidth + j].bg == m_nBg;
+
+				if (bRewrite)
+				{
+					for (int j = cx; j < x; j++)
+						sOut += m_vecPrevious[y * nWidth + j].c;
+				}
+				else
+				{
+					// CUF
+					sOut += L"\x1b[";
+
+					if (nGap > 1)
+						appendNumber(nGap);
+
+					sOut += L'C';
+				}
+			}
+
+			if (cell.fg != m_nFg || cell.bg != m_nBg)
+			{
+				sOut += L"\x1b[";
+
+				if (cell.fg != m_nFg)
+					appendColour(cell.fg, true);
+
+				if (cell.fg != m_nFg && cell.bg != m_nBg)
+					sOut += L';';
+
+				if (cell.bg != m_nBg)
+					appendColour(cell.bg, false);
+
+				sOut += L'm';
+
+				m_nFg = cell.fg;
+				m_nBg = cell.bg;
+			}
+
+			sOut += cell.c;
+
+			cx = x + 1 < nWidth ? x + 1 : -1;
+			cy = y;
+		}
+	}
+
+	if (bStarted && m_bSynchronized)
+		sOut += L"\x1b[?2026l";
+}
+
+void VtEncoder::SetSynchronized(bool bEnable)
+{
+	m_bSynchronized = bEnable;
+}
+
+AssetWatcher::~AssetWatcher()
+{
+	Stop();
+}
+
+bool AssetWatcher::Start(const std::wstring& sDirectory)
+{
+	Stop();
+
+	m_sDirectory = NormalisePath(sDirectory);
+
+	while (m_sDirectory.size() > 3 && (m_sDirectory.back() == L'\\' || m_sDirectory.back() == L'/'))
+		m_sDirectory.pop_back();
+
+	m_hDirectory = CreateFileW(m_sDirectory.c_str(), FILE_LIST_DIRECTORY, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+		NULL, OPEN_EXISTING, FILE_FLAG_BACKUP_SEMANTICS | FILE_FLAG_OVERLAPPED, NULL);
+
+	if (m_hDirectory == INVALID_HANDLE_VALUE)
+		return false;
+
+	m_hStop = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+	if (!m_hStop)
+	{
+		CloseHandle(m_hDirectory);
+		m_hDirectory = INVALID_HANDLE_VALUE;
+		return false;
+	}
+
+	m_thrWatcher = std::thread(&AssetWatcher::Watch, this);
+
+	return true;
+}
+
+void AssetWatcher::Stop()
+{
+	if (!m_thrWatcher.joinable())
+		return;
+
+	SetEvent(m_hStop);
+	m_thrWatcher.join();
+
+	CloseHandle(m_hStop);
+	CloseHandle(m_hDirectory);
+
+	m_hStop = NULL;
+	m_hDirectory = INVALID_HANDLE_VALUE;
+}
+
+bool AssetWatcher::IsWatching() const
+{
+	return m_thrWatcher.joinable();
+}
+
+void AssetWatcher::TrackSprite(Sprite* sprite, const std::wstring& sFileName)
+{
+	std::wstring sPath = NormalisePath(sFileName);
+
+	std::lock_guard<std::mutex> lock(m_mux);
+	m_mapSprites[sprite] = sPath;
+}
+
+void AssetWatcher::UntrackSprite(Sprite* sprite)
+{
+	std::lock_guard<std::mutex> lock(m_mux);
+	m_mapSprites.erase(sprite);
+
+	// A reload may already be waiting for it
+	for (auto& loaded : m_vecLoaded)
+	{
+		if (loaded.pTarget == sprite)
+			loaded.pTarget = nullptr;
+	}
+}
+
+void AssetWatcher::TrackFile(const std::wstring& sFileName, std::function<void()> fnReload)
+{
+	std::wstring sPath = NormalisePath(sFileName);
+
+	std::lock_guard<std::mutex> lock(m_mux);
+	m_vecFiles.push_back({ sPath, std::move(fnReload) });
+}
+
+int AssetWatcher::Apply()
+{
+	std::vector<LoadedSprite> vecLoaded;
+	std::vector<std::function<void()>> vecCallbacks;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+
+		if (m_vecLoaded.empty() && m_vecChangedFiles.empty())
+			return 0;
+
+		vecLoaded.swap(m_vecLoaded);
+
+		for (auto& loaded : vecLoaded)
+		{
+			// Skip sprites that were untracked or moved to another file in the meantime
+			auto it = m_mapSprites.find(loaded.pTarget);
+
+			if (it != m_mapSprites.end() && it->second == loaded.sPath)
+				loaded.pTarget->Swap(*loaded.pSprite);
+		}
+
+		for (auto& sPath : m_vecChangedFiles)
+		{
+			for (auto& file : m_vecFiles)
+			{
+				if (file.first == sPath)
+					vecCallbacks.push_back(file.second);
+			}
+		}
+
+		m_vecChangedFiles.clear();
+	}
+
+	// Callbacks may track more assets, and the old cells are freed here, both outside the lock
+	for (auto& fnReload : vecCallbacks)
+		fnReload();
+
+	return int(vecLoaded.size() + vecCallbacks.size());
+}
+
+void AssetWatcher::Watch()
+{
+	alignas(DWORD) uint8_t buffer[16 * 1024];
+
+	OVERLAPPED overlapped = {};
+	overlapped.hEvent = CreateEventW(NULL, TRUE, FALSE, NULL);
+
+	// Changed files that haven't settled yet, with when they were last touched and how often loading them failed
+	struct Pending
+	{
+		DWORD nTime;
+		int nRetries;
+	};
+
+	std::unordered_map<std::wstring, Pending> mapPending;
+	bool bReading = false;
+
+	while (overlapped.hEvent)
+	{
+		if (!bReading)
+		{
+			ResetEvent(overlapped.hEvent);
+
+			bReading = ReadDirectoryChangesW(m_hDirectory, buffer, sizeof(buffer), TRUE,
+				FILE_NOTIFY_CHANGE_LAST_WRITE | FILE_NOTIFY_CHANGE_FILE_NAME | FILE_NOTIFY_CHANGE_SIZE, NULL, &overlapped, NULL);
+
+			// The directory is gone
+			if (!bReading)
+				break;
+		}
+
+		DWORD nNow = GetTickCount();
+		DWORD nTimeout = INFINITE;
+
+		for (auto& pending : mapPending)
+		{
+			DWORD nElapsed = nNow - pending.second.nTime;
+			nTimeout = std::min(nTimeout, nElapsed < SETTLE_TIME_MS ? SETTLE_TIME_MS - nElapsed : 0);
+		}
+
+		HANDLE hEvents[2] = { overlapped.hEvent, m_hStop };
+		DWORD nResult = WaitForMultipleObjects(2, hEvents, FALSE, nTimeout);
+
+		if (nResult == WAIT_OBJECT_0 + 1)
+			break;
+
+		if (nResult == WAIT_OBJECT_0)
+		{
+			DWORD nBytes = 0;
+			GetOverlappedResult(m_hDirectory, &overlapped, &nBytes, FALSE);
+
+			bReading = false;
+			nNow = GetTickCount();
+
+			if (nBytes == 0)
+			{
+				// The buffer overflowed and the changes were lost, so check everything that is tracked
+				std::lock_guard<std::mutex> lock(m_mux);
+
+				for (auto& sprite : m_mapSprites)
+					mapPending[sprite.second] = { nNow, 0 };
+
+				for (auto& file : m_vecFiles)
+					mapPending[file.first] = { nNow, 0 };
+			}
+			else
+			{
+				size_t nOffset = 0;
+
+				while (true)
+				{
+					const FILE_NOTIFY_INFORMATION* pInfo = (const FILE_NOTIFY_INFORMATION*)(buffer + nOffset);
+
+					if (pInfo->Action == FILE_ACTION_ADDED || pInfo->Action == FILE_ACTION_MODIFIED || pInfo->Action == FILE_ACTION_RENAMED_NEW_NAME)
+					{
+						std::wstring sName(pInfo->FileName, pInfo->FileNameLength / sizeof(wchar_t));
+						mapPending[NormalisePath(m_sDirectory + L'\\' + sName)] = { nNow, 0 };
+					}
+
+					if (pInfo->NextEntryOffset == 0)
+						break;
+
+					nOffset += pInfo->NextEntryOffset;
+				}
+			}
+		}
+
+		nNow = GetTickCount();
+
+		for (auto it = mapPending.begin(); it != mapPending.end();)
+		{
+			if (nNow - it->second.nTime < SETTLE_TIME_MS)
+				++it;
+			else if (Reload(it->first) || ++it->second.nRetries >= MAX_RETRIES)
+				it = mapPending.erase(it);
+			else
+				(it++)->second.nTime = nNow;
+		}
+	}
+
+	if (bReading)
+	{
+		DWORD nBytes = 0;
+		CancelIo(m_hDirectory);
+		GetOverlappedResult(m_hDirectory, &overlapped, &nBytes, TRUE);
+	}
+
+	if (overlapped.hEvent)
+		CloseHandle(overlapped.hEvent);
+}
+
+bool AssetWatcher::Reload(const std::wstring& sPath)
+{
+	std::vector<Sprite*> vecTargets;
+	bool bTrackedFile = false;
+
+	{
+		std::lock_guard<std::mutex> lock(m_mux);
+
+		for (auto& sprite : m_mapSprites)
+		{
+			if (sprite.second == sPath)
+				vecTargets.push_back(sprite.first);
+		}
+
+		for (auto& file : m_vecFiles)
+			bTrackedFile |= file.first == sPath;
+	}
+
+	// Loading happens without the lock so the game thread never waits on the disk
+	std::vector<LoadedSprite> vecLoaded;
+
+	for (Sprite* target : vecTargets)
+	{
+		auto sprite = std::make_unique<Sprite>(1, 1);
+
+		if (!sprite->Load(sPath))
+			return false;
+
+		vecLoaded.push_back({ target, sPath, std::move(sprite) });
+	}
+
+	std::lock_guard<std::mutex> lock(m_mux);
+
+	for (auto& loaded : vecLoaded)
+		m_vecLoaded.push_back(std::move(loaded));
+
+	if (bTrackedFile)
+		m_vecChangedFiles.push_back(sPath);
+
+	return true;
+}
+
+std::wstring AssetWatcher::NormalisePath(const std::wstring& sFileName)
+{
+	wchar_t sFull[MAX_PATH];
+	DWORD nLength = GetFullPathNameW(sFileName.c_str(), MAX_PATH, sFull, NULL);
+
+	std::wstring sPath = nLength > 0 && nLength < MAX_PATH ? std::wstring(sFull, nLength) : sFileName;
+
+	// Paths on Windows are case insensitive
+	for (auto& c : sPath)
+		c = towlower(c);
+
+	return sPath;
+}
+
+#ifdef CONSOLE_GAME_ENGINE_COROUTINES
+namespace detail
+{
+	ScriptFramePool& ScriptFramePool::Instance()
+	{
+		static ScriptFramePool pool;
+		return pool;
+	}
+
+	void* ScriptFramePool::Allocate(size_t nSize)
+	{
+		size_t nClass = (nSize + GRANULARITY - 1) / GRANULARITY;
+
+		if (nClass >= SIZE_CLASSES)
+			return ::operator new(nSize);
+
+		ScriptFramePool& pool = Instance();
+
+		{
+			std::lock_guard<std::mutex> lock(pool.m_mux);
+
+			if (FreeFrame* pFrame = pool.m_pFree[nClass])
+			{
+				pool.m_pFree[nClass] = pFrame->pNext;
+				return pFrame;
+			}
+		}
+
+		// Frames of one class are interchangeable, so allocate the whole class size
+		return ::operator new(nClass * GRANULARITY);
+	}
+
+	void ScriptFramePool::Free(void* p, size_t nSize)
+	{
+		size_t nClass = (nSize + GRANULARITY - 1) / GRANULARITY;
+
+		if (nClass >= SIZE_CLASSES)
+		{
+			::operator delete(p);
+			return;
+		}
+
+		ScriptFramePool& pool = Instance();
+		std::lock_guard<std::mutex> lock(pool.m_mux);
+
+		FreeFrame* pFrame = new (p) FreeFrame;
+		pFrame->pNext = pool.m_pFree[nClass];
+		pool.m_pFree[nClass] = pFrame;
+	}
+}
+
+Script::Script(Handle handle) : m_handle(handle)
+{
+}
+
+Script::Script(Script&& script) noexcept : m_handle(script.m_handle)
+{
+	script.m_handle = nullptr;
+}
+
+Script& Script::operator=(Script&& script) noexcept
+{
+	if (this != &script)
+	{
+		if (m_handle)
+			m_handle.destroy();
+
+		m_handle = script.m_handle;
+		script.m_handle = nullptr;
+	}
+
+	return *this;
+}
+
+Script::~Script()
+{
+	if (m_handle)
+		m_handle.destroy();
+}
+
+Script::Handle Script::Release()
+{
+	Handle handle = m_handle;
+	m_handle = nullptr;
+	return handle;
+}
+
+void NextFrame::await_suspend(Script::Handle handle) const
+{
+	handle.promise().pScheduler->m_vecNextFrame.push_back(handle);
+}
+
+void Seconds::await_suspend(Script::Handle handle) const
+{
+	ScriptScheduler* pScheduler = handle.promise().pScheduler;
+
+	pScheduler->m_vecTimers.push_back({ pScheduler->m_dTime + (double)fSeconds, pScheduler->m_nTimerOrder++, handle });
+	std::push_heap(pScheduler->m_vecTimers.begin(), pScheduler->m_vecTimers.end(), std::greater<ScriptScheduler::Timer>());
+}
+
+void KeyPressed::await_suspend(Script::Handle handle) const
+{
+	ScriptScheduler* pScheduler = handle.promise().pScheduler;
+
+	// There is no such key to wait for, so just wait a frame
+	if (nKey < 0 || nKey >= 256)
+	{
+		pScheduler->m_vecNextFrame.push_back(handle);
+		return;
+	}
+
+	if (pScheduler->m_vecKeyWaits[nKey].empty())
+		pScheduler->m_vecWaitedKeys.push_back(nKey);
+
+	pScheduler->m_vecKeyWaits[nKey].push_back(handle);
+}
+
+ScriptScheduler::~ScriptScheduler()
+{
+	Clear();
+}
+
+void ScriptScheduler::Start(Script script)
+{
+	Script::Handle handle = script.Release();
+
+	if (!handle)
+		return;
+
+	handle.promise().pScheduler = this;
+	m_vecNextFrame.push_back(handle);
+
+	m_nScripts++;
+}
+
+void ScriptScheduler::Update(float fDeltaTime, const KeyState* pKeys)
+{
+	m_dTime += fDeltaTime;
+
+	// Everything that is due is collected first, so scripts that wait again while being resumed
+	// land in the queues for the next call
+	m_vecResuming.swap(m_vecNextFrame);
+
+	while (!m_vecTimers.empty() && m_vecTimers.front().dWake <= m_dTime)
+	{
+		std::pop_heap(m_vecTimers.begin(), m_vecTimers.end(), std::greater<Timer>());
+		m_vecResuming.push_back(m_vecTimers.back().handle);
+		m_vecTimers.pop_back();
+	}
+
+	for (size_t i = 0; i < m_vecWaitedKeys.size();)
+	{
+		int nKey = m_vecWaitedKeys[i];
+
+		if (pKeys[nKey].bPressed)
+		{
+			std::vector<Script::Handle>& vecWaits = m_vecKeyWaits[nKey];
+
+			m_vecResuming.insert(m_vecResuming.end(), vecWaits.begin(), vecWaits.end());
+			vecWaits.clear();
+
+			m_vecWaitedKeys[i] = m_vecWaitedKeys.back();
+			m_vecWaitedKeys.pop_back();
+		}
+		else
+			i++;
+	}
+
+	for (Script::Handle handle : m_vecResuming)
+		Resume(handle);
+
+	m_vecResuming.clear();
+}
+
+void ScriptScheduler::Clear()
+{
+	for (Script::Handle handle : m_vecNextFrame)
+		handle.destroy();
+
+	for (const Timer& timer : m_vecTimers)
+		timer.handle.destroy();
+
+	for (int nKey : m_vecWaitedKeys)
+	{
+		for (Script::Handle handle : m_vecKeyWaits[nKey])
+			handle.destroy();
+
+		m_vecKeyWaits[nKey].clear();
+	}
+
+	m_vecNextFrame.clear();
+	m_vecTimers.clear();
+	m_vecWaitedKeys.clear();
+
+	m_nScripts = 0;
+}
+
+size_t ScriptScheduler::Count() const
+{
+	return m_nScripts;
+}
+
+double ScriptScheduler::Time() const
+{
+	return m_dTime;
+}
+
+void ScriptScheduler::Resume(Script::Handle handle)
+{
+	handle.resume();
+
+	if (handle.done())
+	{
+		handle.destroy();
+		m_nScripts--;
+	}
+}
+#endif
+
+TimerWheel::TimerWheel()
+{
+	std::fill(std::begin(m_arySlots), std::end(m_arySlots), NONE);
+	std::fill(std::begin(m_aryOccupied), std::end(m_aryOccupied), 0);
+}
+
+TimerId TimerWheel::Schedule(float fDelay, std::function<void()> fnCallback, float fRepeat)
+{
+	uint32_t nTimer;
+
+	if (m_nFree != NONE)
+	{
+		nTimer = m_nFree;
+		m_nFree = m_vecTimers[nTimer].nNext;
+	}
+	else
+	{
+		nTimer = (uint32_t)m_vecTimers.size();
+		m_vecTimers.push_back({});
+	}
+
+	// Far enough for any game, but the tick count can't overflow
+	constexpr double MAX_SECONDS = 1e12;
+
+	double dDelay = fDelay > 0.0f ? std::min((double)fDelay, MAX_SECONDS) : 0.0;
+	double dRepeat = fRepeat > 0.0f ? std::min((double)fRepeat, MAX_SECONDS) : 0.0;
+
+	Timer& timer = m_vecTimers[nTimer];
+
+	timer.nDue = std::max((uint64_t)((m_dTime + dDelay) * TICKS_PER_SECOND), m_nTick + 1);
+	timer.nOrder = m_nOrder++;
+	timer.nRepeat = dRepeat > 0.0 ? std::max((uint64_t)(dRepeat * TICKS_PER_SECOND), (uint64_t)1) : 0;
+	timer.fnCallback = std::move(fnCallback);
+	timer.state = TimerState::Pending;
+
+	Insert(nTimer);
+	m_nCount++;
+
+	return ((TimerId)timer.nGeneration << 32) | (TimerId)(nTimer + 1);
+}
+
+bool TimerWheel::Cancel(TimerId id)
+{
+	uint32_t nTimer = Find(id);
+
+	if (nTimer == NONE)
+		return false;
+
+	Timer& timer = m_vecTimers[nTimer];
+
+	switch (timer.state)
+	{
+	case TimerState::Pending:
+		Unlink(nTimer);
+		Release(nTimer);
+		return true;
+
+	// Released by Fire once the callbacks of this tick have run
+	case TimerState::Firing:
+		timer.state = TimerState::Cancelled;
+		return true;
+
+	default:
+		return false;
+	}
+}
+
+bool TimerWheel::IsPending(TimerId id) const
+{
+	uint32_t nTimer = Find(id);
+
+	if (nTimer == NONE)
+		return false;
+
+	const Timer& timer = m_vecTimers[nTimer];
+	return timer.state == TimerState::Pending || (timer.state == TimerState::Firing && timer.nRepeat > 0);
+}
+
+void TimerWheel::Update(float fDeltaTime)
+{
+	if (fDeltaTime > 0.0f)
+		m_dTime += fDeltaTime;
+
+	uint64_t nTarget = std::max((uint64_t)(m_dTime * TICKS_PER_SECOND), m_nTick);
+
+	while (m_nTick < nTarget)
+	{
+		if (m_nCount == 0)
+		{
+			m_nTick = nTarget;
+			break;
+		}
+
+		// Skip straight to the next tick with work, an occupied slot or the end of the block of 256
+		// ticks where the higher levels cascade
+		uint64_t nBlock = m_nTick & ~(uint64_t)(SLOTS - 1);
+		int nSlot = NextOccupied(int(m_nTick - nBlock) + 1);
+		uint64_t nNext = nBlock + nSlot;
+
+		if (nNext > nTarget)
+		{
+			m_nTick = nTarget;
+			break;
+		}
+
+		m_nTick = nNext;
+
+		if (nSlot == SLOTS)
+			Cascade();
+
+		Fire(int(m_nTick & (SLOTS - 1)));
+	}
+}
+
+void TimerWheel::Clear()
+{
+	for (uint32_t i = 0; i < (uint32_t)m_vecTimers.size(); i++)
+	{
+		if (m_vecTimers[i].state != TimerState::Free)
+			Release(i);
+	}
+
+	std::fill(std::begin(m_arySlots), std::end(m_arySlots), NONE);
+	std::fill(std::begin(m_aryOccupied), std::end(m_aryOccupied), 0);
+
+	m_vecFiring.clear();
+}
+
+size_t TimerWheel::Count() const
+{
+	return m_nCount;
+}
+
+double TimerWheel::Time() const
+{
+	return m_dTime;
+}
+
+uint32_t TimerWheel::Find(TimerId id) const
+{
+	uint32_t nTimer = uint32_t(id & 0xFFFFFFFF) - 1;
+
+	if (nTimer >= (uint32_t)m_vecTimers.size() || m_vecTimers[nTimer].nGeneration != uint32_t(id >> 32))
+		return NONE;
+
+	return m_vecTimers[nTimer].state == TimerState::Free ? NONE : nTimer;
+}
+
+void TimerWheel::Insert(uint32_t nTimer)
+{
+	uint64_t nDue = m_vecTimers[nTimer].nDue;
+
+	// The lowest level whose span contains both the current and the due tick
+	for (int nLevel = 0; nLevel < LEVELS; nLevel++)
+	{
+		int nShift = SLOT_BITS * (nLevel + 1);
+
+		if ((nDue >> nShift) == (m_nTick >> nShift))
+		{
+			Link(nTimer, nLevel * SLOTS + int((nDue >> (SLOT_BITS * nLevel)) & (SLOTS - 1)));
+			return;
+		}
+	}
+
+	Link(nTimer, OVERFLOW_SLOT);
+}
+
+void TimerWheel::Link(uint32_t nTimer, int nSlot)
+{
+	Timer& timer = m_vecTimers[nTimer];
+
+	timer.nSlot = (uint16_t)nSlot;
+	timer.nPrev = NONE;
+	timer.nNext = m_arySlots[nSlot];
+
+	if (timer.nNext != NONE)
+		m_vecTimers[timer.nNext].nPrev = nTimer;
+
+	m_arySlots[nSlot] = nTimer;
+
+	if (nSlot < SLOTS)
+		m_aryOccupied[nSlot / 64] |= (uint64_t)1 << (nSlot % 64);
+}
+
+void TimerWheel::Unlink(uint32_t nTimer)
+{
+	Timer& timer = m_vecTimers[nTimer];
+
+	if (timer.nPrev != NONE)
+		m_vecTimers[timer.nPrev].nNext = timer.nNext;
+	else
+		m_arySlots[timer.nSlot] = timer.nNext;
+
+	if (timer.nNext != NONE)
+		m_vecTimers[timer.nNext].nPrev = timer.nPrev;
+
+	if (timer.nSlot < SLOTS && m_arySlots[timer.nSlot] == NONE)
+		m_aryOccupied[timer.nSlot / 64] &= ~((uint64_t)1 << (timer.nSlot % 64));
+}
+
+void TimerWheel::Release(uint32_t nTimer)
+{
+	Timer& timer = m_vecTimers[nTimer];
+
+	timer.fnCallback = nullptr;
+	timer.state = TimerState::Free;
+
+	// Ids of the released timer no longer match
+	timer.nGeneration++;
+
+	timer.nNext = m_nFree;
+	m_nFree = nTimer;
+
+	m_nCount--;
+}
+
+void TimerWheel::Cascade()
+{
+	// Highest level first, so timers can fall through to the slots cascaded after them
+	if ((m_nTick & 0xFFFFFFFF) == 0)
+		Redistribute(OVERFLOW_SLOT);
+
+	for (int nLevel = LEVELS - 1; nLevel > 0; nLevel--)
+	{
+		int nShift = SLOT_BITS * nLevel;
+
+		if ((m_nTick & (((uint64_t)1 << nShift) - 1)) == 0)
+			Redistribute(nLevel * SLOTS + int((m_nTick >> nShift) & (SLOTS - 1)));
+	}
+}
+
+void TimerWheel::Redistribute(int nSlot)
+{
+	uint32_t nTimer = m_arySlots[nSlot];
+	m_arySlots[nSlot] = NONE;
+
+	while (nTimer != NONE)
+	{
+		uint32_t nNext = m_vecTimers[nTimer].nNext;
+		Insert(nTimer);
+		nTimer = nNext;
+	}
+}
+
+void TimerWheel::Fire(int nSlot)
+{
+	uint32_t nTimer = m_arySlots[nSlot];
+
+	if (nTimer == NONE)
+		return;
+
+	m_arySlots[nSlot] = NONE;
+	m_aryOccupied[nSlot / 64] &= ~((uint64_t)1 << (nSlot % 64));
+
+	// Every timer in a slot of level 0 is due on this tick
+	m_vecFiring.clear();
+
+	for (; nTimer != NONE; nTimer = m_vecTimers[nTimer].nNext)
+	{
+		m_vecTimers[nTimer].state = TimerState::Firing;
+		m_vecFiring.push_back(nTimer);
+	}
+
+	std::sort(m_vecFiring.begin(), m_vecFiring.end(), [this](uint32_t a, uint32_t b)
+		{
+			return m_vecTimers[a].nOrder < m_vecTimers[b].nOrder;
+		});
+
+	for (size_t i = 0; i < m_vecFiring.size(); i++)
+	{
+		nTimer = m_vecFiring[i];
+
+		if (m_vecTimers[nTimer].state == TimerState::Firing)
+		{
+			// Callbacks may schedule timers, which can move m_vecTimers
+			std::function<void()> fnCallback = std::move(m_vecTimers[nTimer].fnCallback);
+			fnCallback();
+			m_vecTimers[nTimer].fnCallback = std::move(fnCallback);
+		}
+
+		Timer& timer = m_vecTimers[nTimer];
+
+		if (timer.state == TimerState::Firing && timer.nRepeat > 0)
+		{
+			// Due times advance by the interval so repeating timers don't drift with the frame rate
+			timer.nDue = std::max(timer.nDue + timer.nRepeat, m_nTick + 1);
+			timer.nOrder = m_nOrder++;
+			timer.state = TimerState::Pending;
+
+			Insert(nTimer);
+		}
+		else
+			Release(nTimer);
+	}
+
+	m_vecFiring.clear();
+}
+
+int TimerWheel::NextOccupied(int nFrom) const
+{
+	for (int nWord = nFrom / 64; nWord < SLOTS / 64; nWord++)
+	{
+		uint64_t nBits = m_aryOccupied[nWord];
+
+		if (nWord == nFrom / 64)
+			nBits &= ~(uint64_t)0 << (nFrom % 64);
+
+		if (nBits != 0)
+		{
+			int nSlot = nWord * 64;
+
+			while (!(nBits & 1))
+			{
+				nBits >>= 1;
+				nSlot++;
+			}
+
+			return nSlot;
+		}
+	}
+
+	return SLOTS;
+}
+
+void RewindBuffer::AddState(void* pData, size_t nSize)
+{
+	m_vecStates.push_back({ pData, nSize, nullptr, nullptr });
+}
+
+void RewindBuffer::AddState(std::function<void(std::vector<uint8_t>&)> fnSave, std::function<void(const uint8_t*, size_t)> fnLoad)
+{
+	m_vecStates.push_back({ nullptr, 0, std::move(fnSave), std::move(fnLoad) });
+}
+
+void RewindBuffer::SetBudget(size_t nBytes)
+{
+	Clear();
+
+	// Allocated again on the next capture
+	m_nBudget = nBytes;
+	std::vector<uint8_t>().swap(m_vecData);
+}
+
+void RewindBuffer::SetKeyframeInterval(int nFrames)
+{
+	Clear();
+	m_nKeyframeInterval = std::max(nFrames, 1);
+}
+
+void RewindBuffer::SetMaxDuration(float fSeconds)
+{
+	m_dMaxDuration = std::max((double)fSeconds, 0.0);
+}
+
+bool RewindBuffer::Capture(const CHAR_INFO* pScreen, int nWidth, int nHeight, float fDeltaTime)
+{
+	if (m_bSeeking)
+		Resume();
+
+	m_dTime += fDeltaTime;
+
+	if (m_vecData.size() != m_nBudget)
+		m_vecData.resize(m_nBudget);
+
+	BuildSnapshot(pScreen, nWidth, nHeight);
+
+	bool bKeyframe = m_nRecords == 0 || m_nSinceKeyframe >= m_nKeyframeInterval || m_vecSnapshot.size() != m_vecPrevious.size();
+	Encode(m_vecEncoded, m_vecSnapshot.data(), bKeyframe ? nullptr : m_vecPrevious.data(), m_vecSnapshot.size());
+
+	if (!Reserve(m_vecEncoded.size(), bKeyframe))
+	{
+		// Only the group this frame depends on was left to drop, so start a new one
+		if (!bKeyframe)
+		{
+			bKeyframe = true;
+			Encode(m_vecEncoded, m_vecSnapshot.data(), nullptr, m_vecSnapshot.size());
+		}
+
+		if (!Reserve(m_vecEncoded.size(), true))
+		{
+			m_vecPrevious.clear();
+			return false;
+		}
+	}
+
+	memcpy(m_vecData.data() + m_nWrite, m_vecEncoded.data(), m_vecEncoded.size());
+
+	PushRecord({ m_nWrite, m_vecEncoded.size(), m_vecSnapshot.size(), m_dTime, bKeyframe });
+
+	m_nWrite += m_vecEncoded.size();
+	m_nUsed += m_vecEncoded.size();
+
+	if (bKeyframe)
+	{
+		m_nLastKeyframe = m_nFirstFrame + m_nRecords - 1;
+		m_nSinceKeyframe = 0;
+	}
+
+	m_nSinceKeyframe++;
+	m_vecPrevious.swap(m_vecSnapshot);
+
+	if (m_dMaxDuration > 0.0)
+	{
+		while (m_nFirstFrame != m_nLastKeyframe)
+		{
+			// Only drop the oldest group if the frames after it still cover the duration
+			size_t nNextKeyframe = 1;
+
+			while (!Record(nNextKeyframe).bKeyframe)
+				nNextKeyframe++;
+
+			if (m_dTime - Record(nNextKeyframe).dTime < m_dMaxDuration)
+				break;
+
+			DropOldestGroup();
+		}
+	}
+
+	return true;
+}
+
+bool RewindBuffer::Seek(int nFrame)
+{
+	if (nFrame < 0 || nFrame >= FrameCount())
+		return false;
+
+	size_t nKeyframe = (size_t)nFrame;
+
+	while (!Record(nKeyframe).bKeyframe)
+		nKeyframe--;
+
+	size_t nFrom = nKeyframe;
+
+	// The decoded frame is a good starting point if it's between the keyframe and the target
+	if (m_nSeekFrame != NONE && m_nSeekFrame >= m_nFirstFrame + nKeyframe && m_nSeekFrame <= m_nFirstFrame + nFrame)
+		nFrom = size_t(m_nSeekFrame - m_nFirstFrame) + 1;
+	else
+	{
+		const FrameRecord& record = Record(nKeyframe);
+		m_vecSeek.resize(record.nWords);
+
+		if (!Decode(m_vecSeek.data(), record.nWords, m_vecData.data() + record.nOffset, record.nSize, true))
+		{
+			m_nSeekFrame = NONE;
+			return false;
+		}
+
+		nFrom = nKeyframe + 1;
+	}
+
+	for (size_t i = nFrom; i <= (size_t)nFrame; i++)
+	{
+		const FrameRecord& record = Record(i);
+
+		if (!Decode(m_vecSeek.data(), m_vecSeek.size(), m_vecData.data() + record.nOffset, record.nSize, false))
+		{
+			m_nSeekFrame = NONE;
+			return false;
+		}
+	}
+
+	m_nSeekFrame = m_nFirstFrame + nFrame;
+	m_bSeeking = true;
+
+	m_nSeekWidth = (int)m_vecSeek[0];
+	m_nSeekHeight = (int)m_vecSeek[1];
+
+	m_vecFrame.resize((size_t)m_nSeekWidth * (size_t)m_nSeekHeight);
+	memcpy(m_vecFrame.data(), m_vecSeek.data() + 2, m_vecFrame.size() * sizeof(CHAR_INFO));
+
+	return true;
+}
+
+bool RewindBuffer::IsSeeking() const
+{
+	return m_bSeeking;
+}
+
+bool RewindBuffer::RestoreState()
+{
+	if (!m_bSeeking)
+		return false;
+
+	size_t nWords = m_vecSeek.size();
+	size_t nPos = 2 + (m_vecFrame.size() * sizeof(CHAR_INFO) + 3) / 4;
+
+	if (nPos >= nWords || m_vecSeek[nPos] != m_vecStates.size())
+		return false;
+
+	nPos++;
+
+	// Check every state first so nothing is restored from a frame that doesn't match
+	size_t nFirst = nPos;
+
+	for (const State& state : m_vecStates)
+	{
+		if (nPos >= nWords)
+			return false;
+
+		size_t nSize = m_vecSeek[nPos];
+
+		if ((state.pData && nSize != state.nSize) || nPos + 1 + (nSize + 3) / 4 > nWords)
+			return false;
+
+		nPos += 1 + (nSize + 3) / 4;
+	}
+
+	nPos = nFirst;
+
+	for (State& state : m_vecStates)
+	{
+		size_t nSize = m_vecSeek[nPos];
+		const uint8_t* pBytes = reinterpret_cast<const uint8_t*>(m_vecSeek.data() + nPos + 1);
+
+		if (state.pData)
+			memcpy(state.pData, pBytes, nSize);
+		else if (state.fnLoad)
+			state.fnLoad(pBytes, nSize);
+
+		nPos += 1 + (nSize + 3) / 4;
+	}
+
+	return true;
+}
+
+void RewindBuffer::Resume()
+{
+	if (!m_bSeeking)
+		return;
+
+	m_bSeeking = false;
+
+	size_t nFrame = size_t(m_nSeekFrame - m_nFirstFrame);
+
+	while (m_nRecords > nFrame + 1)
+	{
+		m_nUsed -= Record(m_nRecords - 1).nSize;
+		m_nRecords--;
+	}
+
+	const FrameRecord& record = Record(nFrame);
+
+	// Later frames were written after this one, so their space is free again
+	m_nWrite = record.nOffset + record.nSize;
+	m_dTime = record.dTime;
+
+	size_t nKeyframe = nFrame;
+
+	while (!Record(nKeyframe).bKeyframe)
+		nKeyframe--;
+
+	m_nLastKeyframe = m_nFirstFrame + nKeyframe;
+	m_nSinceKeyframe = int(nFrame - nKeyframe) + 1;
+
+	m_vecPrevious = m_vecSeek;
+}
+
+void RewindBuffer::EndSeek()
+{
+	m_bSeeking = false;
+}
+
+void RewindBuffer::Clear()
+{
+	m_nFirstFrame += m_nRecords;
+	m_nRecords = 0;
+	m_nFirstRecord = 0;
+
+	m_nWrite = 0;
+	m_nUsed = 0;
+
+	m_nSeekFrame = NONE;
+	m_bSeeking = false;
+
+	m_nSinceKeyframe = 0;
+	m_vecPrevious.clear();
+}
+
+int RewindBuffer::FrameCount() const
+{
+	return (int)m_nRecords;
+}
+
+int RewindBuffer::FindFrame(float fSeconds) const
+{
+	if (m_nRecords == 0)
+		return -1;
+
+	double dTime = Record(m_nRecords - 1).dTime - (double)fSeconds;
+
+	// First frame after the time, the one before it is the answer
+	size_t nLow = 0, nHigh = m_nRecords;
+
+	while (nLow < nHigh)
+	{
+		size_t nMid = (nLow + nHigh) / 2;
+
+		if (Record(nMid).dTime <= dTime)
+			nLow = nMid + 1;
+		else
+			nHigh = nMid;
+	}
+
+	return nLow > 0 ? int(nLow - 1) : 0;
+}
+
+const CHAR_INFO* RewindBuffer::Frame() const
+{
+	return m_vecFrame.data();
+}
+
+int RewindBuffer::Width() const
+{
+	return m_nSeekWidth;
+}
+
+int RewindBuffer::Height() const
+{
+	return m_nSeekHeight;
+}
+
+double RewindBuffer::Time() const
+{
+	return m_nSeekFrame != NONE && m_nSeekFrame >= m_nFirstFrame && m_nSeekFrame < m_nFirstFrame + m_nRecords ?
+		Record(size_t(m_nSeekFrame - m_nFirstFrame)).dTime : 0.0;
+}
+
+size_t RewindBuffer::MemoryUsed() const
+{
+	return m_nUsed;
+}
+
+size_t RewindBuffer::Budget() const
+{
+	return m_nBudget;
+}
+
+void RewindBuffer::BuildSnapshot(const CHAR_INFO* pScreen, int nWidth, int nHeight)
+{
+	size_t nCellBytes = (size_t)nWidth * (size_t)nHeight * sizeof(CHAR_INFO);
+	size_t nCellWords = (nCellBytes + 3) / 4;
+
+	m_vecSnapshot.clear();
+	m_vecSnapshot.resize(3 + nCellWords);
+
+	m_vecSnapshot[0] = (uint32_t)nWidth;
+	m_vecSnapshot[1] = (uint32_t)nHeight;
+	memcpy(m_vecSnapshot.data() + 2, pScreen, nCellBytes);
+	m_vecSnapshot[2 + nCellWords] = (uint32_t)m_vecStates.size();
+
+	for (State& state : m_vecStates)
+	{
+		const uint8_t* pBytes = static_cast<const uint8_t*>(state.pData);
+		size_t nSize = state.nSize;
+
+		if (!pBytes)
+		{
+			m_vecState.clear();
+
+			if (state.fnSave)
+				state.fnSave(m_vecState);
+
+			pBytes = m_vecState.data();
+			nSize = m_vecState.size();
+		}
+
+		size_t nPos = m_vecSnapshot.size();
+
+		// Padding stays zero
+		m_vecSnapshot.resize(nPos + 1 + (nSize + 3) / 4);
+		m_vecSnapshot[nPos] = (uint32_t)nSize;
+
+		if (nSize > 0)
+			memcpy(m_vecSnapshot.data() + nPos + 1, pBytes, nSize);
+	}
+}
+
+void RewindBuffer::Encode(std::vector<uint8_t>& vecOut, const uint32_t* pWords, const uint32_t* pReference, size_t nWords)
+{
+	auto putCount = [&](size_t n)
+		{
+			while (n >= 0x80)
+			{
+				vecOut.push_back(uint8_t(n | 0x80));
+				n >>= 7;
+			}
+
+			vecOut.push_back(uint8_t(n));
+		};
+
+	auto word = [&](size_t i)
+		{
+			return pWords[i] ^ (pReference ? pReference[i] : (i >= KEYFRAME_STRIDE ? pWords[i - KEYFRAME_STRIDE] : 0));
+		};
+
+	vecOut.clear();
+
+	for (size_t i = 0; i < nWords;)
+	{
+		// A zero word costs less as part of a run than as a literal, so runs break on every one
+		size_t nLiterals = i;
+
+		while (nLiterals < nWords && word(nLiterals) == 0)
+			nLiterals++;
+
+		size_t nEnd = nLiterals;
+
+		while (nEnd < nWords && word(nEnd) != 0)
+			nEnd++;
+
+		putCount(nLiterals - i);
+		putCount(nEnd - nLiterals);
+
+		size_t nOffset = vecOut.size();
+		vecOut.resize(nOffset + (nEnd - nLiterals) * sizeof(uint32_t));
+
+		for (size_t j = nLiterals; j < nEnd; j++)
+		{
+			uint32_t nWord = word(j);
+			memcpy(vecOut.data() + nOffset + (j - nLiterals) * sizeof(uint32_t), &nWord, sizeof(uint32_t));
+		}
+
+		i = nEnd;
+	}
+}
+
+bool RewindBuffer::Decode(uint32_t* pWords, size_t nWords, const uint8_t* pData, size_t nSize, bool bKeyframe)
+{
+	size_t nRead = 0;
+
+	auto getCount = [&](size_t& n)
+		{
+			n = 0;
+
+			for (int nShift = 0; nRead < nSize && nShift < 64; nShift += 7)
+			{
+				uint8_t nByte = pData[nRead++];
+				n |= size_t(nByte & 0x7F) << nShift;
+
+				if (!(nByte & 0x80))
+					return true;
+			}
+
+			return false;
+		};
+
+	size_t i = 0;
+
+	while (i < nWords)
+	{
+		size_t nZeros, nLiterals;
+
+		if (!getCount(nZeros) || !getCount(nLiterals))
+			return false;
+
+		if (nZeros > nWords - i || nLiterals > nWords - i - nZeros || nLiterals * sizeof(uint32_t) > nSize - nRead)
+			return false;
+
+		if (bKeyframe)
+		{
+			for (size_t j = i; j < i + nZeros; j++)
+				pWords[j] = j >= KEYFRAME_STRIDE ? pWords[j - KEYFRAME_STRIDE] : 0;
+		}
+
+		i += nZeros;
+
+		for (size_t j = i; j < i + nLiterals; j++)
+		{
+			uint32_t nWord;
+			memcpy(&nWord, pData + nRead, sizeof(uint32_t));
+			nRead += sizeof(uint32_t);
+
+			pWords[j] = nWord ^ (bKeyframe ? (j >= KEYFRAME_STRIDE ? pWords[j - KEYFRAME_STRIDE] : 0) : pWords[j]);
+		}
+
+		i += nLiterals;
+	}
+
+	return nRead == nSize;
+}
+
+bool RewindBuffer::Reserve(size_t nSize, bool bKeyframe)
+{
+	if (nSize > m_vecData.size())
+		return false;
+
+	while (true)
+	{
+		if (m_nRecords == 0)
+		{
+			m_nWrite = 0;
+			return true;
+		}
+
+		size_t nOldest = Record(0).nOffset;
+
+		if (nOldest >= m_nWrite)
+		{
+			// Free space is between the newest and the oldest frame
+			if (nOldest - m_nWrite >= nSize)
+				return true;
+		}
+		else
+		{
+			// Free space is after the newest frame and before the oldest one
+			if (m_vecData.size() - m_nWrite >= nSize)
+				return true;
+
+			if (nOldest >= nSize)
+			{
+				m_nWrite = 0;
+				return true;
+			}
+		}
+
+		if (!bKeyframe && m_nFirstFrame == m_nLastKeyframe)
+			return false;
+
+		DropOldestGroup();
+	}
+}
+
+void RewindBuffer::DropOldestGroup()
+{
+	do
+	{
+		m_nUsed -= Record(0).nSize;
+
+		m_nFirstRecord = (m_nFirstRecord + 1) % m_vecRecords.size();
+		m_nRecords--;
+		m_nFirstFrame++;
+	}
+	while (m_nRecords > 0 && !Record(0).bKeyframe);
+
+	if (m_nSeekFrame != NONE && m_nSeekFrame < m_nFirstFrame)
+	{
+		m_nSeekFrame = NONE;
+		m_bSeeking = false;
+	}
+}
+
+void RewindBuffer::PushRecord(const FrameRecord& record)
+{
+	if (m_nRecords == m_vecRecords.size())
+	{
+		std::vector<FrameRecord> vecRecords(std::max(m_vecRecords.size() * 2, (size_t)64));
+
+		for (size_t i = 0; i < m_nRecords; i++)
+			vecRecords[i] = Record(i);
+
+		m_vecRecords.swap(vecRecords);
+		m_nFirstRecord = 0;
+	}
+
+	m_vecRecords[(m_nFirstRecord + m_nRecords) % m_vecRecords.size()] = record;
+	m_nRecords++;
+}
+
+RewindBuffer::FrameRecord& RewindBuffer::Record(size_t nFrame)
+{
+	return m_vecRecords[(m_nFirstRecord + nFrame) % m_vecRecords.size()];
+}
+
+const RewindBuffer::FrameRecord& RewindBuffer::Record(size_t nFrame) const
+{
+	return m_vecRecords[(m_nFirstRecord + nFrame) % m_vecRecords.size()];
+}
+
+ConsoleGameEngine::ConsoleGameEngine()
+{
+	m_hConsoleOut = GetStdHandle(STD_OUTPUT_HANDLE);
+	m_hConsoleIn = GetStdHandle(STD_INPUT_HANDLE);
+
+	m_hWindow = GetConsoleWindow();
+	m_hDrawContext = GetDC(m_hWindow);
+
+	sAppName = L"Undefined";
+	sFont = L"Consolas";
+}
+
+ConsoleGameEngine::~ConsoleGameEngine()
+{
+	delete[] m_pScreen;
+	delete[] m_pColours;
+	delete m_pQuantizer;
+	delete m_pThreadPool;
+	delete m_pRecorder;
+	delete m_pWatcher;
+	delete m_pTimers;
+	delete m_pRewind;
+
+#ifdef CONSOLE_GAME_ENGINE_COROUTINES
+	delete m_pScripts;
+#endif
+
+#ifdef CONSOLE_GAME_ENGINE_STREAMING
+	delete m_pServer;
+#endif
+
+	for (auto layer : m_vecLayers)
+		delete layer;
+}
+
+ErrorCode ConsoleGameEngine::ConstructConsole(int nWidth, int nHeight, int nFontWidth, int nFontHeight)
+{
+	if (nWidth <= 0 || nHeight <= 0 || nFontWidth <= 0 || nFontHeight <= 0)
+		return RC_INVALID_SCREEN_SIZE;
+
+	ResizeLayers(m_nScreenWidth, m_nScreenHeight, nWidth, nHeight);
+
+	m_nScreenWidth = nWidth;
+	m_nScreenHeight = nHeight;
+	m_bOffscreen = false;
+
+	m_nFontWidth = nFontWidth;
+	m_nFontHeight = nFontHeight;
+
+	m_hConsoleOut = CreateConsoleScreenBuffer(GENERIC_READ | GENERIC_WRITE, 0, NULL, CONSOLE_TEXTMODE_BUFFER, NULL);
+
+	if (m_hConsoleOut == INVALID_HANDLE_VALUE)
+		return RC_INVALID_SCREEN_BUFFER;
+
+	m_rWindow = { 0, 0, 1, 1 };
+	SetConsoleWindowInfo(m_hConsoleOut, TRUE, &m_rWindow);
+
+	COORD coord = { (short)m_nScreenWidth, (short)m_nScreenHeight };
+
+	if (!SetConsoleScreenBufferSize(m_hConsoleOut, coord))  return RC_INVALID_SCREEN_SIZE;
+	if (!SetConsoleActiveScreenBuffer(m_hConsoleOut))		return RC_INVALID_SCREEN_BUFFER;
+
+	CONSOLE_FONT_INFOEX cfi;
+	cfi.cbSize = sizeof(cfi);
+	cfi.nFont = 0;
+	cfi.dwFontSize.X = m_nFontWidth;
+	cfi.dwFontSize.Y = m_nFontHeight;
+	cfi.FontFamily = FF_DONTCARE;
+	cfi.FontWeight = FW_NORMAL;
+
+	wcscpy_s(cfi.FaceName, sFont.c_str());
+	if (!SetCurrentConsoleFontEx(m_hConsoleOut, false, &cfi))
+		return RC_INVALID_FONT;
+
+	if (!SetConsoleMode(m_hConsoleIn, ENABLE_EXTENDED_FLAGS | ENABLE_WINDOW_INPUT | ENABLE_MOUSE_INPUT))
+		return RC_INVALID_CONSOLE_MODE;
+
+	CONSOLE_SCREEN_BUFFER_INFO csbi;
+	if (!GetConsoleScreenBufferInfo(m_hConsoleOut, &csbi))
+		return RC_INVALID_SCREEN_INFO;
+
+	if (m_nScreenHeight > csbi.dwMaximumWindowSize.Y)
+		return RC_INVALID_SCREEN_SIZE;
+
+	if (m_nScreenWidth > csbi.dwMaximumWindowSize.X)
+		return RC_INVALID_SCREEN_SIZE;
+
+	m_rWindow = { 0, 0, short(m_nScreenWidth - 1), short(m_nScreenHeight - 1) };
+	SetConsoleWindowInfo(m_hConsoleOut, TRUE, &m_rWindow);
+
+	// Constructing again replaces the old buffers, EnableTrueColour below makes new colours if they were on
+	delete[] m_pScreen;
+	delete[] m_pColours;
+	m_pColours = nullptr;
+
+	m_pScreen = new CHAR_INFO[m_nScreenWidth * m_nScreenHeight]{ 0 };
+	m_nScreenCapacity = (size_t)m_nScreenWidth * (size_t)m_nScreenHeight;
+
+	BindTarget();
+
+	if (m_bTrueColour)
+	{
+		m_bTrueColour = false;
+
+		if (!EnableTrueColour(true))
+			return RC_INVALID_CONSOLE_MODE;
+	}
+
+	return RC_OK;
+}
+
+ErrorCode ConsoleGameEngine::ConstructOffscreen(int nWidth, int nHeight)
+{
+	if (nWidth <= 0 || nHeight <= 0)
+		return RC_INVALID_SCREEN_SIZE;
+
+	ResizeLayers(m_nScreenWidth, m_nScreenHeight, nWidth, nHeight);
+
+	m_nScreenWidth = nWidth;
+	m_nScreenHeight = nHeight;
+	m_bOffscreen = true;
+
+	delete[] m_pScreen;
+	delete[] m_pColours;
+
+	m_pScreen = new CHAR_INFO[m_nScreenWidth * m_nScreenHeight]{ 0 };
+	m_nScreenCapacity = (size_t)m_nScreenWidth * (size_t)m_nScreenHeight;
+
+	// Extended colours only mean something to a VT console
+	m_pColours = nullptr;
+	m_bTrueColour = false;
+
+	m_nTargetLayer = SCREEN_LAYER;
+	m_pTargetSurface = nullptr;
+
+	BindTarget();
+
+	return RC_OK;
+}
+
+void ConsoleGameEngine::Run()
+{
+	m_bGameThreadActive = true;
+
+	m_thrGame = std::thread(&ConsoleGameEngine::AppThread, this);
+
+	if (m_thrGame.joinable())
+		m_thrGame.join();
+}
+
+bool ConsoleGameEngine::MakeSound(const std::wstring& sFilename, bool bLoop)
+{
+	DWORD f = SND_ASYNC | SND_FILENAME;
+
+	if (bLoop)
+		f |= SND_LOOP;
+
+	return PlaySoundW(sFilename.c_str(), NULL, f);
+}
+
+bool ConsoleGameEngine::IsFocused()
+{
+	return m_bFocused;
+}
+
+void ConsoleGameEngine::Draw(int x, int y, wchar_t c, short col)
+{
+	if (x >= 0 && x < m_nTargetWidth && y >= 0 && y < m_nTargetHeight)
+	{
+		m_pTarget[y * m_nTargetWidth + x].Char.UnicodeChar = c;
+		m_pTarget[y * m_nTargetWidth + x].Attributes = col;
+
+		if (m_pTargetLayer)
+			m_pTargetLayer->vecDirty[(y / LAYER_TILE_SIZE) * ((m_nScreenWidth + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE) + x / LAYER_TILE_SIZE] = 1;
+		else if (m_pTargetColours)
+			m_pTargetColours[y * m_nTargetWidth + x] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+	}
+}
+
+void ConsoleGameEngine::DrawTrueColour(int x, int y, wchar_t c, uint32_t fg, uint32_t bg, short col)
+{
+	Draw(x, y, c, col);
+
+	// Extended colours only live on the screen, layers and surfaces keep the palette attribute
+	if (m_pTargetColours && x >= 0 && x < m_nTargetWidth && y >= 0 && y < m_nTargetHeight)
+		m_pTargetColours[y * m_nTargetWidth + x] = { fg, bg };
+}
+
+void ConsoleGameEngine::FillRectangle(int x, int y, int sx, int sy, wchar_t c, short col)
+{
+	for (int i = 0; i <= sx; i++)
+		for (int j = 0; j <= sy; j++)
+			Draw(x + i, y + j, c, col);
+}
+
+void ConsoleGameEngine::DrawCircle(int x, int y, int r, wchar_t c, short col)
+{
+	if (r <= 0)
+		return;
+
+	int x1 = 0;
+	int y1 = r;
+	int p = 3 - 2 * r;
+
+	while (y1 >= x1)
+	{
+		Draw(x - x1, y - y1, c, col);
+		Draw(x - y1, y - x1, c, col);
+		Draw(x + y1, y - x1, c, col);
+		Draw(x + x1, y - y1, c, col);
+		Draw(x - x1, y + y1, c, col);
+		Draw(x - y1, y + x1, c, col);
+		Draw(x + y1, y + x1, c, col);
+		Draw(x + x1, y + y1, c, col);
+
+		if (p < 0)
+			p += 4 * x1++ + 6;
+		else
+			p += 4 * (x1++ - y1--) + 10;
+	}
+}
+
+void ConsoleGameEngine::FillCircle(int x, int y, int r, wchar_t c, short col)
+{
+	if (r <= 0)
+		return;
+
+	int x1 = 0;
+	int y1 = r;
+	int p = 3 - 2 * r;
+
+	auto drawline = [&](int sx, int ex, int ny)
+		{
+			for (int i = sx; i <= ex; i++)
+				Draw(i, ny, c, col);
+		};
+
+	while (y1 >= x1)
+	{
+		drawline(x - x1, x + x1, y - y1);
+		drawline(x - y1, x + y1, y - x1);
+		drawline(x - x1, x + x1, y + y1);
+		drawline(x - y1, x + y1, y + x1);
+
+		if (p < 0)
+			p += 4 * x1++ + 6;
+		else
+			p += 4 * (x1++ - y1--) + 10;
+	}
+}
+
+void ConsoleGameEngine::DrawLine(int x1, int y1, int x2, int y2, wchar_t c, short col)
+{
+	int x, y, xe, ye;
+
+	int dx = x2 - x1;
+	int dy = y2 - y1;
+
+	int dx1 = abs(dx);
+	int dy1 = abs(dy);
+
+	int px = 2 * dy1 - dx1;
+	int py = 2 * dx1 - dy1;
+
+	if (dy1 <= dx1)
+	{
+		if (dx >= 0)
+		{
+			x = x1;
+			y = y1;
+			xe = x2;
+		}
+		else
+		{
+			x = x2;
+			y = y2;
+			xe = x1;
+		}
+
+		Draw(x, y, c, col);
+
+		for (int i = 0; x < xe; i++)
+		{
+			x++;
+
+			if (px < 0)
+				px = px + 2 * dy1;
+			else
+			{
+				y += ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) ? 1 : -1;
+				px = px + 2 * (dy1 - dx1);
+			}
+
+			Draw(x, y, c, col);
+		}
+	}
+	else
+	{
+		if (dy >= 0)
+		{
+			x = x1;
+			y = y1;
+			ye = y2;
+		}
+		else
+		{
+			x = x2;
+			y = y2;
+			ye = y1;
+		}
+
+		Draw(x, y, c, col);
+
+		for (int i = 0; y < ye; i++)
+		{
+			y++;
+
+			if (py <= 0)
+				py = py + 2 * dx1;
+			else
+			{
+				x += ((dx < 0 && dy < 0) || (dx > 0 && dy > 0)) ? 1 : -1;
+				py = py + 2 * (dx1 - dy1);
+			}
+
+			Draw(x, y, c, col);
+		}
+	}
+}
+
+void ConsoleGameEngine::DrawTriangle(int x1, int y1, int x2, int y2, int x3, int y3, wchar_t c, short col)
+{
+	DrawLine(x1, y1, x2, y2, c, col);
+	DrawLine(x2, y2, x3, y3, c, col);
+	DrawLine(x3, y3, x1, y1, c, col);
+}
+
+void ConsoleGameEngine::FillTriangle(int x1, int y1, int x2, int y2, int x3, int y3, wchar_t c, short col)
+{
+	auto drawline = [&](int sx, int ex, int ny)
+		{
+			for (int i = sx; i <= ex; i++)
+				Draw(i, ny, c, col);
+		};
+
+	int t1x, t2x, y, minx, maxx, t1xp, t2xp;
+
+	bool changed1 = false;
+	bool changed2 = false;
+
+	int signx1, signx2, dx1, dy1, dx2, dy2;
+	int e1, e2;
+
+	if (y1 > y2) { std::swap(y1, y2); std::swap(x1, x2); }
+	if (y1 > y3) { std::swap(y1, y3); std::swap(x1, x3); }
+	if (y2 > y3) { std::swap(y2, y3); std::swap(x2, x3); }
+
+	t1x = t2x = x1; y = y1;
+	dx1 = x2 - x1;
+
+	if (dx1 < 0)
+	{
+		dx1 = -dx1;
+		signx1 = -1;
+	}
+	else
+		signx1 = 1;
+
+	dy1 = y2 - y1;
+	dx2 = x3 - x1;
+
+	if (dx2 < 0)
+	{
+		dx2 = -dx2;
+		signx2 = -1;
+	}
+	else
+		signx2 = 1;
+
+	dy2 = y3 - y1;
+
+	if (dy1 > dx1)
+	{
+		std::swap(dx1, dy1);
+		changed1 = true;
+	}
+
+	if (dy2 > dx2)
+	{
+		std::swap(dy2, dx2);
+		changed2 = true;
+	}
+
+	e2 = (int)(dx2 >> 1);
+
+	if (y1 == y2) goto next;
+
+	e1 = (int)(dx1 >> 1);
+
+	for (int i = 0; i < dx1;)
+	{
+		t1xp = 0;
+		t2xp = 0;
+
+		if (t1x < t2x)
+		{
+			minx = t1x;
+			maxx = t2x;
+		}
+		else
+		{
+			minx = t2x;
+			maxx = t1x;
+		}
+
+		while (i < dx1)
+		{
+			i++;
+			e1 += dy1;
+
+			while (e1 >= dx1)
+			{
+				e1 -= dx1;
+
+				if (changed1)
+					t1xp = signx1;
+				else
+					goto next1;
+			}
+
+			if (changed1)
+				break;
+			else
+				t1x += signx1;
+		}
+
+	next1:
+		while (1)
+		{
+			e2 += dy2;
+			while (e2 >= dx2)
+			{
+				e2 -= dx2;
+				if (changed2)
+					t2xp = signx2;
+				else
+					goto next2;
+			}
+			if (changed2)
+				break;
+			else
+				t2x += signx2;
+		}
+
+	next2:
+		if (minx > t1x)
+			minx = t1x;
+
+		if (minx > t2x)
+			minx = t2x;
+
+		if (maxx < t1x)
+			maxx = t1x;
+
+		if (maxx < t2x)
+			maxx = t2x;
+
+		drawline(minx, maxx, y);
+
+		if (!changed1)
+			t1x += signx1;
+
+		t1x += t1xp;
+
+		if (!changed2)
+			t2x += signx2;
+
+		t2x += t2xp;
+		y += 1;
+
+		if (y == y2)
+			break;
+
+	}
+
+next:
+	dx1 = x3 - x2;
 
 	if (dx1 < 0)
 	{
-		dx1 = -dx1;
-		signx1 = -1;
+		dx1 = -dx1;
+		signx1 = -1;
+	}
+	else
+		signx1 = 1;
+
+	dy1 = y3 - y2;
+	t1x = x2;
+
+	if (dy1 > dx1)
+	{
+		std::swap(dy1, dx1);
+		changed1 = true;
+	}
+	else
+		changed1 = false;
+
+	e1 = (int)(dx1 >> 1);
+
+	for (int i = 0; i <= dx1; i++)
+	{
+		t1xp = 0;
+		t2xp = 0;
+
+		if (t1x < t2x)
+		{
+			minx = t1x;
+			maxx = t2x;
+		}
+		else
+		{
+			minx = t2x;
+			maxx = t1x;
+		}
+
+		while (i < dx1)
+		{
+			e1 += dy1;
+
+			while (e1 >= dx1)
+			{
+				e1 -= dx1;
+				if (changed1)
+				{
+					t1xp = signx1;
+					break;
+				}
+				else
+					goto next3;
+			}
+
+			if (changed1)
+				break;
+			else
+				t1x += signx1;
+
+			if (i < dx1)
+				i++;
+		}
+
+	next3:
+		while (t2x != x3)
+		{
+			e2 += dy2;
+
+			while (e2 >= dx2)
+			{
+				e2 -= dx2;
+
+				if (changed2)
+					t2xp = signx2;
+				else
+					goto next4;
+			}
+
+			if (changed2)
+				break;
+			else
+				t2x += signx2;
+		}
+
+	next4:
+		if (minx > t1x)
+			minx = t1x;
+
+		if (minx > t2x)
+			minx = t2x;
+
+		if (maxx < t1x)
+			maxx = t1x;
+
+		if (maxx < t2x)
+			maxx = t2x;
+
+		drawline(minx, maxx, y);
+
+		if (!changed1)
+			t1x += signx1;
+
+		t1x += t1xp;
+
+		if (!changed2)
+			t2x += signx2;
+
+		t2x += t2xp;
+		y += 1;
+
+		if (y > y3)
+			return;
+	}
+}
+
+void ConsoleGameEngine::DrawRectangle(int x, int y, int sx, int sy, wchar_t c, short col)
+{
+	for (int i = 0; i <= sx; i++)
+	{
+		Draw(x + i, y, c, col);
+		Draw(x + i, y + sy, c, col);
 	}
-	else
-		signx1 = 1;
 
-	dy1 = y2 - y1;
-	dx2 = x3 - x1;
+	for (int j = 0; j <= sy; j++)
+	{
+		Draw(x, y + j, c, col);
+		Draw(x + sx, y + j, c, col);
+	}
+}
+
+void ConsoleGameEngine::DrawSprite(int x, int y, Sprite* sprite)
+{
+	if (sprite)
+		DrawSprite(x, y, SpriteView(*sprite));
+}
+
+void ConsoleGameEngine::DrawSpriteAlpha(int x, int y, Sprite* sprite)
+{
+	if (sprite)
+		DrawSpriteAlpha(x, y, SpriteView(*sprite));
+}
+
+void ConsoleGameEngine::DrawPartialSprite(int x, int y, int fx, int fy, int fw, int fh, Sprite* sprite)
+{
+	if (sprite)
+		DrawPartialSprite(x, y, fx, fy, fw, fh, SpriteView(*sprite));
+}
+
+void ConsoleGameEngine::DrawPartialSpriteAlpha(int x, int y, int fx, int fy, int fw, int fh, Sprite* sprite)
+{
+	if (sprite)
+		DrawPartialSpriteAlpha(x, y, fx, fy, fw, fh, SpriteView(*sprite));
+}
+
+void ConsoleGameEngine::DrawSprite(int x, int y, const SpriteView& sprite)
+{
+	BlitSprite(x, y, 0, 0, sprite.nWidth, sprite.nHeight, sprite, false, false);
+}
+
+void ConsoleGameEngine::DrawSpriteAlpha(int x, int y, const SpriteView& sprite)
+{
+	BlitSprite(x, y, 0, 0, sprite.nWidth, sprite.nHeight, sprite, true, true);
+}
+
+void ConsoleGameEngine::DrawPartialSprite(int x, int y, int fx, int fy, int fw, int fh, const SpriteView& sprite)
+{
+	BlitSprite(x, y, fx, fy, fw, fh, sprite, false, true);
+}
+
+void ConsoleGameEngine::DrawPartialSpriteAlpha(int x, int y, int fx, int fy, int fw, int fh, const SpriteView& sprite)
+{
+	BlitSprite(x, y, fx, fy, fw, fh, sprite, true, true);
+}
+
+void ConsoleGameEngine::BlitSprite(int x, int y, int fx, int fy, int fw, int fh, const SpriteView& sprite, bool bAlpha, bool bColourBackground)
+{
+	int x1 = std::max(x, 0);
+	int y1 = std::max(y, 0);
+	int x2 = std::min(x + fw, m_nTargetWidth);
+	int y2 = std::min(y + fh, m_nTargetHeight);
+
+	if (x1 >= x2 || y1 >= y2 || !sprite.GlyphData())
+		return;
+
+	// Source cells outside the sprite read as blank, only then is the slower bounds checked path needed
+	bool bInside = fx + x1 - x >= 0 && fy + y1 - y >= 0 && fx + x2 - x <= sprite.nWidth && fy + y2 - y <= sprite.nHeight;
+
+	for (int dy = y1; dy < y2; dy++)
+	{
+		int sy = fy + dy - y;
+
+		CHAR_INFO* pDst = m_pTarget + dy * m_nTargetWidth;
+		CellColour* pColours = m_pTargetColours ? m_pTargetColours + dy * m_nTargetWidth : nullptr;
+
+		// Index of the source cell for destination column 0
+		int nSource = sy * sprite.nWidth + fx - x;
+
+		for (int dx = x1; dx < x2; dx++)
+		{
+			wchar_t c;
+			short col;
+
+			if (bInside)
+			{
+				c = sprite.GlyphData()[nSource + dx];
+				col = sprite.ColourData()[nSource + dx];
+			}
+			else
+			{
+				c = sprite.GetGlyph(fx + dx - x, sy);
+				col = sprite.GetColour(fx + dx - x, sy);
+			}
+
+			if (bAlpha && c == L' ')
+				continue;
+
+			pDst[dx].Char.UnicodeChar = c;
+			pDst[dx].Attributes = bColourBackground ? short(col | col * 16) : col;
+
+			if (pColours)
+				pColours[dx] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+		}
+	}
+
+	if (m_pTargetLayer)
+		MarkDirty(x1, y1, x2 - 1, y2 - 1);
+}
+
+void ConsoleGameEngine::DrawSprite(int x, int y, const IndexedSprite& sprite)
+{
+	BlitSprite(x, y, 0, 0, sprite.nWidth, sprite.nHeight, sprite, false, false);
+}
+
+void ConsoleGameEngine::DrawSpriteAlpha(int x, int y, const IndexedSprite& sprite)
+{
+	BlitSprite(x, y, 0, 0, sprite.nWidth, sprite.nHeight, sprite, true, true);
+}
+
+void ConsoleGameEngine::DrawPartialSprite(int x, int y, int fx, int fy, int fw, int fh, const IndexedSprite& sprite)
+{
+	BlitSprite(x, y, fx, fy, fw, fh, sprite, false, true);
+}
+
+void ConsoleGameEngine::DrawPartialSpriteAlpha(int x, int y, int fx, int fy, int fw, int fh, const IndexedSprite& sprite)
+{
+	BlitSprite(x, y, fx, fy, fw, fh, sprite, true, true);
+}
+
+void ConsoleGameEngine::BlitSprite(int x, int y, int fx, int fy, int fw, int fh, const IndexedSprite& sprite, bool bAlpha, bool bColourBackground)
+{
+	int x1 = std::max(x, 0);
+	int y1 = std::max(y, 0);
+	int x2 = std::min(x + fw, m_nTargetWidth);
+	int y2 = std::min(y + fh, m_nTargetHeight);
+
+	if (x1 >= x2 || y1 >= y2 || sprite.PaletteSize() == 0)
+		return;
+
+	// Apply the colour mode to the palette once instead of to every cell, the last entry is the blank read outside the sprite
+	CHAR_INFO palette[IndexedSprite::MAX_PALETTE_SIZE + 1];
+	bool bSkip[IndexedSprite::MAX_PALETTE_SIZE + 1];
+
+	int nBlank = sprite.PaletteSize();
+
+	for (int i = 0; i <= nBlank; i++)
+	{
+		palette[i].Char.UnicodeChar = i < nBlank ? sprite.PaletteData()[i].Char.UnicodeChar : L' ';
+		palette[i].Attributes = i < nBlank ? sprite.PaletteData()[i].Attributes : short(FG_BLACK);
+
+		if (bColourBackground)
+			palette[i].Attributes = short(palette[i].Attributes | palette[i].Attributes * 16);
+
+		bSkip[i] = bAlpha && palette[i].Char.UnicodeChar == L' ';
+	}
+
+	bool bInside = fx + x1 - x >= 0 && fy + y1 - y >= 0 && fx + x2 - x <= sprite.nWidth && fy + y2 - y <= sprite.nHeight;
+
+	for (int dy = y1; dy < y2; dy++)
+	{
+		int sy = fy + dy - y;
+
+		CHAR_INFO* pDst = m_pTarget + dy * m_nTargetWidth;
+		CellColour* pColours = m_pTargetColours ? m_pTargetColours + dy * m_nTargetWidth : nullptr;
+
+		const uint8_t* pSrc = bInside ? sprite.IndexData() + sy * sprite.nWidth + fx - x : nullptr;
+
+		for (int dx = x1; dx < x2; dx++)
+		{
+			int nIndex = pSrc ? pSrc[dx] : nBlank;
+
+			if (!pSrc && fx + dx - x >= 0 && fx + dx - x < sprite.nWidth && sy >= 0 && sy < sprite.nHeight)
+				nIndex = sprite.GetIndex(fx + dx - x, sy);
+
+			if (bSkip[nIndex])
+				continue;
+
+			pDst[dx] = palette[nIndex];
+
+			if (pColours)
+				pColours[dx] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+		}
+	}
+
+	if (m_pTargetLayer)
+		MarkDirty(x1, y1, x2 - 1, y2 - 1);
+}
+
+void ConsoleGameEngine::DrawSpriteTransformed(float x, float y, const SpriteView& sprite, float fAngle, float fScaleX, float fScaleY,
+	float fPivotX, float fPivotY, bool bAlpha)
+{
+	if (!sprite.GlyphData() || sprite.nWidth <= 0 || sprite.nHeight <= 0)
+		return;
+
+	// Also keeps the fixed-point steps below 2^26
+	if (fabsf(fScaleX) < 1.0f / 1024.0f || fabsf(fScaleY) < 1.0f / 1024.0f)
+		return;
+
+	float fCos = cosf(fAngle);
+	float fSin = sinf(fAngle);
+
+	// Bounding box of the transformed sprite corners
+	float fMinX = FLT_MAX, fMinY = FLT_MAX, fMaxX = -FLT_MAX, fMaxY = -FLT_MAX;
+
+	for (int i = 0; i < 4; i++)
+	{
+		float u = ((i & 1) ? sprite.nWidth : 0) - fPivotX;
+		float v = ((i & 2) ? sprite.nHeight : 0) - fPivotY;
+
+		float sx = x + u * fScaleX * fCos - v * fScaleY * fSin;
+		float sy = y + u * fScaleX * fSin + v * fScaleY * fCos;
+
+		fMinX = std::min(fMinX, sx);
+		fMinY = std::min(fMinY, sy);
+		fMaxX = std::max(fMaxX, sx);
+		fMaxY = std::max(fMaxY, sy);
+	}
+
+	// Also rejects boxes too far away to convert to int
+	if (!(fMaxX > 0.0f && fMaxY > 0.0f && fMinX < m_nTargetWidth && fMinY < m_nTargetHeight))
+		return;
+
+	int x1 = (int)std::max(floorf(fMinX), 0.0f);
+	int y1 = (int)std::max(floorf(fMinY), 0.0f);
+	int x2 = (int)std::min(ceilf(fMaxX), (float)m_nTargetWidth);
+	int y2 = (int)std::min(ceilf(fMaxY), (float)m_nTargetHeight);
+
+	if (x1 >= x2 || y1 >= y2)
+		return;
+
+	// Inverse mapping from a destination cell centre to sprite cells, as 16.16 fixed point
+	const double dUdx = fCos / fScaleX, dUdy = fSin / fScaleX;
+	const double dVdx = -fSin / fScaleY, dVdy = fCos / fScaleY;
+
+	const int64_t nDu = llround(dUdx * 65536.0);
+	const int64_t nDv = llround(dVdx * 65536.0);
+
+	const int64_t nMaxU = int64_t(sprite.nWidth) << 16;
+	const int64_t nMaxV = int64_t(sprite.nHeight) << 16;
+
+	const wchar_t* pGlyphs = sprite.GlyphData();
+	const short* pColours = sprite.ColourData();
+
+	for (int dy = y1; dy < y2; dy++)
+	{
+		double px = x1 + 0.5 - x;
+		double py = dy + 0.5 - y;
+
+		double u0 = fPivotX + px * dUdx + py * dUdy;
+		double v0 = fPivotY + px * dVdx + py * dVdy;
+
+		// Columns of the row that land inside the sprite form one span, estimate it in floating point...
+		double t1 = 0.0, t2 = x2 - x1;
+
+		auto clipAxis = [&](double a0, double da, double fSize)
+			{
+				if (fabs(da) < 1e-9)
+				{
+					if (a0 < 0.0 || a0 >= fSize)
+						t2 = -1.0;
+
+					return;
+				}
+
+				double ta = -a0 / da, tb = (fSize - a0) / da;
+
+				t1 = std::max(t1, std::min(ta, tb) - 2.0);
+				t2 = std::min(t2, std::max(ta, tb) + 2.0);
+			};
+
+		clipAxis(u0, dUdx, sprite.nWidth);
+		clipAxis(v0, dVdx, sprite.nHeight);
+
+		if (t1 >= t2)
+			continue;
+
+		const int64_t nU0 = llround(u0 * 65536.0);
+		const int64_t nV0 = llround(v0 * 65536.0);
+
+		auto inside = [&](int t)
+			{
+				int64_t u = nU0 + nDu * t, v = nV0 + nDv * t;
+				return u >= 0 && u < nMaxU && v >= 0 && v < nMaxV;
+			};
+
+		// ...then trim it exactly against the fixed-point coordinates, which are linear along the row
+		int nStart = (int)ceil(t1), nEnd = std::min((int)floor(t2) + 1, x2 - x1);
+
+		while (nStart < nEnd && !inside(nStart))
+			nStart++;
+
+		while (nEnd > nStart && !inside(nEnd - 1))
+			nEnd--;
+
+		if (nStart >= nEnd)
+			continue;
+
+		// Every step from here stays inside the sprite, so 32 bits are enough and no bounds checks are needed
+		int32_t u = int32_t(nU0 + nDu * nStart);
+		int32_t v = int32_t(nV0 + nDv * nStart);
+
+		CHAR_INFO* pDst = m_pTarget + dy * m_nTargetWidth + x1;
+		CellColour* pExt = m_pTargetColours ? m_pTargetColours + dy * m_nTargetWidth + x1 : nullptr;
+
+		for (int t = nStart; t < nEnd; t++)
+		{
+			int nIndex = (v >> 16) * sprite.nWidth + (u >> 16);
+
+			u += int32_t(nDu);
+			v += int32_t(nDv);
+
+			wchar_t c = pGlyphs[nIndex];
+
+			if (bAlpha && c == L' ')
+				continue;
+
+			pDst[t].Char.UnicodeChar = c;
+			pDst[t].Attributes = pColours[nIndex];
+
+			if (pExt)
+				pExt[t] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+		}
+	}
+
+	if (m_pTargetLayer)
+		MarkDirty(x1, y1, x2 - 1, y2 - 1);
+}
+
+void ConsoleGameEngine::DrawSpriteTransformed(float x, float y, const SpriteMips& mips, float fAngle, float fScaleX, float fScaleY,
+	float fPivotX, float fPivotY, bool bAlpha)
+{
+	// Go down a level for every halving of the scale along the less shrunk axis, keeping glyphs as sharp as possible
+	float fScale = std::max(fabsf(fScaleX), fabsf(fScaleY));
+	int nLevel = 0;
+
+	while (nLevel + 1 < mips.Levels() && fScale * float(2 << nLevel) <= 1.0f)
+		nLevel++;
+
+	// Odd sizes round up when halving, so map through the real level size rather than a power of two
+	SpriteView level0 = mips.Level(0);
+	SpriteView level = mips.Level(nLevel);
+
+	float fRatioX = level0.nWidth > 0 ? float(level.nWidth) / float(level0.nWidth) : 1.0f;
+	float fRatioY = level0.nHeight > 0 ? float(level.nHeight) / float(level0.nHeight) : 1.0f;
+
+	DrawSpriteTransformed(x, y, level, fAngle, fScaleX / fRatioX, fScaleY / fRatioY, fPivotX * fRatioX, fPivotY * fRatioY, bAlpha);
+}
+
+void ConsoleGameEngine::DrawWireFrameModel(const std::vector<std::pair<float, float>>& model, float x, float y, float r, float s, wchar_t c, short col)
+{
+	size_t nVerts = model.size();
+
+	if (nVerts == 0)
+		return;
+
+	// Scratch space given back on return, so this works outside the frame loop too
+	FrameArena::Marker mark = m_frameArena.Mark();
+	std::pair<float, float>* pTransformed = m_frameArena.Allocate<std::pair<float, float>>(nVerts);
+
+	float fCos = cosf(r);
+	float fSin = sinf(r);
+
+	for (size_t i = 0; i < nVerts; i++)
+	{
+		pTransformed[i].first = (model[i].first * fCos - model[i].second * fSin) * s + x;
+		pTransformed[i].second = (model[i].first * fSin + model[i].second * fCos) * s + y;
+	}
+
+	for (size_t i = 0; i <= nVerts; i++)
+	{
+		size_t j = i + 1;
+
+		DrawLine((int)pTransformed[i % nVerts].first, (int)pTransformed[i % nVerts].second,
+				 (int)pTransformed[j % nVerts].first, (int)pTransformed[j % nVerts].second, c, col);
+	}
+
+	m_frameArena.Rewind(mark);
+}
+
+void ConsoleGameEngine::DrawString(int x, int y, std::wstring_view text, short col)
+{
+	if (y < 0 || y >= m_nTargetHeight)
+		return;
+
+	// Clip per character so partially visible strings are still drawn
+	int nStart = std::max(0, -x);
+	int nEnd = (int)std::min<size_t>(text.size(), (size_t)std::max(0, m_nTargetWidth - x));
+
+	if (nStart >= nEnd)
+		return;
+
+	CHAR_INFO* pRow = m_pTarget + y * m_nTargetWidth;
+
+	for (int i = nStart; i < nEnd; i++)
+	{
+		pRow[x + i].Char.UnicodeChar = text[i];
+		pRow[x + i].Attributes = col;
+	}
+
+	if (m_pTargetLayer)
+		MarkDirty(x + nStart, y, x + nEnd - 1, y);
+	else if (m_pTargetColours)
+	{
+		for (int i = nStart; i < nEnd; i++)
+			m_pTargetColours[y * m_nTargetWidth + x + i] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+	}
+}
+
+void ConsoleGameEngine::DrawString(int x, int y, const std::wstring& text, short col)
+{
+	DrawString(x, y, std::wstring_view(text), col);
+}
+
+void ConsoleGameEngine::DrawString(int x, int y, const wchar_t* text, short col)
+{
+	if (text)
+		DrawString(x, y, std::wstring_view(text), col);
+}
+
+void ConsoleGameEngine::DrawStringf(int x, int y, short col, const wchar_t* format, ...)
+{
+	va_list args;
+	va_start(args, format);
 
-	if (dx2 < 0)
+	int nLength = std::vswprintf(m_sFormatBuffer, FORMAT_BUFFER_SIZE, format, args);
+
+	va_end(args);
+
+	// The output didn't fit or couldn't be encoded, what's left in the buffer is unspecified
+	if (nLength < 0)
+		return;
+
+	DrawString(x, y, std::wstring_view(m_sFormatBuffer, nLength), col);
+}
+
+void ConsoleGameEngine::Clear(wchar_t c, short col)
+{
+	FillRectangle(0, 0, m_nTargetWidth, m_nTargetHeight, c, col);
+}
+
+bool ConsoleGameEngine::EnableTrueColour(bool bEnable)
+{
+	if (bEnable == m_bTrueColour)
+		return true;
+
+	if (!m_pScreen)
 	{
-		dx2 = -dx2;
-		signx2 = -1;
+		// The console isn't constructed yet so defer it to ConstructConsole
+		m_bTrueColour = bEnable;
+		return true;
 	}
-	else
-		signx2 = 1;
 
-	dy2 = y3 - y1;
+	DWORD nMode = 0;
+	GetConsoleMode(m_hConsoleOut, &nMode);
 
-	if (dy1 > dx1)
+	if (bEnable)
 	{
-		std::swap(dx1, dy1);
-		changed1 = true;
-	}
+		if (!SetConsoleMode(m_hConsoleOut, nMode | ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING | DISABLE_NEWLINE_AUTO_RETURN))
+			return false;
 
-	if (dy2 > dx2)
+		m_pColours = new CellColour[m_nScreenCapacity];
+
+		for (size_t i = 0; i < m_nScreenCapacity; i++)
+			m_pColours[i] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+
+		// The encoder knows nothing about what the console shows yet
+		m_bFullRedraw = true;
+	}
+	else
 	{
-		std::swap(dy2, dx2);
-		changed2 = true;
+		SetConsoleMode(m_hConsoleOut, nMode & ~ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+		delete[] m_pColours;
+		m_pColours = nullptr;
 	}
 
-	e2 = (int)(dx2 >> 1);
+	m_bTrueColour = bEnable;
+	BindTarget();
 
-	if (y1 == y2) goto next;
+	return true;
+}
 
-	e1 = (int)(dx1 >> 1);
+void ConsoleGameEngine::SetSynchronizedOutput(bool bEnable)
+{
+	m_bSynchronizedOutput = bEnable;
+}
 
-	for (int i = 0; i < dx1;)
-	{
-		t1xp = 0;
-		t2xp = 0;
+void ConsoleGameEngine::SetPresentDegrade(bool bEnable)
+{
+	m_bPresentDegrade = bEnable;
+}
 
-		if (t1x < t2x)
-		{
-			minx = t1x;
-			maxx = t2x;
-		}
-		else
-		{
-			minx = t2x;
-			maxx = t1x;
-		}
+PresentStats ConsoleGameEngine::GetPresentStats() const
+{
+	std::lock_guard<std::mutex> lock(m_muxPresent);
+	return m_presentStats;
+}
 
-		while (i < dx1)
-		{
-			i++;
-			e1 += dy1;
+FrameArena& ConsoleGameEngine::GetFrameArena()
+{
+	return m_frameArena;
+}
 
-			while (e1 >= dx1)
-			{
-				e1 -= dx1;
+const AllocationStats& ConsoleGameEngine::GetAllocationStats() const
+{
+	return m_allocationStats;
+}
 
-				if (changed1)
-					t1xp = signx1;
-				else
-					goto next1;
-			}
+bool ConsoleGameEngine::IsTrueColour() const
+{
+	return m_bTrueColour;
+}
 
-			if (changed1)
-				break;
-			else
-				t1x += signx1;
-		}
+void ConsoleGameEngine::DrawRaycaster(Raycaster& raycaster, float px, float py, float fAngle)
+{
+	raycaster.Render(m_pTarget, m_nTargetWidth, m_nTargetHeight, px, py, fAngle, &GetThreadPool());
 
-	next1:
-		while (1)
-		{
-			e2 += dy2;
-			while (e2 >= dx2)
-			{
-				e2 -= dx2;
-				if (changed2)
-					t2xp = signx2;
-				else
-					goto next2;
-			}
-			if (changed2)
-				break;
-			else
-				t2x += signx2;
-		}
+	if (m_pTargetLayer)
+		MarkDirty(0, 0, m_nScreenWidth - 1, m_nScreenHeight - 1);
+	else if (m_pTargetColours)
+		std::fill(m_pTargetColours, m_pTargetColours + m_nTargetWidth * m_nTargetHeight, CellColour{ EXT_COLOUR_NONE, EXT_COLOUR_NONE });
+}
 
-	next2:
-		if (minx > t1x)
-			minx = t1x;
+void ConsoleGameEngine::DrawBillboard(const Raycaster& raycaster, float x, float y, const Sprite* sprite, float fScale)
+{
+	raycaster.DrawBillboard(m_pTarget, m_nTargetWidth, m_nTargetHeight, x, y, sprite, fScale, m_pTargetColours);
 
-		if (minx > t2x)
-			minx = t2x;
+	// The projected size isn't known here, so the whole layer is recomposited
+	if (m_pTargetLayer)
+		MarkDirty(0, 0, m_nScreenWidth - 1, m_nScreenHeight - 1);
+}
 
-		if (maxx < t1x)
-			maxx = t1x;
+void ConsoleGameEngine::DrawMesh(Renderer3D& renderer, const Mesh& mesh, const Mat4& matModel, short col, bool bLit, wchar_t c)
+{
+	if (renderer.Width() != m_nTargetWidth || renderer.Height() != m_nTargetHeight)
+		renderer.Resize(m_nTargetWidth, m_nTargetHeight);
 
-		if (maxx < t2x)
-			maxx = t2x;
+	renderer.DrawMesh(m_pTarget, mesh, matModel, col, bLit, c, &GetThreadPool());
 
-		drawline(minx, maxx, y);
+	if (m_pTargetLayer)
+		MarkDirty(0, 0, m_nScreenWidth - 1, m_nScreenHeight - 1);
+	else if (m_pTargetColours)
+		std::fill(m_pTargetColours, m_pTargetColours + m_nTargetWidth * m_nTargetHeight, CellColour{ EXT_COLOUR_NONE, EXT_COLOUR_NONE });
+}
 
-		if (!changed1)
-			t1x += signx1;
+bool ConsoleGameEngine::StartRecording(const std::wstring& sFileName)
+{
+	if (!m_pRecorder)
+		m_pRecorder = new FrameRecorder;
 
-		t1x += t1xp;
+	return m_pRecorder->Start(sFileName);
+}
 
-		if (!changed2)
-			t2x += signx2;
+bool ConsoleGameEngine::StopRecording()
+{
+	return m_pRecorder ? m_pRecorder->Stop() : true;
+}
 
-		t2x += t2xp;
-		y += 1;
+bool ConsoleGameEngine::IsRecording() const
+{
+	return m_pRecorder && m_pRecorder->IsRecording();
+}
 
-		if (y == y2)
-			break;
+void ConsoleGameEngine::DrawRecording(const FramePlayer& player)
+{
+	BlitCells(0, 0, player.Frame(), player.Width(), player.Height(), false);
+}
 
-	}
+void ConsoleGameEngine::EnableRewind(bool bEnable)
+{
+	if (bEnable)
+		GetRewindBuffer();
 
-next:
-	dx1 = x3 - x2;
+	m_bRewind = bEnable;
+}
 
-	if (dx1 < 0)
-	{
-		dx1 = -dx1;
-		signx1 = -1;
-	}
-	else
-		signx1 = 1;
+RewindBuffer& ConsoleGameEngine::GetRewindBuffer()
+{
+	if (!m_pRewind)
+		m_pRewind = new RewindBuffer;
 
-	dy1 = y3 - y2;
-	t1x = x2;
+	return *m_pRewind;
+}
 
-	if (dy1 > dx1)
-	{
-		std::swap(dy1, dx1);
-		changed1 = true;
-	}
-	else
-		changed1 = false;
+void ConsoleGameEngine::DrawRewind(const RewindBuffer& rewind)
+{
+	BlitCells(0, 0, rewind.Frame(), rewind.Width(), rewind.Height(), false);
+}
 
-	e1 = (int)(dx1 >> 1);
+bool ConsoleGameEngine::WatchAssets(const std::wstring& sDirectory)
+{
+	if (!m_pWatcher)
+		m_pWatcher = new AssetWatcher;
 
-	for (int i = 0; i <= dx1; i++)
+	return m_pWatcher->Start(sDirectory);
+}
+
+void ConsoleGameEngine::StopWatchingAssets()
+{
+	if (m_pWatcher)
+		m_pWatcher->Stop();
+}
+
+void ConsoleGameEngine::TrackSprite(Sprite* sprite, const std::wstring& sFileName)
+{
+	if (!m_pWatcher)
+		m_pWatcher = new AssetWatcher;
+
+	m_pWatcher->TrackSprite(sprite, sFileName);
+}
+
+void ConsoleGameEngine::UntrackSprite(Sprite* sprite)
+{
+	if (m_pWatcher)
+		m_pWatcher->UntrackSprite(sprite);
+}
+
+void ConsoleGameEngine::TrackAsset(const std::wstring& sFileName, std::function<void()> fnReload)
+{
+	if (!m_pWatcher)
+		m_pWatcher = new AssetWatcher;
+
+	m_pWatcher->TrackFile(sFileName, std::move(fnReload));
+}
+
+TimerId ConsoleGameEngine::ScheduleTimer(float fDelay, std::function<void()> fnCallback, float fRepeat)
+{
+	return GetTimers().Schedule(fDelay, std::move(fnCallback), fRepeat);
+}
+
+bool ConsoleGameEngine::CancelTimer(TimerId id)
+{
+	return m_pTimers && m_pTimers->Cancel(id);
+}
+
+TimerWheel& ConsoleGameEngine::GetTimers()
+{
+	if (!m_pTimers)
+		m_pTimers = new TimerWheel;
+
+	return *m_pTimers;
+}
+
+#ifdef CONSOLE_GAME_ENGINE_COROUTINES
+void ConsoleGameEngine::StartScript(Script script)
+{
+	GetScriptScheduler().Start(std::move(script));
+}
+
+ScriptScheduler& ConsoleGameEngine::GetScriptScheduler()
+{
+	if (!m_pScripts)
+		m_pScripts = new ScriptScheduler;
+
+	return *m_pScripts;
+}
+#endif
+
+#ifdef CONSOLE_GAME_ENGINE_STREAMING
+bool ConsoleGameEngine::StartStreaming(const std::string& sPath)
+{
+	if (!m_pServer)
+		m_pServer = new FrameServer;
+
+	return m_pServer->Start(sPath);
+}
+
+void ConsoleGameEngine::StopStreaming()
+{
+	if (m_pServer)
+		m_pServer->Stop();
+}
+
+bool ConsoleGameEngine::IsStreaming() const
+{
+	return m_pServer && m_pServer->IsRunning();
+}
+
+void ConsoleGameEngine::DrawStream(const FrameStreamClient& client)
+{
+	BlitCells(0, 0, client.Frame(), client.Width(), client.Height(), false);
+}
+#endif
+
+void ConsoleGameEngine::BlitCells(int x, int y, const CHAR_INFO* pCells, int nWidth, int nHeight, bool bAlpha)
+{
+	int x1 = std::max(x, 0);
+	int y1 = std::max(y, 0);
+	int x2 = std::min(x + nWidth, m_nTargetWidth);
+	int y2 = std::min(y + nHeight, m_nTargetHeight);
+
+	if (x1 >= x2 || y1 >= y2 || !pCells)
+		return;
+
+	for (int dy = y1; dy < y2; dy++)
 	{
-		t1xp = 0;
-		t2xp = 0;
+		const CHAR_INFO* pSrc = pCells + (dy - y) * nWidth - x;
+		CHAR_INFO* pDst = m_pTarget + dy * m_nTargetWidth;
 
-		if (t1x < t2x)
-		{
-			minx = t1x;
-			maxx = t2x;
-		}
-		else
+		if (!bAlpha)
 		{
-			minx = t2x;
-			maxx = t1x;
+			memcpy(pDst + x1, pSrc + x1, (x2 - x1) * sizeof(CHAR_INFO));
+
+			if (m_pTargetColours)
+				std::fill(m_pTargetColours + dy * m_nTargetWidth + x1, m_pTargetColours + dy * m_nTargetWidth + x2, CellColour{ EXT_COLOUR_NONE, EXT_COLOUR_NONE });
+
+			continue;
 		}
 
-		while (i < dx1)
+		for (int dx = x1; dx < x2; dx++)
 		{
-			e1 += dy1;
-
-			while (e1 >= dx1)
-			{
-				e1 -= dx1;
-				if (changed1)
-				{
-					t1xp = signx1;
-					break;
-				}
-				else
-					goto next3;
-			}
+			if (pSrc[dx].Char.UnicodeChar == L' ')
+				continue;
 
-			if (changed1)
-				break;
-			else
-				t1x += signx1;
+			pDst[dx] = pSrc[dx];
 
-			if (i < dx1)
-				i++;
+			if (m_pTargetColours)
+				m_pTargetColours[dy * m_nTargetWidth + dx] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
 		}
+	}
 
-	next3:
-		while (t2x != x3)
-		{
-			e2 += dy2;
+	if (m_pTargetLayer)
+		MarkDirty(x1, y1, x2 - 1, y2 - 1);
+}
+
+ThreadPool& ConsoleGameEngine::GetThreadPool()
+{
+	if (!m_pThreadPool)
+		m_pThreadPool = new ThreadPool();
+
+	return *m_pThreadPool;
+}
+
+void ConsoleGameEngine::DrawParticles(const ParticleSystem& particles)
+{
+	SMALL_RECT rTouched;
+	particles.Render(m_pTarget, m_nTargetWidth, m_nTargetHeight, rTouched, m_pTargetColours);
 
-			while (e2 >= dx2)
-			{
-				e2 -= dx2;
+	if (m_pTargetLayer && rTouched.Right >= rTouched.Left)
+		MarkDirty(rTouched.Left, rTouched.Top, rTouched.Right, rTouched.Bottom);
+}
 
-				if (changed2)
-					t2xp = signx2;
-				else
-					goto next4;
-			}
+void ConsoleGameEngine::DrawRGBBuffer(int x, int y, int w, int h, const uint32_t* pPixels, bool bDither)
+{
+	if (!pPixels)
+		return;
 
-			if (changed2)
-				break;
-			else
-				t2x += signx2;
-		}
+	int sx = std::max(0, -x);
+	int sy = std::max(0, -y);
+	int ex = std::min(w, m_nTargetWidth - x);
+	int ey = std::min(h, m_nTargetHeight - y);
 
-	next4:
-		if (minx > t1x)
-			minx = t1x;
+	if (sx >= ex || sy >= ey)
+		return;
 
-		if (minx > t2x)
-			minx = t2x;
+	if (!m_pQuantizer)
+		m_pQuantizer = new ColourQuantizer();
 
-		if (maxx < t1x)
-			maxx = t1x;
+	// Roughly the distance between two neighbouring shade mixes of the default palette
+	const int nDitherAmount = bDither ? 48 : 0;
 
-		if (maxx < t2x)
-			maxx = t2x;
+	m_pQuantizer->Convert(pPixels + sy * w + sx, ex - sx, ey - sy, w,
+		m_pTarget + (y + sy) * m_nTargetWidth + x + sx, m_nTargetWidth, x + sx, y + sy, nDitherAmount);
 
-		drawline(minx, maxx, y);
+	if (m_pTargetLayer)
+		MarkDirty(x + sx, y + sy, x + ex - 1, y + ey - 1);
+	else if (m_pTargetColours)
+	{
+		for (int j = y + sy; j < y + ey; j++)
+			for (int i = x + sx; i < x + ex; i++)
+				m_pTargetColours[j * m_nTargetWidth + i] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+	}
+}
 
-		if (!changed1)
-			t1x += signx1;
+int ConsoleGameEngine::CreateLayer(int nZ)
+{
+	Layer* layer = new Layer;
+	layer->nZ = nZ;
 
-		t1x += t1xp;
+	size_t nTiles = size_t((m_nScreenWidth + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE) * size_t((m_nScreenHeight + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE);
 
-		if (!changed2)
-			t2x += signx2;
+	layer->vecCells.resize((size_t)m_nScreenWidth * (size_t)m_nScreenHeight, { layer->cAlpha, 0 });
+	layer->vecDirty.resize(nTiles, 0);
 
-		t2x += t2xp;
-		y += 1;
+	m_vecLayers.push_back(layer);
 
-		if (y > y3)
-			return;
-	}
+	// Equal z values keep the creation order
+	m_vecLayerOrder.insert(std::upper_bound(m_vecLayerOrder.begin(), m_vecLayerOrder.end(), layer,
+		[](const Layer* lhs, const Layer* rhs) { return lhs->nZ > rhs->nZ; }), layer);
+
+	m_bLayersChanged = true;
+
+	return int(m_vecLayers.size() - 1);
 }
 
-void ConsoleGameEngine::DrawRectangle(int x, int y, int sx, int sy, wchar_t c, short col)
+void ConsoleGameEngine::SetDrawLayer(int nLayer)
 {
-	for (int i = 0; i <= sx; i++)
-	{
-		Draw(x + i, y, c, col);
-		Draw(x + i, y + sy, c, col);
-	}
+	m_nTargetLayer = nLayer >= 0 && nLayer < (int)m_vecLayers.size() ? nLayer : SCREEN_LAYER;
+	m_pTargetSurface = nullptr;
 
-	for (int j = 0; j <= sy; j++)
-	{
-		Draw(x, y + j, c, col);
-		Draw(x + sx, y + j, c, col);
-	}
+	BindTarget();
 }
 
-void ConsoleGameEngine::DrawSprite(int x, int y, Sprite* sprite)
+int ConsoleGameEngine::GetDrawLayer() const
 {
-	if (!sprite)
-		return;
+	return m_nTargetLayer;
+}
 
-	for (int i = 0; i < sprite->nWidth; i++)
-		for (int j = 0; j < sprite->nHeight; j++)
-			Draw(x + i, y + j, sprite->GetGlyph(i, j), sprite->GetColour(i, j));
+void ConsoleGameEngine::SetDrawTarget(Surface* pSurface)
+{
+	m_pTargetSurface = pSurface;
+	BindTarget();
 }
 
-void ConsoleGameEngine::DrawSpriteAlpha(int x, int y, Sprite* sprite)
+Surface* ConsoleGameEngine::GetDrawTarget() const
 {
-	if (!sprite)
-		return;
+	return m_pTargetSurface;
+}
 
-	for (int i = 0; i < sprite->nWidth; i++)
-		for (int j = 0; j < sprite->nHeight; j++)
-			if (sprite->GetGlyph(i, j) != L' ')
-				Draw(x + i, y + j, sprite->GetGlyph(i, j), sprite->GetColour(i, j) | sprite->GetColour(i, j) * 16);
+int ConsoleGameEngine::TargetWidth() const
+{
+	return m_nTargetWidth;
 }
 
-void ConsoleGameEngine::DrawPartialSprite(int x, int y, int fx, int fy, int fw, int fh, Sprite* sprite)
+int ConsoleGameEngine::TargetHeight() const
 {
-	if (!sprite)
-		return;
+	return m_nTargetHeight;
+}
 
-	for (int i = fx, x1 = 0; i < fx + fw; i++, x1++)
-		for (int j = fy, y1 = 0; j < fy + fh; j++, y1++)
-			Draw(x + x1, y + y1, sprite->GetGlyph(i, j), sprite->GetColour(i, j) | sprite->GetColour(i, j) * 16);
+void ConsoleGameEngine::DrawSurface(int x, int y, const Surface& surface)
+{
+	BlitCells(x, y, surface.Cells(), surface.nWidth, surface.nHeight, false);
 }
 
-void ConsoleGameEngine::DrawPartialSpriteAlpha(int x, int y, int fx, int fy, int fw, int fh, Sprite* sprite)
+void ConsoleGameEngine::DrawSurfaceAlpha(int x, int y, const Surface& surface)
+{
+	BlitCells(x, y, surface.Cells(), surface.nWidth, surface.nHeight, true);
+}
+
+void ConsoleGameEngine::BindTarget()
 {
-	if (!sprite)
+	if (m_pTargetSurface)
+	{
+		m_pTarget = m_pTargetSurface->Cells();
+		m_pTargetColours = nullptr;
+		m_nTargetWidth = m_pTargetSurface->nWidth;
+		m_nTargetHeight = m_pTargetSurface->nHeight;
+		m_pTargetLayer = nullptr;
 		return;
+	}
 
-	for (int i = fx, x1 = 0; i < fx + fw; i++, x1++)
-		for (int j = fy, y1 = 0; j < fy + fh; j++, y1++)
-		{
-			if (sprite->GetGlyph(i, j) != L' ')
-				Draw(x + x1, y + y1, sprite->GetGlyph(i, j), sprite->GetColour(i, j) | sprite->GetColour(i, j) * 16);
-		}
+	m_nTargetWidth = m_nScreenWidth;
+	m_nTargetHeight = m_nScreenHeight;
+
+	if (m_nTargetLayer != SCREEN_LAYER)
+	{
+		m_pTargetLayer = m_vecLayers[m_nTargetLayer];
+		m_pTarget = m_pTargetLayer->vecCells.data();
+		m_pTargetColours = nullptr;
+	}
+	else
+	{
+		m_pTargetLayer = nullptr;
+		m_pTarget = m_pScreen;
+		m_pTargetColours = m_pColours;
+	}
 }
 
-void ConsoleGameEngine::DrawWireFrameModel(const std::vector<std::pair<float, float>>& model, float x, float y, float r, float s, wchar_t c, short col)
+void ConsoleGameEngine::SetLayerVisible(int nLayer, bool bVisible)
 {
-	size_t nVerts = model.size();
-	std::vector<std::pair<float, float>> vecTransformed(nVerts);
-
-	for (size_t i = 0; i < nVerts; i++)
+	if (nLayer >= 0 && nLayer < (int)m_vecLayers.size() && m_vecLayers[nLayer]->bVisible != bVisible)
 	{
-		vecTransformed[i].first = (model[i].first * cos(r) - model[i].second * sin(r)) * s + x;
-		vecTransformed[i].second = (model[i].first * sin(r) + model[i].second * cos(r)) * s + y;
+		m_vecLayers[nLayer]->bVisible = bVisible;
+		m_bLayersChanged = true;
 	}
+}
 
-	for (size_t i = 0; i <= nVerts; i++)
+void ConsoleGameEngine::SetLayerZ(int nLayer, int nZ)
+{
+	if (nLayer >= 0 && nLayer < (int)m_vecLayers.size() && m_vecLayers[nLayer]->nZ != nZ)
 	{
-		size_t j = i + 1;
+		m_vecLayers[nLayer]->nZ = nZ;
 
-		DrawLine((int)vecTransformed[i % nVerts].first, (int)vecTransformed[i % nVerts].second,
-				 (int)vecTransformed[j % nVerts].first, (int)vecTransformed[j % nVerts].second, c, col);
+		std::stable_sort(m_vecLayerOrder.begin(), m_vecLayerOrder.end(),
+			[](const Layer* lhs, const Layer* rhs) { return lhs->nZ > rhs->nZ; });
+
+		m_bLayersChanged = true;
 	}
 }
 
-void ConsoleGameEngine::DrawString(int x, int y, const std::wstring& text, short col)
+void ConsoleGameEngine::SetLayerAlphaGlyph(int nLayer, wchar_t c)
 {
-	if (x + text.size() < ScreenWidth() && x >= 0 && y >= 0 && y < ScreenHeight())
+	if (nLayer >= 0 && nLayer < (int)m_vecLayers.size() && m_vecLayers[nLayer]->cAlpha != c)
 	{
-		for (size_t i = 0; i < text.size(); i++)
+		Layer* layer = m_vecLayers[nLayer];
+
+		for (auto& cell : layer->vecCells)
 		{
-			m_pScreen[y * m_nScreenWidth + x + i].Char.UnicodeChar = text[i];
-			m_pScreen[y * m_nScreenWidth + x + i].Attributes = col;
+			if (cell.Char.UnicodeChar == layer->cAlpha)
+				cell.Char.UnicodeChar = c;
 		}
+
+		layer->cAlpha = c;
+		m_bLayersChanged = true;
 	}
 }
 
-void ConsoleGameEngine::Clear(wchar_t c, short col)
+void ConsoleGameEngine::ClearLayer(int nLayer)
+{
+	if (nLayer >= 0 && nLayer < (int)m_vecLayers.size())
+	{
+		Layer* layer = m_vecLayers[nLayer];
+
+		std::fill(layer->vecCells.begin(), layer->vecCells.end(), CHAR_INFO{ { layer->cAlpha }, 0 });
+		std::fill(layer->vecDirty.begin(), layer->vecDirty.end(), 1);
+	}
+}
+
+void ConsoleGameEngine::MarkDirty(int x1, int y1, int x2, int y2)
+{
+	int nTilesX = (m_nScreenWidth + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE;
+
+	for (int ty = y1 / LAYER_TILE_SIZE; ty <= y2 / LAYER_TILE_SIZE; ty++)
+		for (int tx = x1 / LAYER_TILE_SIZE; tx <= x2 / LAYER_TILE_SIZE; tx++)
+			m_pTargetLayer->vecDirty[ty * nTilesX + tx] = 1;
+}
+
+void ConsoleGameEngine::CompositeLayers()
 {
-	FillRectangle(0, 0, m_nScreenWidth, m_nScreenHeight, c, col);
+	if (m_vecLayers.empty())
+		return;
+
+	int nTilesX = (m_nScreenWidth + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE;
+	int nTilesY = (m_nScreenHeight + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE;
+
+	for (int ty = 0; ty < nTilesY; ty++)
+		for (int tx = 0; tx < nTilesX; tx++)
+		{
+			int nTile = ty * nTilesX + tx;
+			bool bDirty = m_bLayersChanged;
+
+			for (auto layer : m_vecLayers)
+			{
+				bDirty |= layer->vecDirty[nTile] != 0;
+				layer->vecDirty[nTile] = 0;
+			}
+
+			if (!bDirty)
+				continue;
+
+			int ex = std::min((tx + 1) * LAYER_TILE_SIZE, m_nScreenWidth);
+			int ey = std::min((ty + 1) * LAYER_TILE_SIZE, m_nScreenHeight);
+
+			for (int y = ty * LAYER_TILE_SIZE; y < ey; y++)
+				for (int x = tx * LAYER_TILE_SIZE; x < ex; x++)
+				{
+					int i = y * m_nScreenWidth + x;
+					CHAR_INFO cell = { { L' ' }, 0 };
+
+					// Search from the top so covered cells of lower layers are never read
+					for (auto layer : m_vecLayerOrder)
+					{
+						if (layer->bVisible && layer->vecCells[i].Char.UnicodeChar != layer->cAlpha)
+						{
+							cell = layer->vecCells[i];
+							break;
+						}
+					}
+
+					m_pScreen[i] = cell;
+
+					if (m_pColours)
+						m_pColours[i] = { EXT_COLOUR_NONE, EXT_COLOUR_NONE };
+				}
+		}
+
+	m_bLayersChanged = false;
 }
 
 int ConsoleGameEngine::GetMouseX() const
@@ -1064,6 +9343,122 @@ int ConsoleGameEngine::ScreenHeight() const
 	return m_nScreenHeight;
 }
 
+const CHAR_INFO* ConsoleGameEngine::ScreenBuffer() const
+{
+	return m_pScreen;
+}
+
+namespace detail
+{
+	// Lays the rows of a w1 x h1 grid out as w2 x h2 in the same buffer, which must hold both,
+	// keeping the overlapping cells and filling the rest with blank
+	template <typename T>
+	void ReflowCells(T* pCells, int w1, int h1, int w2, int h2, const T& blank)
+	{
+		int nRows = std::min(h1, h2);
+		int nCols = std::min(w1, w2);
+
+		// Wider rows move forward so go backwards to not overwrite rows that haven't moved yet
+		if (w2 > w1)
+		{
+			for (int y = nRows - 1; y >= 0; y--)
+			{
+				memmove(pCells + y * w2, pCells + y * w1, nCols * sizeof(T));
+				std::fill(pCells + y * w2 + nCols, pCells + (y + 1) * w2, blank);
+			}
+		}
+		else
+		{
+			for (int y = 0; y < nRows; y++)
+				memmove(pCells + y * w2, pCells + y * w1, nCols * sizeof(T));
+		}
+
+		std::fill(pCells + nRows * w2, pCells + h2 * w2, blank);
+	}
+}
+
+bool ConsoleGameEngine::ResizeScreen(int nWidth, int nHeight)
+{
+	if (!m_pScreen || nWidth <= 0 || nHeight <= 0 || nWidth > SHRT_MAX || nHeight > SHRT_MAX)
+		return false;
+
+	if (nWidth == m_nScreenWidth && nHeight == m_nScreenHeight)
+		return true;
+
+	int nOldWidth = m_nScreenWidth;
+	int nOldHeight = m_nScreenHeight;
+
+	size_t nOldCells = (size_t)nOldWidth * (size_t)nOldHeight;
+	size_t nCells = (size_t)nWidth * (size_t)nHeight;
+
+	if (nCells > m_nScreenCapacity)
+	{
+		// Dragging a window edge sends many events, growing by half at a time keeps reallocations rare
+		size_t nCapacity = std::max(nCells, m_nScreenCapacity + m_nScreenCapacity / 2);
+
+		CHAR_INFO* pScreen = new CHAR_INFO[nCapacity];
+		memcpy(pScreen, m_pScreen, nOldCells * sizeof(CHAR_INFO));
+
+		delete[] m_pScreen;
+		m_pScreen = pScreen;
+
+		if (m_pColours)
+		{
+			CellColour* pColours = new CellColour[nCapacity];
+			memcpy(pColours, m_pColours, nOldCells * sizeof(CellColour));
+
+			delete[] m_pColours;
+			m_pColours = pColours;
+		}
+
+		m_nScreenCapacity = nCapacity;
+	}
+
+	detail::ReflowCells(m_pScreen, nOldWidth, nOldHeight, nWidth, nHeight, CHAR_INFO{ { L' ' }, 0 });
+
+	if (m_pColours)
+		detail::ReflowCells(m_pColours, nOldWidth, nOldHeight, nWidth, nHeight, CellColour{ EXT_COLOUR_NONE, EXT_COLOUR_NONE });
+
+	ResizeLayers(nOldWidth, nOldHeight, nWidth, nHeight);
+
+	m_nScreenWidth = nWidth;
+	m_nScreenHeight = nHeight;
+
+	m_rWindow = { 0, 0, short(m_nScreenWidth - 1), short(m_nScreenHeight - 1) };
+
+	if (!m_bOffscreen)
+		SetConsoleWindowInfo(m_hConsoleOut, TRUE, &m_rWindow);
+
+	BindTarget();
+	m_bFullRedraw = true;
+
+	if (!OnUserResize(m_nScreenWidth, m_nScreenHeight))
+		m_bGameThreadActive = false;
+
+	return true;
+}
+
+void ConsoleGameEngine::ResizeLayers(int nOldWidth, int nOldHeight, int nWidth, int nHeight)
+{
+	if (m_vecLayers.empty())
+		return;
+
+	size_t nOldCells = (size_t)nOldWidth * (size_t)nOldHeight;
+	size_t nCells = (size_t)nWidth * (size_t)nHeight;
+	size_t nTiles = size_t((nWidth + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE) * size_t((nHeight + LAYER_TILE_SIZE - 1) / LAYER_TILE_SIZE);
+
+	for (auto layer : m_vecLayers)
+	{
+		layer->vecCells.resize(std::max(nOldCells, nCells));
+		detail::ReflowCells(layer->vecCells.data(), nOldWidth, nOldHeight, nWidth, nHeight, CHAR_INFO{ { layer->cAlpha }, 0 });
+		layer->vecCells.resize(nCells);
+
+		layer->vecDirty.assign(nTiles, 1);
+	}
+
+	m_bLayersChanged = true;
+}
+
 void ConsoleGameEngine::AppThread()
 {
 	if (!OnUserCreate())
@@ -1080,14 +9475,35 @@ void ConsoleGameEngine::AppThread()
 		for (int i = 0; i < 5; i++)
 			m_aryMouse[i] = { false, false, false };
 
+		m_bPresentActive = true;
+		m_thrPresent = std::thread(&ConsoleGameEngine::PresentThread, this);
+
 		while (m_bGameThreadActive)
 		{
+#ifdef CONSOLE_GAME_ENGINE_COUNT_ALLOCATIONS
+			uint64_t nAllocations = detail::g_nAllocations;
+			uint64_t nFrees = detail::g_nFrees;
+			uint64_t nBytes = detail::g_nAllocatedBytes;
+#endif
+
 			tp2 = std::chrono::system_clock::now();
 			std::chrono::duration<float> elapsedTime = tp2 - tp1;
 			tp1 = tp2;
 
 			m_fDeltaTime = elapsedTime.count();
 
+			// Frame boundary, nothing is being drawn
+			if (m_pWatcher)
+				m_pWatcher->Apply();
+
+			if (m_pTimers)
+				m_pTimers->Update(m_fDeltaTime);
+
+#ifdef CONSOLE_GAME_ENGINE_COROUTINES
+			if (m_pScripts)
+				m_pScripts->Update(m_fDeltaTime, m_aryKeys);
+#endif
+
 			wchar_t title[256];
 			swprintf_s(title, 256, L"github.com/defini7 - Console Game Engine - %s - FPS: %3.2f", sAppName.c_str(), 1.0f / m_fDeltaTime);
 			SetConsoleTitleW(title);
@@ -1113,8 +9529,8 @@ void ConsoleGameEngine::AppThread()
 
 				case WINDOW_BUFFER_SIZE_EVENT:
 				{
-					m_nScreenWidth = (int)inBuf[i].Event.WindowBufferSizeEvent.dwSize.X;
-					m_nScreenHeight = (int)inBuf[i].Event.WindowBufferSizeEvent.dwSize.Y;
+					ResizeScreen((int)inBuf[i].Event.WindowBufferSizeEvent.dwSize.X,
+						(int)inBuf[i].Event.WindowBufferSizeEvent.dwSize.Y);
 				}
 				break;
 
@@ -1193,8 +9609,171 @@ void ConsoleGameEngine::AppThread()
 				m_bMouseOldState[i] = m_bMouseNewState[i];
 			}
 
-			WriteConsoleOutputW(m_hConsoleOut, m_pScreen, { (short)m_nScreenWidth, (short)m_nScreenHeight }, { 0, 0 }, &m_rWindow);
+			CompositeLayers();
+
+			if (m_pRecorder)
+				m_pRecorder->Capture(m_pScreen, m_nScreenWidth, m_nScreenHeight, m_fDeltaTime);
+
+			if (m_bRewind && !m_pRewind->IsSeeking())
+				m_pRewind->Capture(m_pScreen, m_nScreenWidth, m_nScreenHeight, m_fDeltaTime);
+
+#ifdef CONSOLE_GAME_ENGINE_STREAMING
+			if (m_pServer)
+				m_pServer->Publish(m_pScreen, m_nScreenWidth, m_nScreenHeight, m_fDeltaTime);
+#endif
+
+			Present();
+
+#ifdef CONSOLE_GAME_ENGINE_COUNT_ALLOCATIONS
+			m_allocationStats.nAllocations = detail::g_nAllocations - nAllocations;
+			m_allocationStats.nFrees = detail::g_nFrees - nFrees;
+			m_allocationStats.nBytes = detail::g_nAllocatedBytes - nBytes;
+#endif
+
+			m_allocationStats.nArenaBytes = m_frameArena.Used();
+			m_frameArena.Reset();
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(m_muxPresent);
+			m_bPresentActive = false;
+		}
+
+		m_cvPresent.notify_one();
+		m_thrPresent.join();
+	}
+}
+
+void ConsoleGameEngine::Present()
+{
+	std::lock_guard<std::mutex> lock(m_muxPresent);
+
+	if (m_bFramePending)
+		m_presentStats.nCoalesced++;
+
+	size_t nCells = (size_t)m_nScreenWidth * (size_t)m_nScreenHeight;
+
+	m_vecPendingCells.assign(m_pScreen, m_pScreen + nCells);
+
+	if (m_pColours)
+		m_vecPendingColours.assign(m_pColours, m_pColours + nCells);
+	else
+		m_vecPendingColours.clear();
+
+	m_nPendingWidth = m_nScreenWidth;
+	m_nPendingHeight = m_nScreenHeight;
+
+	// A full redraw has to happen even if the frame asking for it is coalesced
+	m_bPendingFullRedraw |= m_bFullRedraw;
+	m_bFullRedraw = false;
+
+	m_bFramePending = true;
+
+	float& fFrameTime = m_presentStats.fFrameTime;
+	fFrameTime = fFrameTime > 0.0f ? fFrameTime + (m_fDeltaTime - fFrameTime) * 0.1f : m_fDeltaTime;
+
+	m_cvPresent.notify_one();
+}
+
+void ConsoleGameEngine::PresentThread()
+{
+	// Seconds it takes to write one row, what degrading is based on
+	float fRowTime = 0.0f;
+	int nNextRow = 0;
+
+	while (true)
+	{
+		int nWidth, nHeight;
+		bool bFull, bBackpressure;
+		float fFrameTime;
+
+		{
+			std::unique_lock<std::mutex> lock(m_muxPresent);
+			m_cvPresent.wait(lock, [&]() { return m_bFramePending || !m_bPresentActive; });
+
+			// The last frame is still shown when stopping
+			if (!m_bFramePending)
+				break;
+
+			m_vecPresentCells.swap(m_vecPendingCells);
+			m_vecPresentColours.swap(m_vecPendingColours);
+
+			nWidth = m_nPendingWidth;
+			nHeight = m_nPendingHeight;
+			bFull = m_bPendingFullRedraw;
+			bBackpressure = m_presentStats.bBackpressure;
+			fFrameTime = m_presentStats.fFrameTime;
+
+			m_bPendingFullRedraw = false;
+			m_bFramePending = false;
 		}
+
+		if (nWidth <= 0 || nHeight <= 0)
+			continue;
+
+		int nRows = nHeight;
+
+		if (m_bPresentDegrade && bBackpressure && !bFull && fRowTime > 0.0f)
+			nRows = std::clamp(int(fFrameTime / fRowTime), 1, nHeight);
+
+		if (nRows == nHeight)
+			nNextRow = 0;
+
+		auto tp1 = std::chrono::steady_clock::now();
+
+		WriteFrame(m_vecPresentCells.data(), m_vecPresentColours.empty() ? nullptr : m_vecPresentColours.data(),
+			nWidth, nHeight, bFull, nNextRow, nRows);
+
+		float fTime = std::chrono::duration<float>(std::chrono::steady_clock::now() - tp1).count();
+
+		nNextRow = (nNextRow + nRows) % nHeight;
+		fRowTime = fRowTime > 0.0f ? fRowTime + (fTime / nRows - fRowTime) * 0.1f : fTime / nRows;
+
+		std::lock_guard<std::mutex> lock(m_muxPresent);
+
+		PresentStats& stats = m_presentStats;
+
+		stats.fPresentTime = stats.nPresented > 0 ? stats.fPresentTime + (fTime - stats.fPresentTime) * 0.1f : fTime;
+		stats.nPresented++;
+		stats.nRowsPerPresent = nRows;
+
+		// Some slack either way so it doesn't flip every frame near the limit
+		float fWholeFrame = fRowTime * nHeight;
+
+		if (!stats.bBackpressure && fWholeFrame > stats.fFrameTime * 1.25f)
+			stats.bBackpressure = true;
+		else if (stats.bBackpressure && fWholeFrame < stats.fFrameTime * 0.8f)
+			stats.bBackpressure = false;
+	}
+}
+
+void ConsoleGameEngine::WriteFrame(const CHAR_INFO* pCells, const CellColour* pColours, int nWidth, int nHeight, bool bFull, int nFirstRow, int nRows)
+{
+	if (pColours)
+	{
+		m_vtEncoder.SetSynchronized(m_bSynchronizedOutput);
+		m_vtEncoder.Encode(m_sVtFrame, pCells, pColours, nWidth, nHeight, bFull, nFirstRow, nRows);
+
+		if (m_sVtFrame.empty())
+			return;
+
+		DWORD nWritten;
+		WriteConsoleW(m_hConsoleOut, m_sVtFrame.c_str(), (DWORD)m_sVtFrame.size(), &nWritten, NULL);
+
+		return;
+	}
+
+	// Up to two bands when the rows wrap around the bottom
+	int nFirst = std::min(nRows, nHeight - nFirstRow);
+	int nBands[2][2] = { { nFirstRow, nFirst }, { 0, nRows - nFirst } };
+
+	for (auto& band : nBands)
+	{
+		if (band[1] <= 0)
+			continue;
+
+		SMALL_RECT rect = { 0, (short)band[0], short(nWidth - 1), short(band[0] + band[1] - 1) };
+		WriteConsoleOutputW(m_hConsoleOut, pCells, { (short)nWidth, (short)nHeight }, { 0, (short)band[0] }, &rect);
 	}
 }
 
@@ -0,0 +1,387 @@
+#define CONSOLE_GAME_ENGINE_IMPLEMENTATION
+#include "ConsoleGameEngine.hpp"
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <map>
+
+/**
+* Drawing primitive benchmarks. Every primitive is run against an offscreen screen (nothing is presented)
+* at a few screen sizes, fully inside the screen, partially clipped and fully clipped.
+*
+*	Usage: ConsoleGameEngineBenchmark [--filter text] [--min-time ms] [--json file] [--baseline file] [--threshold percent]
+*
+* --json writes the results so a later run can be compared against them with --baseline. The exit code is 1
+* if any benchmark got slower than the baseline by more than the threshold (10% by default).
+**/
+
+class BenchmarkEngine : public ConsoleGameEngine
+{
+protected:
+	virtual bool OnUserCreate() override
+	{
+		return true;
+	}
+
+	virtual bool OnUserUpdate(float fDeltaTime) override
+	{
+		return true;
+	}
+
+};
+
+struct Result
+{
+	std::string sName;
+
+	double dNsPerCall;
+	double dCellsPerSecond;
+
+	long long nCellsPerCall;
+};
+
+// Where a primitive lands relative to the screen
+struct Scenario
+{
+	const char* sName;
+
+	int x, y;
+	int w, h;
+};
+
+struct Options
+{
+	std::string sFilter;
+	std::string sJsonFile;
+	std::string sBaselineFile;
+
+	double dMinTime = 0.1;
+	double dThreshold = 10.0;
+};
+
+typedef std::function<void(BenchmarkEngine&, int)> DrawFunc;
+
+long long CountCells(BenchmarkEngine& engine, const DrawFunc& fnDraw)
+{
+	// Draw once into a blank screen and count what changed
+	engine.FillRectangle(0, 0, engine.ScreenWidth(), engine.ScreenHeight(), 0, 0);
+	fnDraw(engine, 0);
+
+	const CHAR_INFO* pScreen = engine.ScreenBuffer();
+	long long nCells = 0;
+
+	for (int i = 0; i < engine.ScreenWidth() * engine.ScreenHeight(); i++)
+	{
+		if (pScreen[i].Char.UnicodeChar != 0 || pScreen[i].Attributes != 0)
+			nCells++;
+	}
+
+	return nCells;
+}
+
+double TimeCalls(BenchmarkEngine& engine, const DrawFunc& fnDraw, int nCalls)
+{
+	auto tp1 = std::chrono::steady_clock::now();
+
+	for (int i = 0; i < nCalls; i++)
+		fnDraw(engine, i);
+
+	auto tp2 = std::chrono::steady_clock::now();
+
+	return std::chrono::duration<double>(tp2 - tp1).count();
+}
+
+Result Measure(BenchmarkEngine& engine, const std::string& sName, const DrawFunc& fnDraw, const Options& options)
+{
+	Result result;
+	result.sName = sName;
+	result.nCellsPerCall = CountCells(engine, fnDraw);
+
+	// Grow the batch until one run takes a tenth of the time budget
+	int nCalls = 1;
+
+	while (nCalls < (1 << 30) && TimeCalls(engine, fnDraw, nCalls) < options.dMinTime * 0.1)
+		nCalls *= 2;
+
+	// Median of the runs is less noisy than the mean
+	double dRuns[10];
+
+	for (int i = 0; i < 10; i++)
+		dRuns[i] = TimeCalls(engine, fnDraw, nCalls);
+
+	std::sort(dRuns, dRuns + 10);
+
+	double dSeconds = (dRuns[4] + dRuns[5]) * 0.5;
+
+	result.dNsPerCall = dSeconds * 1e9 / nCalls;
+	result.dCellsPerSecond = dSeconds > 0.0 ? (double)result.nCellsPerCall * nCalls / dSeconds : 0.0;
+
+	return result;
+}
+
+bool WriteJson(const std::string& sFileName, const std::vector<Result>& vecResults)
+{
+	FILE* f = fopen(sFileName.c_str(), "w");
+
+	if (!f)
+		return false;
+
+	fprintf(f, "{\n\t\"version\": 1,\n\t\"results\": [\n");
+
+	for (size_t i = 0; i < vecResults.size(); i++)
+	{
+		const Result& r = vecResults[i];
+
+		fprintf(f, "\t\t{ \"name\": \"%s\", \"ns_per_call\": %.3f, \"cells_per_call\": %lld, \"cells_per_second\": %.1f }%s\n",
+			r.sName.c_str(), r.dNsPerCall, r.nCellsPerCall, r.dCellsPerSecond, i + 1 < vecResults.size() ? "," : "");
+	}
+
+	fprintf(f, "\t]\n}\n");
+
+	return fclose(f) == 0;
+}
+
+// Reads back what WriteJson wrote, one result per line
+bool ReadJson(const std::string& sFileName, std::map<std::string, double>& mapNsPerCall)
+{
+	std::ifstream file(sFileName);
+
+	if (!file.is_open())
+		return false;
+
+	std::string sLine;
+
+	while (std::getline(file, sLine))
+	{
+		size_t nName = sLine.find("\"name\": \"");
+		size_t nTime = sLine.find("\"ns_per_call\": ");
+
+		if (nName == std::string::npos || nTime == std::string::npos)
+			continue;
+
+		nName += 9;
+
+		size_t nNameEnd = sLine.find('"', nName);
+
+		if (nNameEnd != std::string::npos)
+			mapNsPerCall[sLine.substr(nName, nNameEnd - nName)] = strtod(sLine.c_str() + nTime + 15, nullptr);
+	}
+
+	return true;
+}
+
+bool ParseOptions(int argc, char** argv, Options& options)
+{
+	for (int i = 1; i < argc; i++)
+	{
+		std::string sArg = argv[i];
+
+		if (i + 1 >= argc)
+			return false;
+
+		if (sArg == "--filter")
+			options.sFilter = argv[++i];
+		else if (sArg == "--min-time")
+			options.dMinTime = atof(argv[++i]) / 1000.0;
+		else if (sArg == "--json")
+			options.sJsonFile = argv[++i];
+		else if (sArg == "--baseline")
+			options.sBaselineFile = argv[++i];
+		else if (sArg == "--threshold")
+			options.dThreshold = atof(argv[++i]);
+		else
+			return false;
+	}
+
+	return true;
+}
+
+int main(int argc, char** argv)
+{
+	Options options;
+
+	if (!ParseOptions(argc, argv, options))
+	{
+		printf("Usage: %s [--filter text] [--min-time ms] [--json file] [--baseline file] [--threshold percent]\n", argv[0]);
+		return 2;
+	}
+
+	std::map<std::string, double> mapBaseline;
+
+	if (!options.sBaselineFile.empty() && !ReadJson(options.sBaselineFile, mapBaseline))
+	{
+		printf("Can't read baseline %s\n", options.sBaselineFile.c_str());
+		return 2;
+	}
+
+	const int nSizes[][2] = { { 80, 25 }, { 256, 240 }, { 640, 360 } };
+
+	std::vector<Result> vecResults;
+	bool bRegressed = false;
+
+	printf("%-44s %14s %14s %16s", "benchmark", "ns/call", "cells/call", "cells/s");
+	printf(mapBaseline.empty() ? "\n" : " %10s\n", "vs base");
+
+	for (auto& size : nSizes)
+	{
+		int nWidth = size[0], nHeight = size[1];
+
+		BenchmarkEngine engine;
+
+		if (engine.ConstructOffscreen(nWidth, nHeight) != RC_OK)
+			return 1;
+
+		// Primitives cover half the screen in each direction
+		int w = nWidth / 2, h = nHeight / 2;
+
+		const Scenario scenarios[] =
+		{
+			{ "inside", nWidth / 4, nHeight / 4, w, h },
+			{ "partial", nWidth - w / 2, nHeight - h / 2, w, h },
+			{ "outside", nWidth + 8, nHeight + 8, w, h }
+		};
+
+		Sprite sprite(w, h);
+		Sprite spriteAlpha(w, h);
+
+		for (int x = 0; x < w; x++)
+			for (int y = 0; y < h; y++)
+			{
+				sprite.SetGlyph(x, y, PIXEL_SOLID);
+				sprite.SetColour(x, y, short(1 + (x + y) % 15));
+
+				// A checkerboard makes half the cells transparent
+				spriteAlpha.SetGlyph(x, y, (x + y) % 2 ? wchar_t(PIXEL_HALF) : L' ');
+				spriteAlpha.SetColour(x, y, short(1 + (x * y) % 15));
+			}
+
+		IndexedSprite spriteIndexed;
+		spriteIndexed.FromSprite(sprite);
+
+		std::vector<std::pair<float, float>> vecModel;
+
+		for (int i = 0; i < 16; i++)
+		{
+			float fRadius = i % 2 ? 0.5f : 1.0f;
+			vecModel.push_back({ fRadius * cosf(i * 3.14159f / 8.0f), fRadius * sinf(i * 3.14159f / 8.0f) });
+		}
+
+		std::wstring sText(w, L'A');
+
+		for (int i = 0; i < w; i++)
+			sText[i] = wchar_t(L'!' + i % 90);
+
+		std::vector<std::pair<std::string, DrawFunc>> vecCases;
+
+		vecCases.push_back({ "Clear/full", [](BenchmarkEngine& e, int i) { e.Clear(PIXEL_SOLID, short(i & 15)); } });
+
+		for (auto& sc : scenarios)
+		{
+			std::string sSuffix = std::string("/") + sc.sName;
+
+			vecCases.push_back({ "Draw" + sSuffix, [sc](BenchmarkEngine& e, int i)
+				{
+					e.Draw(sc.x + i % sc.w, sc.y + (i / sc.w) % sc.h, PIXEL_SOLID, FG_WHITE);
+				} });
+
+			vecCases.push_back({ "FillRectangle" + sSuffix, [sc](BenchmarkEngine& e, int i)
+				{
+					e.FillRectangle(sc.x, sc.y, sc.w, sc.h, PIXEL_SOLID, short(1 + i % 15));
+				} });
+
+			vecCases.push_back({ "DrawLine" + sSuffix, [sc](BenchmarkEngine& e, int i)
+				{
+					e.DrawLine(sc.x, sc.y + i % sc.h, sc.x + sc.w - 1, sc.y + sc.h - 1 - i % sc.h, PIXEL_SOLID, FG_WHITE);
+				} });
+
+			vecCases.push_back({ "DrawCircle" + sSuffix, [sc](BenchmarkEngine& e, int i)
+				{
+					e.DrawCircle(sc.x + sc.w / 2, sc.y + sc.h / 2, std::min(sc.w, sc.h) / 2, PIXEL_SOLID, FG_WHITE);
+				} });
+
+			vecCases.push_back({ "FillCircle" + sSuffix, [sc](BenchmarkEngine& e, int i)
+				{
+					e.FillCircle(sc.x + sc.w / 2, sc.y + sc.h / 2, std::min(sc.w, sc.h) / 2, PIXEL_SOLID, FG_WHITE);
+				} });
+
+			vecCases.push_back({ "FillTriangle" + sSuffix, [sc](BenchmarkEngine& e, int i)
+				{
+					e.FillTriangle(sc.x, sc.y + sc.h - 1, sc.x + sc.w / 2, sc.y, sc.x + sc.w - 1, sc.y + sc.h - 1, PIXEL_SOLID, FG_WHITE);
+				} });
+
+			vecCases.push_back({ "DrawSprite" + sSuffix, [sc, &sprite](BenchmarkEngine& e, int i)
+				{
+					e.DrawSprite(sc.x, sc.y, &sprite);
+				} });
+
+			vecCases.push_back({ "DrawSpriteAlpha" + sSuffix, [sc, &spriteAlpha](BenchmarkEngine& e, int i)
+				{
+					e.DrawSpriteAlpha(sc.x, sc.y, &spriteAlpha);
+				} });
+
+			vecCases.push_back({ "DrawIndexedSprite" + sSuffix, [sc, &spriteIndexed](BenchmarkEngine& e, int i)
+				{
+					e.DrawSprite(sc.x, sc.y, spriteIndexed);
+				} });
+
+			vecCases.push_back({ "DrawPartialSprite" + sSuffix, [sc, &sprite](BenchmarkEngine& e, int i)
+				{
+					e.DrawPartialSprite(sc.x, sc.y, sc.w / 4, sc.h / 4, sc.w / 2, sc.h / 2, &sprite);
+				} });
+
+			vecCases.push_back({ "DrawSpriteTransformed" + sSuffix, [sc, &spriteAlpha](BenchmarkEngine& e, int i)
+				{
+					e.DrawSpriteTransformed(float(sc.x + sc.w / 2), float(sc.y + sc.h / 2), spriteAlpha, i * 0.01f, 0.75f, 0.75f, sc.w / 2.0f, sc.h / 2.0f);
+				} });
+
+			vecCases.push_back({ "DrawWireFrameModel" + sSuffix, [sc, &vecModel](BenchmarkEngine& e, int i)
+				{
+					e.DrawWireFrameModel(vecModel, float(sc.x + sc.w / 2), float(sc.y + sc.h / 2), i * 0.01f, float(std::min(sc.w, sc.h) / 2), PIXEL_SOLID, FG_WHITE);
+				} });
+
+			vecCases.push_back({ "DrawString" + sSuffix, [sc, &sText](BenchmarkEngine& e, int i)
+				{
+					e.DrawString(sc.x, sc.y + i % sc.h, sText, FG_WHITE);
+				} });
+		}
+
+		for (auto& c : vecCases)
+		{
+			// Names look like FillRectangle/256x240/partial
+			size_t nSlash = c.first.find('/');
+			std::string sName = c.first.substr(0, nSlash) + "/" + std::to_string(nWidth) + "x" + std::to_string(nHeight) + c.first.substr(nSlash);
+
+			if (!options.sFilter.empty() && sName.find(options.sFilter) == std::string::npos)
+				continue;
+
+			Result r = Measure(engine, sName, c.second, options);
+			vecResults.push_back(r);
+
+			printf("%-44s %14.1f %14lld %16.4g", r.sName.c_str(), r.dNsPerCall, r.nCellsPerCall, r.dCellsPerSecond);
+
+			auto it = mapBaseline.find(r.sName);
+
+			if (it != mapBaseline.end() && it->second > 0.0)
+			{
+				double dChange = (r.dNsPerCall / it->second - 1.0) * 100.0;
+
+				if (dChange > options.dThreshold)
+					bRegressed = true;
+
+				printf(" %+9.1f%%%s", dChange, dChange > options.dThreshold ? " slower" : "");
+			}
+
+			printf("\n");
+		}
+	}
+
+	if (!options.sJsonFile.empty() && !WriteJson(options.sJsonFile, vecResults))
+	{
+		printf("Can't write %s\n", options.sJsonFile.c_str());
+		return 2;
+	}
+
+	return bRegressed ? 1 : 0;
+}